@@ -0,0 +1,55 @@
+// Session captures written by keyboard.c (-w file) and read by replay.c.
+//
+// A capture is a capture_file_header followed by records, each a
+// capture_record and len bytes of data padded to CAPTURE_ALIGN, so the
+// file can be mmap'd and walked in place. CAPTURE_HOST and CAPTURE_DEVICE
+// records hold one whole USB/IP frame exactly as it went over the wire:
+// the header in network byte order with the setup packet, then OUT or IN
+// data and isochronous packet descriptors. OUT data that the server threw
+// away is recorded as zeros. Records of a connection are in order, but
+// every worker writes its own batches, so records of connections served
+// by different workers may be interleaved out of timestamp order.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "UNLKCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 8
+
+enum capture_type {
+	CAPTURE_OPEN = 1,	// data: the peer's name
+	CAPTURE_CLOSE,
+	CAPTURE_HOST,		// data: frame from the host
+	CAPTURE_DEVICE,		// data: frame from the device
+};
+
+struct capture_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} __attribute__((packed));
+
+struct capture_record {
+	uint64_t ts;		// CLOCK_MONOTONIC, ns
+	uint32_t conn;		// numbered from 1 in order of connection
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t len;
+	uint32_t reserved2;
+} __attribute__((packed));
+
+static inline size_t capture_record_size(const struct capture_record *rec) {
+	return sizeof(*rec) +
+		((rec->len + CAPTURE_ALIGN - 1) & ~(CAPTURE_ALIGN - 1));
+}
+
+static inline const char *capture_record_data(
+			const struct capture_record *rec) {
+	return (const char *)(rec + 1);
+}
+
+#endif // CAPTURE_H
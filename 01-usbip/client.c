@@ -0,0 +1,694 @@
+// Stand-in USB/IP client for benchmarking keyboard.c without vhci_hcd.
+//
+// Imports devices over TCP (or over socketpairs handed to a server that
+// the client starts itself), replays an enumeration sequence on each of
+// them, then keeps a window of interrupt IN URBs in flight and finally
+// unlinks whatever is left. Prints URBs/s and round-trip percentiles.
+// A server the client starts gets -n with the number of connections, so
+// that there is a bus ID for each, and -b, so that interrupt URBs are
+// answered right away instead of once per bInterval. A server reached over
+// TCP should be started with enough copies and -b for the same numbers.
+// If no URB completes for -t ms, the client says where each connection
+// got stuck and fails.
+//
+//   ./client -c 16 -e 100 -n 1000 -- ./keyboard -d devices/mouse.txt
+//   ./keyboard -n 4 -b & ./client -H 127.0.0.1 -c 4 -r enum.txt
+//
+// An enumeration sequence file has one control URB per line: the 8 setup
+// bytes in hex, followed by the OUT data stage if there is one. Lines
+// starting with # are ignored. Without -r the client replays the requests
+// Linux sends when it binds usbhid to a boot keyboard.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/usb/ch9.h>
+
+#include "client.h"
+#include "usbip.h"
+
+/*----------------------------------------------------------------------*/
+
+#define MAX_CONNS 256
+#define MAX_EVENTS 64
+#define MAX_PENDING 4096	// in-flight URBs per connection, power of two
+#define MAX_ENUM_URBS 256
+#define MAX_URB_DATA 1024
+#define RX_BUF_SIZE (64 * 1024)
+
+struct enum_urb {
+	unsigned char setup[8];
+	unsigned char data[MAX_URB_DATA];
+	unsigned int data_len;		// OUT data stage
+};
+
+// Set up by usbhid-like probing of a keyboard: device, configuration and
+// string descriptors, SET_CONFIGURATION, SET_IDLE, the HID report
+// descriptor and finally the LED state through SET_REPORT.
+struct enum_urb builtin_enum[] = {
+	{ { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 } },
+	{ { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 } },
+	{ { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0x09, 0x00 } },
+	{ { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xff, 0x00 } },
+	{ { 0x80, 0x06, 0x00, 0x03, 0x00, 0x00, 0xff, 0x00 } },
+	{ { 0x80, 0x06, 0x02, 0x03, 0x09, 0x04, 0xff, 0x00 } },
+	{ { 0x80, 0x06, 0x01, 0x03, 0x09, 0x04, 0xff, 0x00 } },
+	{ { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+	{ { 0x21, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+	{ { 0x81, 0x06, 0x00, 0x22, 0x00, 0x00, 0xff, 0x00 } },
+	{ { 0x21, 0x09, 0x00, 0x02, 0x00, 0x00, 0x01, 0x00 }, { 0x00 }, 1 },
+};
+
+struct enum_urb *enum_urbs = &builtin_enum[0];
+int num_enum_urbs = sizeof(builtin_enum) / sizeof(builtin_enum[0]);
+
+void load_enum(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen()");
+		exit(EXIT_FAILURE);
+	}
+
+	enum_urbs = calloc(MAX_ENUM_URBS, sizeof(*enum_urbs));
+	if (enum_urbs == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	num_enum_urbs = 0;
+
+	char line[4 * MAX_URB_DATA];
+	int lineno = 0;
+	while (fgets(&line[0], sizeof(line), f) != NULL) {
+		lineno++;
+		char *p = &line[0];
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (num_enum_urbs == MAX_ENUM_URBS) {
+			fprintf(stderr, "%s: too many URBs\n", path);
+			exit(EXIT_FAILURE);
+		}
+		struct enum_urb *urb = &enum_urbs[num_enum_urbs];
+		unsigned int len = 0;
+		while (true) {
+			char *end;
+			unsigned long byte = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+			if (byte > 0xff || len == 8 + MAX_URB_DATA) {
+				fprintf(stderr, "%s:%d: bad byte\n", path, lineno);
+				exit(EXIT_FAILURE);
+			}
+			if (len < 8)
+				urb->setup[len] = byte;
+			else
+				urb->data[len - 8] = byte;
+			len++;
+			p = end;
+		}
+		if (len < 8) {
+			fprintf(stderr, "%s:%d: short setup packet\n",
+				path, lineno);
+			exit(EXIT_FAILURE);
+		}
+		urb->data_len = len - 8;
+		num_enum_urbs++;
+	}
+	fclose(f);
+
+	if (num_enum_urbs == 0) {
+		fprintf(stderr, "%s: no URBs\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+// Round-trip times in nanoseconds, one array per kind of URB.
+
+struct samples {
+	unsigned long *rtt;
+	unsigned long count;
+	unsigned long size;
+};
+
+struct samples ctrl_samples;
+struct samples int_samples;
+
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void samples_add(struct samples *s, unsigned long rtt) {
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->rtt = realloc(s->rtt, s->size * sizeof(s->rtt[0]));
+		if (s->rtt == NULL) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->rtt[s->count++] = rtt;
+}
+
+int compare_ulong(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+void samples_print(const char *name, struct samples *s) {
+	if (s->count == 0) {
+		printf("%-9s 0 URBs\n", name);
+		return;
+	}
+	qsort(s->rtt, s->count, sizeof(s->rtt[0]), compare_ulong);
+	printf("%-9s %lu URBs, RTT p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		name, s->count,
+		s->rtt[s->count / 2] / 1000.0,
+		s->rtt[s->count * 99 / 100] / 1000.0,
+		s->rtt[s->count - 1] / 1000.0);
+}
+
+/*----------------------------------------------------------------------*/
+
+enum phase {
+	PHASE_ENUM,
+	PHASE_INT,
+	PHASE_UNLINK,
+	PHASE_DONE,
+};
+
+struct pending {
+	bool used;
+	bool in;
+	bool ctrl;
+	bool unlinked;
+	unsigned long sent;
+};
+
+struct client_conn {
+	int fd;
+	char busid[SYSFS_BUS_ID_SIZE];
+	__u32 devid;
+	enum phase phase;
+	__u32 seqnum;
+
+	struct pending pending[MAX_PENDING];
+	unsigned int inflight;
+
+	unsigned int enum_index;	// next URB of the sequence
+	unsigned int enum_round;
+	unsigned long int_submitted;
+	unsigned long int_done;
+	unsigned int unlinks;		// RET_UNLINKs still expected
+
+	char rx[RX_BUF_SIZE];
+	unsigned int rx_len;
+
+	struct {
+		unsigned long errors;
+		unsigned long unlink_reset;
+		unsigned long unlink_done;
+	} stats;
+};
+
+struct client_conn conns[MAX_CONNS];
+int num_conns;
+
+int enum_rounds = 1;
+int int_ep = 1;
+int int_window = 8;
+unsigned long int_urbs = 100;
+int stall_ms = 5000;
+
+void send_all(struct client_conn *conn, const void *buf, size_t size) {
+	const char *p = buf;
+	while (size > 0) {
+		ssize_t rv = send(conn->fd, p, size, MSG_NOSIGNAL);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("send()");
+			exit(EXIT_FAILURE);
+		}
+		p += rv;
+		size -= rv;
+	}
+}
+
+void recv_all(struct client_conn *conn, void *buf, size_t size) {
+	char *p = buf;
+	while (size > 0) {
+		ssize_t rv = recv(conn->fd, p, size, 0);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			if (rv < 0)
+				perror("recv()");
+			else
+				fprintf(stderr, "%s: connection closed\n",
+					conn->busid);
+			exit(EXIT_FAILURE);
+		}
+		p += rv;
+		size -= rv;
+	}
+}
+
+void import_device(struct client_conn *conn) {
+	struct {
+		struct usbip_op_common common;
+		struct usbip_op_import_request request;
+	} __attribute__((packed)) req;
+
+	// The import is a blocking exchange, don't wait for it forever
+	// either.
+	struct timeval tv = { stall_ms / 1000, (stall_ms % 1000) * 1000 };
+	if (setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+		perror("setsockopt(SO_RCVTIMEO)");
+
+	memset(&req, 0, sizeof(req));
+	req.common.version = 0x0111;
+	req.common.code = OP_REQ_IMPORT;
+	pack_usbip_op_common(&req.common);
+	snprintf(req.request.busid, sizeof(req.request.busid), "%s",
+		conn->busid);
+	send_all(conn, &req, sizeof(req));
+
+	struct usbip_op_common common;
+	recv_all(conn, &common, sizeof(common));
+	unpack_usbip_op_common(&common);
+	if (common.code != OP_REP_IMPORT || common.status != ST_OK) {
+		fprintf(stderr, "%s: import failed, code 0x%x, status %u\n",
+			conn->busid, common.code, common.status);
+		exit(EXIT_FAILURE);
+	}
+
+	struct usbip_usb_device udev;
+	recv_all(conn, &udev, sizeof(udev));
+	unpack_usbip_usb_device(&udev);
+	conn->devid = (udev.busnum << 16) | udev.devnum;
+}
+
+__u32 submit_urb(struct client_conn *conn, unsigned int ep, bool in,
+			bool ctrl, const unsigned char *setup,
+			const void *data, unsigned int len) {
+	__u32 seqnum = ++conn->seqnum;
+	struct pending *p = &conn->pending[seqnum & (MAX_PENDING - 1)];
+	assert(!p->used);
+
+	struct {
+		struct usbip_header uh;
+		char data[MAX_URB_DATA];
+	} __attribute__((packed)) msg;
+	memset(&msg.uh, 0, sizeof(msg.uh));
+	msg.uh.base.command = USBIP_CMD_SUBMIT;
+	msg.uh.base.seqnum = seqnum;
+	msg.uh.base.devid = conn->devid;
+	msg.uh.base.direction = in ? USBIP_DIR_IN : USBIP_DIR_OUT;
+	msg.uh.base.ep = ep;
+	msg.uh.u.cmd_submit.transfer_buffer_length = len;
+	if (setup != NULL)
+		memcpy(&msg.uh.u.cmd_submit.setup[0], setup, 8);
+	pack_usbip_header_basic(&msg.uh.base);
+	pack_usbip_header_cmd_submit(&msg.uh.u.cmd_submit);
+
+	size_t size = sizeof(msg.uh);
+	if (!in) {
+		memcpy(&msg.data[0], data, len);
+		size += len;
+	}
+
+	p->used = true;
+	p->in = in;
+	p->ctrl = ctrl;
+	p->unlinked = false;
+	p->sent = now_ns();
+	conn->inflight++;
+	send_all(conn, &msg, size);
+	return seqnum;
+}
+
+void unlink_urb(struct client_conn *conn, __u32 victim) {
+	struct usbip_header uh;
+	memset(&uh, 0, sizeof(uh));
+	uh.base.command = USBIP_CMD_UNLINK;
+	uh.base.seqnum = ++conn->seqnum;
+	uh.base.devid = conn->devid;
+	uh.u.cmd_unlink.seqnum = victim;
+	pack_usbip_header_basic(&uh.base);
+	pack_usbip_header_cmd_unlink(&uh.u.cmd_unlink);
+	conn->pending[victim & (MAX_PENDING - 1)].unlinked = true;
+	conn->unlinks++;
+	send_all(conn, &uh, sizeof(uh));
+}
+
+void submit_enum_urb(struct client_conn *conn) {
+	struct enum_urb *urb = &enum_urbs[conn->enum_index];
+	struct usb_ctrlrequest *ctrl = (struct usb_ctrlrequest *)urb->setup;
+	bool in = ctrl->bRequestType & USB_DIR_IN;
+	unsigned int len = in ? __le16_to_cpu(ctrl->wLength) : urb->data_len;
+	submit_urb(conn, 0, in, true, urb->setup, urb->data, len);
+}
+
+// Moves the connection forward after a completion: the enumeration
+// sequence runs one URB at a time like a real host would, interrupt URBs
+// are kept int_window deep.
+void conn_advance(struct client_conn *conn) {
+	switch (conn->phase) {
+	case PHASE_ENUM:
+		if (conn->inflight > 0)
+			return;
+		if (++conn->enum_index == num_enum_urbs) {
+			conn->enum_index = 0;
+			if (++conn->enum_round == enum_rounds) {
+				conn->phase = PHASE_INT;
+				conn_advance(conn);
+				return;
+			}
+		}
+		submit_enum_urb(conn);
+		return;
+	case PHASE_INT:
+		while (conn->int_submitted < int_urbs &&
+				conn->inflight < int_window) {
+			submit_urb(conn, int_ep, true, false, NULL, NULL,
+					MAX_URB_DATA);
+			conn->int_submitted++;
+		}
+		if (conn->int_done < int_urbs)
+			return;
+		// Leave some URBs behind to be unlinked, the way usbhid
+		// does when the device is closed.
+		for (int i = 0; i < int_window; i++)
+			submit_urb(conn, int_ep, true, false, NULL, NULL,
+					MAX_URB_DATA);
+		__u32 last = conn->seqnum;
+		for (int i = 0; i < int_window; i++)
+			unlink_urb(conn, last - i);
+		conn->phase = PHASE_UNLINK;
+		return;
+	case PHASE_UNLINK:
+		if (conn->unlinks == 0 && conn->inflight == 0)
+			conn->phase = PHASE_DONE;
+		return;
+	case PHASE_DONE:
+		return;
+	}
+}
+
+void handle_ret_submit(struct client_conn *conn, struct usbip_header *uh) {
+	struct pending *p = &conn->pending[uh->base.seqnum & (MAX_PENDING - 1)];
+	if (!p->used) {
+		fprintf(stderr, "%s: unexpected seqnum %u\n",
+			conn->busid, uh->base.seqnum);
+		exit(EXIT_FAILURE);
+	}
+	if (uh->u.ret_submit.status != 0)
+		conn->stats.errors++;
+	if (p->ctrl)
+		samples_add(&ctrl_samples, now_ns() - p->sent);
+	else if (!p->unlinked) {
+		samples_add(&int_samples, now_ns() - p->sent);
+		conn->int_done++;
+	}
+	p->used = false;
+	conn->inflight--;
+}
+
+void handle_ret_unlink(struct client_conn *conn, struct usbip_header *uh) {
+	// The reply carries the seqnum of the CMD_UNLINK, which is never
+	// reused, and the victim is always the URB submitted right before
+	// the unlinks went out, so just count them.
+	if (uh->u.ret_unlink.status == -ECONNRESET) {
+		conn->stats.unlink_reset++;
+		conn->inflight--;
+	} else if (uh->u.ret_unlink.status == 0)
+		conn->stats.unlink_done++;
+	else
+		conn->stats.errors++;
+	conn->unlinks--;
+}
+
+// An URB that is unlinked is either answered by RET_UNLINK with
+// -ECONNRESET and never completes, or completes normally and the unlink
+// gets status 0. In the first case its pending slot has to be released
+// here as no RET_SUBMIT will come.
+void release_unlinked(struct client_conn *conn) {
+	if (conn->phase != PHASE_UNLINK || conn->unlinks > 0)
+		return;
+	for (int i = 0; i < MAX_PENDING; i++)
+		conn->pending[i].used = false;
+	conn->inflight = 0;
+}
+
+void conn_read(struct client_conn *conn) {
+	ssize_t rv = recv(conn->fd, &conn->rx[conn->rx_len],
+				sizeof(conn->rx) - conn->rx_len, 0);
+	if (rv < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("recv()");
+		exit(EXIT_FAILURE);
+	}
+	if (rv == 0) {
+		fprintf(stderr, "%s: connection closed\n", conn->busid);
+		exit(EXIT_FAILURE);
+	}
+	conn->rx_len += rv;
+
+	unsigned int offset = 0;
+	while (conn->rx_len - offset >= sizeof(struct usbip_header)) {
+		struct usbip_header uh;
+		memcpy(&uh, &conn->rx[offset], sizeof(uh));
+		unpack_usbip_header_basic(&uh.base);
+
+		unsigned int size = sizeof(uh);
+		if (uh.base.command == USBIP_RET_SUBMIT) {
+			unpack_usbip_header_ret_submit(&uh.u.ret_submit);
+			struct pending *p = &conn->pending[uh.base.seqnum &
+							(MAX_PENDING - 1)];
+			if (p->in && uh.u.ret_submit.actual_length > 0)
+				size += uh.u.ret_submit.actual_length;
+		} else if (uh.base.command == USBIP_RET_UNLINK) {
+			unpack_usbip_header_ret_unlink(&uh.u.ret_unlink);
+		} else {
+			fprintf(stderr, "%s: unknown command %u\n",
+				conn->busid, uh.base.command);
+			exit(EXIT_FAILURE);
+		}
+		if (size > sizeof(conn->rx)) {
+			fprintf(stderr, "%s: reply too long\n", conn->busid);
+			exit(EXIT_FAILURE);
+		}
+		if (conn->rx_len - offset < size)
+			break;
+		offset += size;
+
+		if (uh.base.command == USBIP_RET_SUBMIT)
+			handle_ret_submit(conn, &uh);
+		else
+			handle_ret_unlink(conn, &uh);
+		release_unlinked(conn);
+		conn_advance(conn);
+	}
+
+	memmove(&conn->rx[0], &conn->rx[offset], conn->rx_len - offset);
+	conn->rx_len -= offset;
+}
+
+const char *phase_name(enum phase phase) {
+	switch (phase) {
+	case PHASE_ENUM:
+		return "enumeration";
+	case PHASE_INT:
+		return "interrupt";
+	case PHASE_UNLINK:
+		return "unlink";
+	case PHASE_DONE:
+		return "done";
+	}
+	return "?";
+}
+
+// Nothing has come back for stall_ms, most likely the server holds URBs
+// it has no data for.
+void report_stall(void) {
+	fprintf(stderr, "nothing came back for %d ms\n", stall_ms);
+	for (int i = 0; i < num_conns; i++) {
+		struct client_conn *conn = &conns[i];
+		if (conn->phase == PHASE_DONE)
+			continue;
+		fprintf(stderr, "%s: %s phase, %u URBs in flight, "
+			"%lu/%lu interrupt URBs done\n", conn->busid,
+			phase_name(conn->phase), conn->inflight,
+			conn->int_done, int_urbs);
+	}
+	exit(EXIT_FAILURE);
+}
+
+/*----------------------------------------------------------------------*/
+
+void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-H host] [-p port] [-c conns] "
+		"[-r enum_file] [-e rounds] [-i ep] [-w window] [-n urbs] "
+		"[-t stall_ms] [-- server args...]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *host = "127.0.0.1";
+	int port = USBIP_PORT;
+	int opt;
+	num_conns = 1;
+	while ((opt = getopt(argc, argv, "H:p:c:r:e:i:w:n:t:")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			num_conns = atoi(optarg);
+			if (num_conns < 1 || num_conns > MAX_CONNS)
+				usage(argv[0]);
+			break;
+		case 'r':
+			load_enum(optarg);
+			break;
+		case 'e':
+			enum_rounds = atoi(optarg);
+			if (enum_rounds < 1)
+				usage(argv[0]);
+			break;
+		case 'i':
+			int_ep = atoi(optarg);
+			if (int_ep < 1 || int_ep > 15)
+				usage(argv[0]);
+			break;
+		case 'w':
+			int_window = atoi(optarg);
+			if (int_window < 1 || int_window > MAX_PENDING / 4)
+				usage(argv[0]);
+			break;
+		case 'n':
+			int_urbs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			stall_ms = atoi(optarg);
+			if (stall_ms < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	pid_t server_pid = -1;
+	if (optind < argc) {
+		char copies[16];
+		snprintf(&copies[0], sizeof(copies), "%d", num_conns);
+		char *extra[] = { "-b", "-n", &copies[0], NULL };
+		int fds[MAX_CONNS];
+		server_pid = spawn_server(&argv[optind], argc - optind,
+					&extra[0], &fds[0], num_conns);
+		for (int i = 0; i < num_conns; i++)
+			conns[i].fd = fds[i];
+	} else {
+		for (int i = 0; i < num_conns; i++)
+			conns[i].fd = connect_tcp(host, port);
+	}
+
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < num_conns; i++) {
+		struct client_conn *conn = &conns[i];
+		snprintf(conn->busid, sizeof(conn->busid), "1-%d", i + 1);
+		import_device(conn);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+			perror("epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unsigned long start = now_ns();
+	for (int i = 0; i < num_conns; i++)
+		submit_enum_urb(&conns[i]);
+
+	int done = 0;
+	while (done < num_conns) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(epoll_fd, &events[0], MAX_EVENTS, stall_ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0)
+			report_stall();
+		for (int i = 0; i < n; i++) {
+			struct client_conn *conn = events[i].data.ptr;
+			conn_read(conn);
+			if (conn->phase == PHASE_DONE) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+				done++;
+			}
+		}
+	}
+	unsigned long elapsed = now_ns() - start;
+
+	unsigned long errors = 0, unlink_reset = 0, unlink_done = 0;
+	for (int i = 0; i < num_conns; i++) {
+		errors += conns[i].stats.errors;
+		unlink_reset += conns[i].stats.unlink_reset;
+		unlink_done += conns[i].stats.unlink_done;
+		close(conns[i].fd);
+	}
+
+	unsigned long total = ctrl_samples.count + int_samples.count;
+	printf("%d connections, %lu URBs in %.3f s, %.0f URBs/s\n",
+		num_conns, total, elapsed / 1e9, total / (elapsed / 1e9));
+	samples_print("control", &ctrl_samples);
+	samples_print("interrupt", &int_samples);
+	printf("unlinked  %lu pending, %lu already completed, %lu errors\n",
+		unlink_reset, unlink_done, errors);
+
+	if (server_pid > 0) {
+		int status;
+		waitpid(server_pid, &status, 0);
+	}
+
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,107 @@
+// Reaching a keyboard.c server from the tools next to it, either over TCP
+// or over socketpairs handed to a server the tool starts itself.
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+static inline int connect_tcp(const char *host, int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "bad address: %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect()");
+		exit(EXIT_FAILURE);
+	}
+
+	int nodelay = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		       &nodelay, sizeof(nodelay)) < 0)
+		perror("setsockopt(TCP_NODELAY)");
+	return fd;
+}
+
+// Runs the server given by argv with the NULL-terminated extra arguments,
+// -p 0 and one end of a socketpair per connection as -f arguments, so
+// that it exits once the tool is done. The other ends go to fds.
+static inline pid_t spawn_server(char **argv, int argc, char **extra,
+				int *fds, int num_fds) {
+	int num_extra = 0;
+	while (extra != NULL && extra[num_extra] != NULL)
+		num_extra++;
+	char **args = calloc(argc + num_extra + 2 * num_fds + 3,
+				sizeof(*args));
+	int *server_fds = calloc(num_fds, sizeof(*server_fds));
+	if (args == NULL || server_fds == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	int n = 0;
+	for (int i = 0; i < argc; i++)
+		args[n++] = argv[i];
+	for (int i = 0; i < num_extra; i++)
+		args[n++] = extra[i];
+	args[n++] = "-p";
+	args[n++] = "0";
+	for (int i = 0; i < num_fds; i++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, &sv[0]) < 0) {
+			perror("socketpair()");
+			exit(EXIT_FAILURE);
+		}
+		fds[i] = sv[0];
+		server_fds[i] = sv[1];
+		args[n++] = "-f";
+		if (asprintf(&args[n++], "%d", sv[1]) < 0) {
+			perror("asprintf()");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		for (int i = 0; i < num_fds; i++)
+			close(fds[i]);
+		// The server prints a few lines for every connection, keep
+		// them out of the way.
+		int null_fd = open("/dev/null", O_WRONLY);
+		if (null_fd >= 0)
+			dup2(null_fd, STDOUT_FILENO);
+		execvp(args[0], args);
+		perror("execvp()");
+		_exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < num_fds; i++)
+		close(server_fds[i]);
+	free(server_fds);
+	return pid;
+}
+
+#endif // CLIENT_H
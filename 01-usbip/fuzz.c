@@ -0,0 +1,994 @@
+// Device-side USB fuzzer built from the USB/IP server in server.c:
+//
+//   gcc -O2 -DTRACE_DISABLED -pthread
+//     fuzz.c server.c hid.c storage.c uring.c -o fuzz
+//   ./fuzz -n 8 -o crashes devices/*.txt keyboard
+//   ./fuzz -R crashes/crash-0.txt
+//
+// Plugs mutated device models into vhci_hcd ports, many at a time, and
+// watches how the host takes them. A test case is a model from the corpus
+// plus a list of mutations of what the device answers with: the device,
+// qualifier and configuration descriptors, the HID report descriptors,
+// the strings, and the answer to requests the model doesn't know (see
+// reply_fallback()). Each test case is plugged in, left until the host has
+// sent no URBs for a while or the time is up, and unplugged. The server,
+// its exports and the models stay, so a test case costs a mutated copy of
+// a model and an attach.
+//
+// The kernel log is watched for oopses, warnings and sanitizer reports.
+// When one shows up fuzzing stops, the test cases that were plugged in
+// around that time are run again one at a time, and the one that brings
+// the report back is minimized by dropping mutations for as long as it
+// still does. It's saved to the crash directory as:
+//
+//   # BUG: KASAN: slab-out-of-bounds in usb_parse_configuration
+//   seed devices/mouse.txt
+//   mutate config 18 set 0xff
+//   mutate report0 4 flip 0x10
+//
+// which -R runs again. A report whose first line, numbers aside, matches
+// one that was saved before is only counted. Test cases that make the
+// host send a sequence of setup packets that hasn't been seen before
+// join the corpus. Needs root and vhci_hcd.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/stat.h>
+
+#include <linux/usb/ch9.h>
+
+#include "server.h"
+
+#define FUZZ_MAX_SLOTS 64
+#define FUZZ_MAX_MUTATIONS 32
+#define FUZZ_MAX_BLOB 1024
+#define FUZZ_MAX_CORPUS 4096
+#define FUZZ_SEEN_SIZE (1 << 16)	// must be a power of two
+#define FUZZ_REPORT_LINES 64
+#define FUZZ_MAX_REPORTS 256
+#define FUZZ_REPRO_TRIES 3
+
+// What a mutation applies to. Reports and strings are numbered by
+// interface and string index.
+enum fuzz_target {
+	FUZZ_DEVICE,
+	FUZZ_QUALIFIER,
+	FUZZ_CONFIG,
+	FUZZ_REPORT,
+	FUZZ_STRING = FUZZ_REPORT + MAX_INTERFACES,
+	FUZZ_FALLBACK = FUZZ_STRING + MAX_STRING_DESCS,
+	FUZZ_NUM_TARGETS,
+};
+
+// flip, set and add change a byte, set16 a little-endian word, size
+// truncates or extends the data with value, dup repeats value bytes.
+enum fuzz_op {
+	FUZZ_FLIP,
+	FUZZ_SET,
+	FUZZ_ADD,
+	FUZZ_SET16,
+	FUZZ_SIZE,
+	FUZZ_DUP,
+	FUZZ_NUM_OPS,
+};
+
+const char *fuzz_op_names[FUZZ_NUM_OPS] = {
+	"flip", "set", "add", "set16", "size", "dup",
+};
+
+struct fuzz_mutation {
+	unsigned char target;
+	unsigned char op;
+	unsigned short offset;
+	unsigned int value;
+};
+
+struct fuzz_input {
+	int seed;			// index into models[]
+	int num_mutations;
+	struct fuzz_mutation mutations[FUZZ_MAX_MUTATIONS];
+};
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_PLUGGED,
+	SLOT_UNPLUGGING,	// waiting for vhci_hcd to drop the connection
+};
+
+// How a test case went.
+#define OUTCOME_CONFIGURED	1
+#define OUTCOME_DISCONNECT	2	// connection closed while plugged in
+#define OUTCOME_TIMEOUT		4	// no URBs, or no end to them
+
+// A vhci_hcd port's worth of fuzzing: an export with a model of its own
+// that the mutated descriptors are served from.
+struct fuzz_slot {
+	struct export *export;
+	struct device_model model;
+	char data[FUZZ_NUM_TARGETS][FUZZ_MAX_BLOB];
+	unsigned int len[FUZZ_NUM_TARGETS];
+
+	enum slot_state state;
+	struct fuzz_input input;
+	bool input_ready;		// generated, not plugged in yet
+	struct fuzz_input previous;
+	bool has_previous;
+	int outcome;
+	int port;
+	unsigned long plugged;
+	unsigned long unplugged;
+	unsigned long active;		// last time URBs came in
+	unsigned long done;
+	unsigned long retry;
+	unsigned long urbs;
+	// Hash of the setup packets the host has sent since the slot was
+	// plugged in, see fuzz_control().
+	uint64_t requests;
+};
+
+struct fuzz_slot *slots[FUZZ_MAX_SLOTS];
+int num_slots = 8;
+
+const char *model_paths[MAX_MODELS];
+
+struct fuzz_input corpus[FUZZ_MAX_CORPUS];
+int num_corpus;
+uint64_t seen[FUZZ_SEEN_SIZE];
+unsigned int num_seen;
+uint64_t known_reports[FUZZ_MAX_REPORTS];
+int num_known_reports;
+
+unsigned long idle_ns = 100000000UL;
+unsigned long timeout_ns = 3000000000UL;
+// Reports can show up a little after the device that caused them is gone.
+unsigned long settle_ns = 300000000UL;
+const char *crash_dir = "crashes";
+unsigned long max_execs;
+uint64_t rng_state;
+
+struct {
+	unsigned long execs;
+	unsigned long configured;
+	unsigned long disconnects;
+	unsigned long timeouts;
+	unsigned long errors;
+	int crashes;
+} stats;
+
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned int fuzz_rand(unsigned int n) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Kernel log watching. Records are read from /dev/kmsg starting with the
+// ones logged after the fuzzer started, the first one that looks like a
+// report and the lines after it are kept.
+
+const char *report_markers[] = {
+	"BUG:",
+	"WARNING:",
+	"KASAN:",
+	"KMSAN:",
+	"KFENCE:",
+	"UBSAN:",
+	"Oops:",
+	"general protection fault",
+	"kernel BUG at",
+	"Kernel panic",
+	"INFO: task hung",
+	"INFO: rcu_",
+};
+
+int kmsg_fd = -1;
+
+struct {
+	bool seen;
+	int lines;
+	char text[8192];
+	unsigned int len;
+} report;
+
+void kmsg_open(void) {
+	kmsg_fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (kmsg_fd < 0) {
+		perror("open(/dev/kmsg), crashes won't be detected");
+		return;
+	}
+	lseek(kmsg_fd, 0, SEEK_END);
+}
+
+void report_reset(void) {
+	report.seen = false;
+	report.lines = 0;
+	report.len = 0;
+	report.text[0] = 0;
+}
+
+bool is_report(const char *msg) {
+	for (int i = 0; i < sizeof(report_markers) / sizeof(report_markers[0]);
+			i++) {
+		if (strstr(msg, report_markers[i]) != NULL)
+			return true;
+	}
+	return false;
+}
+
+void kmsg_read(void) {
+	while (kmsg_fd >= 0) {
+		char record[2048];
+		ssize_t rv = read(kmsg_fd, &record[0], sizeof(record) - 1);
+		if (rv < 0) {
+			// EPIPE: records were overwritten before we got to them.
+			if (errno == EINTR || errno == EPIPE)
+				continue;
+			if (errno != EAGAIN)
+				perror("read(/dev/kmsg)");
+			return;
+		}
+		if (rv == 0)
+			return;
+		record[rv] = 0;
+		char *msg = strchr(&record[0], ';');
+		if (msg == NULL)
+			continue;
+		msg++;
+		char *end = strchr(msg, '\n');
+		if (end != NULL)
+			*end = 0;
+
+		if (!report.seen && !is_report(msg))
+			continue;
+		report.seen = true;
+		if (report.lines == FUZZ_REPORT_LINES)
+			continue;
+		int len = snprintf(&report.text[report.len],
+				sizeof(report.text) - report.len, "%s\n", msg);
+		if (len > 0 && report.len + len < sizeof(report.text)) {
+			report.len += len;
+			report.lines++;
+		}
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+// Returns the descriptor a target refers to in the model's cache, or
+// NULL if the model doesn't have it.
+struct desc_blob *fuzz_blob(struct device_model *model, int target) {
+	switch (target) {
+	case FUZZ_DEVICE:
+		return &model->cache.device;
+	case FUZZ_QUALIFIER:
+		return &model->cache.qualifier;
+	case FUZZ_CONFIG:
+		return &model->cache.config;
+	case FUZZ_FALLBACK:
+		return &model->fallback;
+	}
+	if (target < FUZZ_STRING) {
+		struct desc_blob *blob =
+			&model->cache.hid_report[target - FUZZ_REPORT];
+		return blob->data != NULL ? blob : NULL;
+	}
+	return &model->cache.strings[target - FUZZ_STRING];
+}
+
+void target_name(int target, char *name, size_t size) {
+	if (target >= FUZZ_REPORT && target < FUZZ_STRING)
+		snprintf(name, size, "report%d", target - FUZZ_REPORT);
+	else if (target >= FUZZ_STRING && target < FUZZ_FALLBACK)
+		snprintf(name, size, "string%d", target - FUZZ_STRING);
+	else
+		snprintf(name, size, "%s", target == FUZZ_DEVICE ? "device" :
+			target == FUZZ_QUALIFIER ? "qualifier" :
+			target == FUZZ_CONFIG ? "config" : "fallback");
+}
+
+int parse_target(const char *name) {
+	for (int target = 0; target < FUZZ_NUM_TARGETS; target++) {
+		char buf[16];
+		target_name(target, &buf[0], sizeof(buf));
+		if (strcmp(&buf[0], name) == 0)
+			return target;
+	}
+	return -1;
+}
+
+void fuzz_mutate(char *data, unsigned int *len, struct fuzz_mutation *m) {
+	unsigned int off = m->offset;
+	if (m->op == FUZZ_SIZE) {
+		if (off > FUZZ_MAX_BLOB)
+			return;
+		if (off > *len)
+			memset(data + *len, m->value, off - *len);
+		*len = off;
+		return;
+	}
+	if (off >= *len)
+		return;
+
+	switch (m->op) {
+	case FUZZ_FLIP:
+		data[off] ^= m->value;
+		break;
+	case FUZZ_SET:
+		data[off] = m->value;
+		break;
+	case FUZZ_ADD:
+		data[off] += m->value;
+		break;
+	case FUZZ_SET16:
+		if (off + 1 < *len) {
+			data[off] = m->value;
+			data[off + 1] = m->value >> 8;
+		}
+		break;
+	case FUZZ_DUP: {
+		unsigned int n = min_len(m->value, *len - off);
+		n = min_len(n, FUZZ_MAX_BLOB - *len);
+		memmove(data + off + n, data + off, *len - off);
+		*len += n;
+		break;
+	}
+	}
+}
+
+// Points the slot's model at the seed's descriptors with the mutations
+// applied.
+void fuzz_apply(struct fuzz_slot *slot) {
+	struct device_model *seed = models[slot->input.seed];
+	struct device_model *model = &slot->model;
+	*model = *seed;
+
+	for (int target = 0; target < FUZZ_NUM_TARGETS; target++) {
+		struct desc_blob *blob = fuzz_blob(seed, target);
+		if (blob == NULL)
+			continue;
+		if (blob->len > 0)
+			memcpy(&slot->data[target][0], blob->data, blob->len);
+		slot->len[target] = blob->len;
+	}
+	for (int i = 0; i < slot->input.num_mutations; i++) {
+		struct fuzz_mutation *m = &slot->input.mutations[i];
+		if (fuzz_blob(seed, m->target) != NULL)
+			fuzz_mutate(&slot->data[m->target][0],
+				&slot->len[m->target], m);
+	}
+	for (int target = 0; target < FUZZ_NUM_TARGETS; target++) {
+		struct desc_blob *blob = fuzz_blob(model, target);
+		if (blob == NULL)
+			continue;
+		blob->data = &slot->data[target][0];
+		blob->len = slot->len[target];
+	}
+}
+
+const unsigned int interesting[] = {
+	0x00, 0x01, 0x02, 0x7f, 0x80, 0xfe, 0xff,
+	0x100, 0x7fff, 0x8000, 0xffff,
+};
+
+// Descriptor headers in a configuration are where the host's parser makes
+// its decisions, offsets land on them half of the time.
+unsigned int fuzz_offset(struct desc_blob *blob, int target) {
+	if (target == FUZZ_CONFIG && fuzz_rand(2) == 0) {
+		unsigned int headers[64], n = 0;
+		for (unsigned int off = 0; off + 1 < blob->len && n < 64; ) {
+			headers[n++] = off;
+			unsigned char length = blob->data[off];
+			if (length < 2)
+				break;
+			off += length;
+		}
+		if (n > 0)
+			return headers[fuzz_rand(n)] + fuzz_rand(4);
+	}
+	return blob->len > 0 ? fuzz_rand(blob->len) : 0;
+}
+
+void fuzz_add_mutation(struct fuzz_input *input) {
+	struct device_model *seed = models[input->seed];
+	int targets[2 * FUZZ_NUM_TARGETS], n = 0;
+	for (int target = 0; target < FUZZ_NUM_TARGETS; target++) {
+		if (fuzz_blob(seed, target) == NULL)
+			continue;
+		targets[n++] = target;
+		// The configuration and report descriptors are where
+		// the parsing is.
+		if (target == FUZZ_CONFIG ||
+		    (target >= FUZZ_REPORT && target < FUZZ_STRING))
+			targets[n++] = target;
+	}
+
+	struct fuzz_mutation m;
+	m.target = targets[fuzz_rand(n)];
+	m.op = fuzz_rand(FUZZ_NUM_OPS);
+	struct desc_blob *blob = fuzz_blob(seed, m.target);
+	m.offset = fuzz_offset(blob, m.target);
+	switch (m.op) {
+	case FUZZ_FLIP:
+		m.value = 1 << fuzz_rand(8);
+		break;
+	case FUZZ_SET:
+		m.value = fuzz_rand(2) ? interesting[fuzz_rand(7)] :
+					fuzz_rand(256);
+		break;
+	case FUZZ_ADD:
+		m.value = (fuzz_rand(33) - 16) & 0xff;
+		break;
+	case FUZZ_SET16:
+		m.value = fuzz_rand(2) ? interesting[fuzz_rand(11)] :
+					fuzz_rand(65536);
+		break;
+	case FUZZ_SIZE:
+		m.offset = fuzz_rand(blob->len + 64);
+		m.value = fuzz_rand(256);
+		break;
+	case FUZZ_DUP:
+		m.value = 1 + fuzz_rand(64);
+		break;
+	}
+
+	if (input->num_mutations < FUZZ_MAX_MUTATIONS)
+		input->mutations[input->num_mutations++] = m;
+	else
+		input->mutations[fuzz_rand(FUZZ_MAX_MUTATIONS)] = m;
+}
+
+void remove_mutation(struct fuzz_input *input, int i) {
+	memmove(&input->mutations[i], &input->mutations[i + 1],
+		(input->num_mutations - i - 1) * sizeof(input->mutations[0]));
+	input->num_mutations--;
+}
+
+void fuzz_generate(struct fuzz_input *input) {
+	*input = corpus[fuzz_rand(num_corpus)];
+	if (input->num_mutations > 0 && fuzz_rand(8) == 0)
+		remove_mutation(input, fuzz_rand(input->num_mutations));
+	for (int n = 1 + fuzz_rand(4); n > 0; n--)
+		fuzz_add_mutation(input);
+}
+
+// Returns true if hash hasn't been seen before.
+bool seen_add(uint64_t hash) {
+	if (hash == 0)
+		hash = 1;
+	unsigned int i = hash & (FUZZ_SEEN_SIZE - 1);
+	for (; seen[i] != 0; i = (i + 1) & (FUZZ_SEEN_SIZE - 1)) {
+		if (seen[i] == hash)
+			return false;
+	}
+	if (2 * num_seen >= FUZZ_SEEN_SIZE)
+		return false;
+	seen[i] = hash;
+	num_seen++;
+	return true;
+}
+
+// The server's control_hook. Slot N serves export N.
+void fuzz_control(struct conn *conn, const struct usb_ctrlrequest *ctrl) {
+	if (conn->export == NULL)
+		return;
+	struct fuzz_slot *slot = slots[conn->export - &exports[0]];
+	uint64_t setup;
+	memcpy(&setup, ctrl, sizeof(setup));
+	slot->requests = (slot->requests ^ setup) * 0x100000001b3ULL;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Finds a free port for the slot's input and plugs it in.
+bool slot_plug(struct fuzz_slot *slot, unsigned long now) {
+	int port = vhci_free_port(models[slot->input.seed]->speed);
+	if (port < 0)
+		return false;
+
+	fuzz_apply(slot);
+	struct export *export = slot->export;
+	slot->requests = 0;
+	export->attaching = true;
+	attach_pending++;
+	if (vhci_plug(&workers[0], export, port) == NULL) {
+		export->attaching = false;
+		attach_pending--;
+		stats.errors++;
+		slot->retry = now + 100000000UL;
+		return false;
+	}
+	slot->state = SLOT_PLUGGED;
+	slot->port = port;
+	slot->outcome = 0;
+	slot->plugged = now;
+	slot->active = now;
+	slot->urbs = 0;
+	return true;
+}
+
+// Detaching makes vhci_hcd shut down its end of the connection.
+void slot_unplug(struct fuzz_slot *slot, unsigned long now) {
+	char request[16];
+	int len = snprintf(&request[0], sizeof(request), "%d", slot->port);
+	int fd = open(VHCI_PATH "/detach", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, &request[0], len) != len) {
+		perror("write(" VHCI_PATH "/detach)");
+		conn_close(slot->export->conn);
+	}
+	if (fd >= 0)
+		close(fd);
+	slot->state = SLOT_UNPLUGGING;
+	slot->unplugged = now;
+}
+
+void slot_done(struct fuzz_slot *slot, unsigned long now) {
+	struct export *export = slot->export;
+	if (__atomic_exchange_n(&export->attaching, false, __ATOMIC_ACQ_REL))
+		attach_pending--;
+	else
+		slot->outcome |= OUTCOME_CONFIGURED;
+
+	stats.execs++;
+	if (slot->outcome & OUTCOME_CONFIGURED)
+		stats.configured++;
+	if (slot->outcome & OUTCOME_DISCONNECT)
+		stats.disconnects++;
+	if (slot->outcome & OUTCOME_TIMEOUT)
+		stats.timeouts++;
+
+	if (seen_add(slot->requests ^ slot->outcome) &&
+	    num_corpus < FUZZ_MAX_CORPUS)
+		corpus[num_corpus++] = slot->input;
+
+	slot->previous = slot->input;
+	slot->has_previous = true;
+	slot->state = SLOT_FREE;
+	slot->done = now;
+}
+
+// A test case ends once the host has gone idle_ns without sending URBs,
+// or after timeout_ns.
+void slot_step(struct fuzz_slot *slot, unsigned long now) {
+	struct conn *conn = slot->export->conn;
+	switch (slot->state) {
+	case SLOT_FREE:
+		return;
+	case SLOT_PLUGGED:
+		if (conn == NULL) {
+			slot->outcome |= OUTCOME_DISCONNECT;
+			slot_done(slot, now);
+			return;
+		}
+		if (conn->stats.urbs != slot->urbs) {
+			slot->urbs = conn->stats.urbs;
+			slot->active = now;
+		}
+		bool idle = slot->urbs > 0 && now - slot->active >= idle_ns;
+		if (!idle && now - slot->plugged < timeout_ns)
+			return;
+		if (!idle)
+			slot->outcome |= OUTCOME_TIMEOUT;
+		slot_unplug(slot, now);
+		return;
+	case SLOT_UNPLUGGING:
+		if (conn == NULL)
+			slot_done(slot, now);
+		else if (now - slot->unplugged >= timeout_ns)
+			conn_close(conn);
+		return;
+	}
+}
+
+void fuzz_poll(int timeout_ms) {
+	struct worker *worker = &workers[0];
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(worker->epoll_fd, &events[0], MAX_EVENTS,
+				timeout_ms);
+	if (n < 0 && errno != EINTR) {
+		perror("epoll_wait()");
+		exit(EXIT_FAILURE);
+	}
+	if (n > 0)
+		worker_dispatch(worker, &events[0], n);
+	free_closed_conns(worker);
+	kmsg_read();
+}
+
+// Runs one test case on its own, returns true if it caused a report.
+bool fuzz_run(struct fuzz_slot *slot, struct fuzz_input *input) {
+	report_reset();
+	slot->input = *input;
+	unsigned long start = now_ns();
+	while (!slot_plug(slot, now_ns())) {
+		if (now_ns() - start >= timeout_ns) {
+			fprintf(stderr, "no free vhci_hcd port\n");
+			return false;
+		}
+		fuzz_poll(10);
+	}
+	while (slot->state != SLOT_FREE) {
+		slot_step(slot, now_ns());
+		fuzz_poll(10);
+	}
+	while (now_ns() - slot->done < settle_ns)
+		fuzz_poll(10);
+	return report.seen;
+}
+
+bool fuzz_reproduces(struct fuzz_slot *slot, struct fuzz_input *input) {
+	for (int i = 0; i < FUZZ_REPRO_TRIES; i++) {
+		if (fuzz_run(slot, input))
+			return true;
+	}
+	return false;
+}
+
+void fuzz_minimize(struct fuzz_slot *slot, struct fuzz_input *input) {
+	for (int i = input->num_mutations - 1; i >= 0; i--) {
+		struct fuzz_input smaller = *input;
+		remove_mutation(&smaller, i);
+		if (fuzz_reproduces(slot, &smaller))
+			*input = smaller;
+	}
+	// Leave the report of the minimized input for fuzz_save().
+	fuzz_reproduces(slot, input);
+}
+
+void fuzz_write_input(FILE *file, struct fuzz_input *input) {
+	fprintf(file, "seed %s\n", model_paths[input->seed]);
+	for (int i = 0; i < input->num_mutations; i++) {
+		struct fuzz_mutation *m = &input->mutations[i];
+		char name[16];
+		target_name(m->target, &name[0], sizeof(name));
+		fprintf(file, "mutate %s %u %s 0x%x\n", &name[0], m->offset,
+			fuzz_op_names[m->op], m->value);
+	}
+}
+
+void fuzz_save(struct fuzz_input *input, const char *text, bool confirmed) {
+	if (mkdir(crash_dir, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir()");
+		return;
+	}
+	char path[PATH_MAX];
+	int fd;
+	for (int i = 0; ; i++) {
+		snprintf(&path[0], sizeof(path), "%s/crash-%d.txt",
+			crash_dir, i);
+		fd = open(&path[0], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+				0644);
+		if (fd >= 0)
+			break;
+		if (errno != EEXIST) {
+			perror("open()");
+			return;
+		}
+	}
+	FILE *file = fdopen(fd, "w");
+	if (!confirmed)
+		fprintf(file, "# didn't reproduce on its own\n");
+	for (const char *line = text; *line != 0; ) {
+		const char *end = strchrnul(line, '\n');
+		fprintf(file, "# %.*s\n", (int)(end - line), line);
+		line = *end ? end + 1 : end;
+	}
+	fuzz_write_input(file, input);
+	fclose(file);
+	fprintf(stderr, "saved %s\n", &path[0]);
+}
+
+// Reports are told apart by their first line without the numbers in it,
+// which are CPUs, PIDs, offsets and line numbers.
+uint64_t report_title(const char *text) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *text != 0 && *text != '\n'; text++) {
+		if (*text >= '0' && *text <= '9')
+			continue;
+		hash = (hash ^ (unsigned char)*text) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Unplugs everything and finds the test case behind the report among the
+// ones that were plugged in or had just been unplugged.
+void fuzz_crash(unsigned long now) {
+	static struct fuzz_input suspects[2 * FUZZ_MAX_SLOTS];
+	static char text[sizeof(report.text)];
+	int num_suspects = 0;
+	for (int i = 0; i < num_slots; i++) {
+		struct fuzz_slot *slot = slots[i];
+		if (slot->state != SLOT_FREE)
+			suspects[num_suspects++] = slot->input;
+		if (slot->has_previous && now - slot->done < settle_ns)
+			suspects[num_suspects++] = slot->previous;
+	}
+
+	bool busy = true;
+	while (busy) {
+		busy = false;
+		for (int i = 0; i < num_slots; i++) {
+			struct fuzz_slot *slot = slots[i];
+			if (slot->state == SLOT_PLUGGED)
+				slot_unplug(slot, now_ns());
+			slot_step(slot, now_ns());
+			busy |= slot->state != SLOT_FREE;
+		}
+		fuzz_poll(10);
+	}
+	for (unsigned long start = now_ns(); now_ns() - start < settle_ns; )
+		fuzz_poll(10);
+	memcpy(&text[0], &report.text[0], sizeof(text));
+	fprintf(stderr, "%.*s", (int)strcspn(&text[0], "\n") + 1, &text[0]);
+	stats.crashes++;
+	uint64_t title = report_title(&text[0]);
+	for (int i = 0; i < num_known_reports; i++) {
+		if (known_reports[i] == title) {
+			fprintf(stderr, "already saved\n");
+			report_reset();
+			return;
+		}
+	}
+	if (num_known_reports < FUZZ_MAX_REPORTS)
+		known_reports[num_known_reports++] = title;
+
+	for (int i = 0; i < num_suspects; i++) {
+		fprintf(stderr, "trying suspect %d of %d\n", i + 1,
+			num_suspects);
+		if (!fuzz_reproduces(slots[0], &suspects[i]))
+			continue;
+		fprintf(stderr, "reproduced, minimizing %d mutations\n",
+			suspects[i].num_mutations);
+		fuzz_minimize(slots[0], &suspects[i]);
+		fuzz_save(&suspects[i], report.seen ? &report.text[0] :
+							&text[0], true);
+		report_reset();
+		return;
+	}
+	for (int i = 0; i < num_suspects; i++)
+		fuzz_save(&suspects[i], &text[0], false);
+	report_reset();
+}
+
+void print_stats(unsigned long start, unsigned long now) {
+	fprintf(stderr, "%lu execs (%.1f/s), corpus %d, %lu configured, "
+		"%lu disconnects, %lu timeouts, %lu errors, %d crashes\n",
+		stats.execs, stats.execs / ((now - start) / 1e9), num_corpus,
+		stats.configured, stats.disconnects, stats.timeouts,
+		stats.errors, stats.crashes);
+}
+
+void fuzz(void) {
+	for (int i = 0; i < num_models; i++) {
+		corpus[num_corpus].seed = i;
+		corpus[num_corpus++].num_mutations = 0;
+	}
+
+	unsigned long start = now_ns(), last_stats = start;
+	while (max_execs == 0 || stats.execs < max_execs) {
+		unsigned long now = now_ns();
+		for (int i = 0; i < num_slots; i++) {
+			struct fuzz_slot *slot = slots[i];
+			if (slot->state != SLOT_FREE) {
+				slot_step(slot, now);
+				continue;
+			}
+			if (now < slot->retry)
+				continue;
+			// An input that found no free port waits for one.
+			if (!slot->input_ready) {
+				fuzz_generate(&slot->input);
+				slot->input_ready = true;
+			}
+			if (slot_plug(slot, now))
+				slot->input_ready = false;
+		}
+		fuzz_poll(10);
+		if (report.seen)
+			fuzz_crash(now_ns());
+
+		now = now_ns();
+		if (now - last_stats >= 1000000000UL) {
+			print_stats(start, now);
+			last_stats = now;
+		}
+	}
+	print_stats(start, now_ns());
+}
+
+/*----------------------------------------------------------------------*/
+
+void fuzz_add_model(const char *path) {
+	add_model(path);
+	model_paths[num_models - 1] = path;
+}
+
+// Reads a test case saved by fuzz_save(), loading its seed.
+bool fuzz_load(const char *path, struct fuzz_input *input) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror("fopen()");
+		return false;
+	}
+
+	memset(input, 0, sizeof(*input));
+	input->seed = -1;
+	int lineno = 0;
+	char line[PATH_MAX + 16];
+	const char *error = NULL;
+	while (error == NULL && fgets(&line[0], sizeof(line), file) != NULL) {
+		lineno++;
+		char *comment = strchr(&line[0], '#');
+		if (comment != NULL)
+			*comment = 0;
+		char *key = strtok(&line[0], " \t\r\n");
+		if (key == NULL)
+			continue;
+
+		if (strcmp(key, "seed") == 0) {
+			char *seed = strtok(NULL, " \t\r\n");
+			if (seed == NULL || input->seed >= 0) {
+				error = "expected one seed";
+				break;
+			}
+			fuzz_add_model(strdup(seed));
+			input->seed = num_models - 1;
+		} else if (strcmp(key, "mutate") == 0) {
+			char *rest = strtok(NULL, "\r\n");
+			char target[16], op[8];
+			unsigned int offset, value;
+			if (rest == NULL || sscanf(rest, "%15s %u %7s %i",
+					target, &offset, op, &value) != 4) {
+				error = "expected <target> <offset> <op> "
+					"<value>";
+				break;
+			}
+			if (input->num_mutations == FUZZ_MAX_MUTATIONS) {
+				error = "too many mutations";
+				break;
+			}
+			struct fuzz_mutation *m =
+				&input->mutations[input->num_mutations++];
+			int t = parse_target(&target[0]);
+			m->op = FUZZ_NUM_OPS;
+			for (int i = 0; i < FUZZ_NUM_OPS; i++) {
+				if (strcmp(&op[0], fuzz_op_names[i]) == 0)
+					m->op = i;
+			}
+			if (t < 0)
+				error = "unknown target";
+			else if (m->op == FUZZ_NUM_OPS)
+				error = "unknown mutation";
+			m->target = t;
+			m->offset = offset;
+			m->value = value;
+		} else {
+			error = "unknown keyword";
+		}
+	}
+	fclose(file);
+
+	if (error == NULL && input->seed < 0)
+		error = "no seed";
+	if (error != NULL) {
+		fprintf(stderr, "%s:%d: %s\n", path, lineno, error);
+		return false;
+	}
+	return true;
+}
+
+void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-n ports] [-i idle_ms] [-t timeout_ms] "
+		"[-o crash_dir] [-N execs] [-S seed] [-v] "
+		"keyboard|description...\n"
+		"       %s [-i idle_ms] [-t timeout_ms] [-v] -R crash_file\n",
+		argv0, argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *repro = NULL;
+	bool verbose = false;
+	rng_state = now_ns() | 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:i:t:o:N:R:S:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_slots = atoi(optarg);
+			if (num_slots < 1 || num_slots > FUZZ_MAX_SLOTS)
+				usage(argv[0]);
+			break;
+		case 'i':
+			idle_ns = strtoul(optarg, NULL, 0) * 1000000UL;
+			break;
+		case 't':
+			timeout_ns = strtoul(optarg, NULL, 0) * 1000000UL;
+			break;
+		case 'o':
+			crash_dir = optarg;
+			break;
+		case 'N':
+			max_execs = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			repro = optarg;
+			break;
+		case 'S':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((repro == NULL) == (optind == argc))
+		usage(argv[0]);
+
+	if (access(VHCI_PATH "/attach", W_OK) < 0) {
+		perror(VHCI_PATH "/attach");
+		fprintf(stderr, "is vhci_hcd loaded?\n");
+		exit(EXIT_FAILURE);
+	}
+	// The server prints a few lines for every device it attaches, keep
+	// them out of the way.
+	if (!verbose && freopen("/dev/null", "w", stdout) == NULL)
+		perror("freopen()");
+
+	struct fuzz_input input;
+	if (repro != NULL) {
+		num_slots = 1;
+		if (!fuzz_load(repro, &input))
+			exit(EXIT_FAILURE);
+	}
+	for (int i = optind; i < argc; i++)
+		fuzz_add_model(argv[i]);
+
+	// Keyboards type nothing: an empty script instead of sysrq_script.
+	source_init();
+	control_hook = fuzz_control;
+	worker_init(&workers[0], 0, "/dev/null", 0, false);
+	for (int i = 0; i < num_slots; i++) {
+		slots[i] = calloc(1, sizeof(*slots[i]));
+		if (slots[i] == NULL) {
+			perror("calloc()");
+			exit(EXIT_FAILURE);
+		}
+		slots[i]->model = *models[0];
+		add_export(&slots[i]->model);
+		slots[i]->export = &exports[num_exports - 1];
+	}
+	kmsg_open();
+
+	if (repro != NULL) {
+		bool crashed = fuzz_run(slots[0], &input);
+		if (crashed)
+			fprintf(stderr, "%s", &report.text[0]);
+		else
+			fprintf(stderr, "no report, %s\n",
+				slots[0]->outcome & OUTCOME_CONFIGURED ?
+				"configured" : "not configured");
+		return crashed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	fuzz();
+	return 0;
+}
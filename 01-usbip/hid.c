@@ -0,0 +1,318 @@
+// HID report descriptor compiler and report packer of the USB/IP server,
+// see hid.h.
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <linux/types.h>
+#include <asm/byteorder.h>
+
+#include "hid.h"
+
+#define HID_MAX_ARRAY_COUNT 64
+#define HID_MAX_USAGES 64
+#define HID_STACK_DEPTH 4
+
+#define HID_PAGE_DESKTOP	0x01
+#define HID_PAGE_KEYBOARD	0x07
+#define HID_PAGE_BUTTON		0x09
+#define HID_PAGE_CONSUMER	0x0c
+
+#define HID_KEY_ERROR_ROLLOVER	0x01
+
+static int hid_state_bit(unsigned int usage) {
+	unsigned int page = usage >> 16, id = usage & 0xffff;
+	if (page == HID_PAGE_KEYBOARD && id < HID_STATE_BUTTON)
+		return id;
+	if (page == HID_PAGE_BUTTON && id >= 1 && id <= 32)
+		return HID_STATE_BUTTON + id - 1;
+	return -1;
+}
+
+static int hid_state_axis(unsigned int usage) {
+	switch (usage) {
+	case (HID_PAGE_DESKTOP << 16) | 0x30:
+		return HID_AXIS_X;
+	case (HID_PAGE_DESKTOP << 16) | 0x31:
+		return HID_AXIS_Y;
+	case (HID_PAGE_DESKTOP << 16) | 0x38:
+		return HID_AXIS_WHEEL;
+	case (HID_PAGE_CONSUMER << 16) | 0x238:
+		return HID_AXIS_PAN;
+	}
+	return -1;
+}
+
+struct hid_globals {
+	unsigned int usage_page;
+	int logical_min;
+	unsigned int logical_max;	// raw, see hid_logical_max()
+	int logical_max_size;
+	unsigned int report_size;
+	unsigned int report_count;
+	unsigned int report_id;
+};
+
+// Logical Maximum is signed like every other value, but descriptors with
+// a non-negative minimum often spell e.g. 255 as a 1-byte 0xff.
+static int hid_logical_max(struct hid_globals *g) {
+	unsigned int raw = g->logical_max;
+	int shift = 32 - 8 * g->logical_max_size;
+	int max = shift < 32 ? (int)(raw << shift) >> shift : 0;
+	if (g->logical_min >= 0 && max < g->logical_min)
+		return raw;
+	return max;
+}
+
+// Adds an Input main item to the layout. Returns an error message or NULL.
+static const char *hid_add_input(struct hid_layout *layout,
+			struct hid_globals *g, unsigned int flags,
+			unsigned int *usages, int num_usages, bool range,
+			unsigned int usage_min, unsigned int usage_max) {
+	int r;
+	for (r = 0; r < layout->num_reports; r++) {
+		if (layout->reports[r].id == g->report_id)
+			break;
+	}
+	if (r == layout->num_reports) {
+		if (r == HID_MAX_REPORTS)
+			return "too many reports";
+		if (r > 0 && (g->report_id == 0 || layout->reports[0].id == 0))
+			return "report ID missing";
+		layout->reports[r].id = g->report_id;
+		layout->num_reports++;
+	}
+	struct hid_report_layout *report = &layout->reports[r];
+
+	unsigned int offset = report->bits;
+	unsigned int total = g->report_size * g->report_count;
+	if (g->report_size > 32 || offset + total > HID_MAX_REPORT_SIZE * 8)
+		return "report too large";
+	report->bits += total;
+	report->len = (report->id ? 1 : 0) + (report->bits + 7) / 8;
+	if (flags & 0x01)		// Constant
+		return NULL;
+
+	unsigned int dst = r * HID_REPORT_STRIDE * 8 + (report->id ? 8 : 0) +
+				offset;
+	if (!(flags & 0x02)) {		// Array
+		if (!range || (usage_min >> 16) != HID_PAGE_KEYBOARD)
+			return NULL;
+		if (layout->num_array_ops == HID_MAX_ARRAY_OPS)
+			return "too many array fields";
+		if (g->report_count > HID_MAX_ARRAY_COUNT)
+			return "array field too large";
+		if ((usage_max & 0xffff) > 0xff)
+			usage_max = (usage_min & 0xffff0000) | 0xff;
+		struct hid_array_op *op =
+			&layout->array_ops[layout->num_array_ops++];
+		op->dst = dst;
+		op->size = g->report_size;
+		op->count = g->report_count;
+		op->usage_min = usage_min & 0xff;
+		op->usage_max = usage_max & 0xff;
+		op->base = g->logical_min - op->usage_min;
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < g->report_count; i++) {
+		unsigned int usage;
+		if (num_usages > 0)
+			usage = usages[i < num_usages ? i : num_usages - 1];
+		else if (range && usage_min + i <= usage_max)
+			usage = usage_min + i;
+		else
+			continue;
+
+		unsigned int field = dst + i * g->report_size;
+		int bit = hid_state_bit(usage);
+		int axis = hid_state_axis(usage);
+		if (g->report_size == 1 && bit >= 0) {
+			if (layout->num_bit_ops == HID_MAX_BIT_OPS)
+				return "too many bit fields";
+			struct hid_bit_op *op =
+				&layout->bit_ops[layout->num_bit_ops++];
+			op->src = bit;
+			op->dst = field;
+		} else if (axis >= 0) {
+			if (layout->num_value_ops == HID_MAX_VALUE_OPS)
+				return "too many value fields";
+			struct hid_value_op *op =
+				&layout->value_ops[layout->num_value_ops++];
+			op->dst = field;
+			op->size = g->report_size;
+			op->axis = axis;
+			op->min = g->logical_min;
+			op->max = hid_logical_max(g);
+		}
+	}
+	return NULL;
+}
+
+const char *hid_compile(struct hid_layout *layout, const char *desc,
+			unsigned int len) {
+	struct hid_globals stack[HID_STACK_DEPTH];
+	int depth = 0;
+	struct hid_globals g;
+	unsigned int usages[HID_MAX_USAGES];
+	int num_usages = 0;
+	unsigned int usage_min = 0, usage_max = 0;
+	bool range = false;
+
+	memset(layout, 0, sizeof(*layout));
+	memset(&g, 0, sizeof(g));
+
+	const unsigned char *ptr = (const unsigned char *)desc;
+	const unsigned char *end = ptr + len;
+	while (ptr < end) {
+		unsigned char prefix = *ptr++;
+		if (prefix == 0xfe) {		// long item
+			if (end - ptr < 2 || end - ptr < 2 + ptr[0])
+				return "truncated item";
+			ptr += 2 + ptr[0];
+			continue;
+		}
+		int size = (prefix & 0x03) == 3 ? 4 : prefix & 0x03;
+		if (end - ptr < size)
+			return "truncated item";
+		unsigned int data = 0;
+		for (int i = 0; i < size; i++)
+			data |= (unsigned int)ptr[i] << (8 * i);
+		int sdata = size == 0 || size == 4 ? (int)data :
+			(int)(data << (32 - 8 * size)) >> (32 - 8 * size);
+		ptr += size;
+
+		int type = (prefix >> 2) & 0x03;
+		int tag = prefix >> 4;
+		const char *error = NULL;
+		if (type == 0) {		// Main
+			if (tag == 0x8) {	// Input
+				unsigned int page = g.usage_page << 16;
+				for (int i = 0; i < num_usages; i++) {
+					if ((usages[i] >> 16) == 0)
+						usages[i] |= page;
+				}
+				if ((usage_min >> 16) == 0)
+					usage_min |= page;
+				if ((usage_max >> 16) == 0)
+					usage_max |= page;
+				error = hid_add_input(layout, &g, data,
+						&usages[0], num_usages, range,
+						usage_min, usage_max);
+			}
+			num_usages = 0;
+			usage_min = usage_max = 0;
+			range = false;
+		} else if (type == 1) {		// Global
+			switch (tag) {
+			case 0x0:
+				g.usage_page = data;
+				break;
+			case 0x1:
+				g.logical_min = sdata;
+				break;
+			case 0x2:
+				g.logical_max = data;
+				g.logical_max_size = size;
+				break;
+			case 0x7:
+				g.report_size = data;
+				break;
+			case 0x8:
+				if (data == 0 || data > 0xff)
+					error = "bad report ID";
+				g.report_id = data;
+				break;
+			case 0x9:
+				g.report_count = data;
+				break;
+			case 0xa:
+				if (depth == HID_STACK_DEPTH)
+					error = "push too deep";
+				else
+					stack[depth++] = g;
+				break;
+			case 0xb:
+				if (depth == 0)
+					error = "pop without push";
+				else
+					g = stack[--depth];
+				break;
+			}
+		} else if (type == 2) {		// Local
+			unsigned int usage = size == 4 ? data : data & 0xffff;
+			switch (tag) {
+			case 0x0:
+				if (num_usages == HID_MAX_USAGES)
+					error = "too many usages";
+				else
+					usages[num_usages++] = usage;
+				break;
+			case 0x1:
+				usage_min = usage;
+				range = true;
+				break;
+			case 0x2:
+				usage_max = usage;
+				break;
+			}
+		}
+		if (error != NULL)
+			return error;
+	}
+	return NULL;
+}
+
+// ORs the low size bits of value into buf at bit offset dst. Fields are
+// at most 32 bits, so they always fit in the 64-bit word at dst / 8.
+static void hid_put_bits(char *buf, unsigned int dst, unsigned int size,
+			unsigned int value) {
+	__u64 word;
+	memcpy(&word, buf + dst / 8, sizeof(word));
+	word = __le64_to_cpu(word);
+	word |= (__u64)(value & (__u32)((1ULL << size) - 1)) << (dst % 8);
+	word = __cpu_to_le64(word);
+	memcpy(buf + dst / 8, &word, sizeof(word));
+}
+
+void hid_pack(const struct hid_layout *layout, const struct hid_state *state,
+		char *out) {
+	memset(out, 0, layout->num_reports * HID_REPORT_STRIDE);
+	for (int r = 0; r < layout->num_reports; r++)
+		out[r * HID_REPORT_STRIDE] = layout->reports[r].id;
+
+	for (int i = 0; i < layout->num_bit_ops; i++) {
+		const struct hid_bit_op *op = &layout->bit_ops[i];
+		unsigned int bit = (state->bits[op->src / 8] >> (op->src % 8)) & 1;
+		out[op->dst / 8] |= bit << (op->dst % 8);
+	}
+
+	for (int i = 0; i < layout->num_value_ops; i++) {
+		const struct hid_value_op *op = &layout->value_ops[i];
+		int value = state->axes[op->axis];
+		value = value < op->min ? op->min : value;
+		value = value > op->max ? op->max : value;
+		hid_put_bits(out, op->dst, op->size, value);
+	}
+
+	for (int i = 0; i < layout->num_array_ops; i++) {
+		const struct hid_array_op *op = &layout->array_ops[i];
+		unsigned char slots[HID_MAX_ARRAY_COUNT] = { 0 };
+		unsigned int n = 0;
+		for (unsigned int k = 0; k < state->num_keys; k++) {
+			unsigned char key = state->keys[k];
+			slots[n] = key;
+			n += key >= op->usage_min && key <= op->usage_max;
+		}
+		// More keys than the field has room for is reported as
+		// ErrorRollOver in every slot, as the HID spec wants.
+		bool rollover = n > op->count;
+		for (unsigned int s = 0; s < op->count; s++) {
+			unsigned int usage = rollover ? HID_KEY_ERROR_ROLLOVER :
+						slots[s];
+			unsigned int valid = rollover || s < n;
+			hid_put_bits(out, op->dst + s * op->size, op->size,
+					(usage + op->base) & -valid);
+		}
+	}
+}
@@ -0,0 +1,95 @@
+// HID report descriptors are compiled once per interface into a flat
+// table of pack operations on a logical input state, so producing any
+// report is a few loops over that table with no descriptor parsing or
+// per-device code. Every report of a layout is packed into its own
+// HID_REPORT_STRIDE slot of one buffer, report ID byte first if there is
+// one; the operations address bits of that whole buffer.
+//
+// The state covers what report streams can produce: keyboard page usages,
+// buttons 1-32 and the X, Y, Wheel and AC Pan axes. Input fields with any
+// other usage are left zero, Output and Feature items are skipped.
+
+#ifndef HID_H
+#define HID_H
+
+#define HID_MAX_REPORTS 8
+#define HID_MAX_REPORT_SIZE 64		// bytes, without the report ID
+#define HID_REPORT_STRIDE (1 + HID_MAX_REPORT_SIZE + 8)
+#define HID_MAX_BIT_OPS 512
+#define HID_MAX_VALUE_OPS 16
+#define HID_MAX_ARRAY_OPS 4
+#define HID_MAX_KEYS 32
+
+// Bits of hid_state.bits: a keyboard usage is its own bit, button N is
+// bit HID_STATE_BUTTON + N - 1.
+#define HID_STATE_BUTTON 256
+#define HID_STATE_BITS (HID_STATE_BUTTON + 32)
+
+enum hid_axis {
+	HID_AXIS_X,
+	HID_AXIS_Y,
+	HID_AXIS_WHEEL,
+	HID_AXIS_PAN,
+	HID_NUM_AXES,
+};
+
+struct hid_state {
+	unsigned char bits[HID_STATE_BITS / 8];
+	// Pressed keyboard usages other than modifiers in the order they
+	// were pressed, for array fields.
+	unsigned char keys[HID_MAX_KEYS];
+	unsigned int num_keys;
+	int axes[HID_NUM_AXES];		// relative, for this report only
+};
+
+// A 1-bit variable field: state bit src goes to buffer bit dst.
+struct hid_bit_op {
+	unsigned short src;
+	unsigned short dst;
+};
+
+// A variable field holding an axis, clamped to the logical range.
+struct hid_value_op {
+	unsigned short dst;
+	unsigned char size;
+	unsigned char axis;
+	int min, max;
+};
+
+// An array field of keyboard usages from usage_min to usage_max, holding
+// the first count pressed ones, each as usage + base.
+struct hid_array_op {
+	unsigned short dst;
+	unsigned char size;
+	unsigned char count;
+	unsigned char usage_min, usage_max;
+	int base;
+};
+
+struct hid_report_layout {
+	unsigned char id;		// 0 if the descriptor has no report IDs
+	unsigned short bits;		// without the report ID
+	unsigned short len;		// bytes on the wire, with the report ID
+};
+
+struct hid_layout {
+	struct hid_report_layout reports[HID_MAX_REPORTS];
+	int num_reports;
+	struct hid_bit_op bit_ops[HID_MAX_BIT_OPS];
+	int num_bit_ops;
+	struct hid_value_op value_ops[HID_MAX_VALUE_OPS];
+	int num_value_ops;
+	struct hid_array_op array_ops[HID_MAX_ARRAY_OPS];
+	int num_array_ops;
+};
+
+// Compiles a report descriptor. Returns an error message or NULL.
+const char *hid_compile(struct hid_layout *layout, const char *desc,
+			unsigned int len);
+
+// Packs every report of the layout into out, which has HID_REPORT_STRIDE
+// bytes per report.
+void hid_pack(const struct hid_layout *layout, const struct hid_state *state,
+		char *out);
+
+#endif // HID_H
@@ -0,0 +1,672 @@
+// Replays the host side of a session captured with keyboard.c -w.
+//
+// Every connection in the capture gets a connection to the server, over
+// TCP or over a socketpair handed to a server that the replayer starts
+// itself, and is sent the frames the host sent, either at the recorded
+// times or as fast as the server answers (-m). A frame only goes out once
+// the replies that preceded it in the capture have come back, so URBs
+// are never more in flight than they were when it was recorded. Replies
+// are matched to the recorded ones by seqnum and compared byte for byte.
+//
+//   ./replay -m session.cap -- ./keyboard -d devices/storage.txt
+//   ./replay -H 127.0.0.1 session.cap
+//   ./replay -l session.cap
+//
+// -l lists the records instead, with the time since the start of the
+// capture and since the previous record of the connection.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/usb/ch9.h>
+
+#include "capture.h"
+#include "client.h"
+#include "usbip.h"
+
+/*----------------------------------------------------------------------*/
+
+#define MAX_CONNS 256
+#define MAX_PENDING 4096	// seqnums tracked per connection, power of two
+#define RX_BUF_SIZE (256 * 1024)
+
+struct replay_conn {
+	unsigned int id;		// in the capture
+	int fd;
+	bool done;
+	bool stalled;
+
+	// Frames of the connection in the capture. need[i] is how many
+	// device frames have to be back before host[i] is sent.
+	const struct capture_record **host;
+	unsigned int *need;
+	unsigned int num_host;
+	const struct capture_record **device;
+	unsigned int num_device;
+	unsigned int *by_seqnum;	// device index + 1, open addressing
+	unsigned int by_seqnum_mask;
+
+	unsigned int next_host;
+	size_t sent;			// of host[next_host]
+	unsigned int received;
+	bool urb_state;			// imported, exchanging URBs
+	bool in[MAX_PENDING];		// direction of submitted URBs
+
+	char rx[RX_BUF_SIZE];
+	unsigned int rx_len;
+	unsigned long last_progress;
+
+	struct {
+		unsigned long host_bytes;
+		unsigned long device_bytes;
+		unsigned long mismatches;
+	} stats;
+};
+
+struct replay_conn *conns[MAX_CONNS];
+int num_conns;
+
+const char *capture;
+size_t capture_size;
+unsigned long capture_start = ~0UL;
+unsigned long capture_end;
+
+bool max_speed;
+unsigned long stall_ns = 2000000000UL;
+
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		perror("realloc()");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Frames are told apart by their first bytes: URB frames start with a
+// USBIP_CMD_* or USBIP_RET_* command, frames before the import with the
+// 0x0111 protocol version.
+bool frame_is_urb(const struct capture_record *rec) {
+	return rec->len >= sizeof(struct usbip_header) &&
+		ntohl(*(const __u32 *)capture_record_data(rec)) <=
+			USBIP_RET_UNLINK;
+}
+
+struct usbip_header_basic frame_header(const struct capture_record *rec) {
+	struct usbip_header_basic basic;
+	memcpy(&basic, capture_record_data(rec), sizeof(basic));
+	unpack_usbip_header_basic(&basic);
+	return basic;
+}
+
+bool frame_is_import_ok(const char *data, unsigned int len) {
+	struct usbip_op_common common;
+	if (len < sizeof(common))
+		return false;
+	memcpy(&common, data, sizeof(common));
+	unpack_usbip_op_common(&common);
+	return common.code == OP_REP_IMPORT && common.status == ST_OK;
+}
+
+struct replay_conn *find_conn(unsigned int id) {
+	for (int i = 0; i < num_conns; i++) {
+		if (conns[i]->id == id)
+			return conns[i];
+	}
+	if (num_conns == MAX_CONNS) {
+		fprintf(stderr, "too many connections in the capture\n");
+		exit(EXIT_FAILURE);
+	}
+	struct replay_conn *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	conn->id = id;
+	conn->fd = -1;
+	conns[num_conns++] = conn;
+	return conn;
+}
+
+// Calls fn on every record, exits if the capture is malformed.
+void capture_walk(void (*fn)(const struct capture_record *rec)) {
+	size_t off = sizeof(struct capture_file_header);
+	while (off < capture_size) {
+		const struct capture_record *rec =
+			(const struct capture_record *)(capture + off);
+		if (capture_size - off < sizeof(*rec) ||
+		    capture_size - off < capture_record_size(rec)) {
+			fprintf(stderr, "truncated record at %zu\n", off);
+			exit(EXIT_FAILURE);
+		}
+		fn(rec);
+		off += capture_record_size(rec);
+	}
+}
+
+void load_record(const struct capture_record *rec) {
+	if (rec->ts < capture_start)
+		capture_start = rec->ts;
+	if (rec->ts > capture_end)
+		capture_end = rec->ts;
+	if (rec->type != CAPTURE_HOST && rec->type != CAPTURE_DEVICE)
+		return;
+
+	struct replay_conn *conn = find_conn(rec->conn);
+	if (rec->type == CAPTURE_DEVICE) {
+		conn->device = xrealloc(conn->device,
+			(conn->num_device + 1) * sizeof(conn->device[0]));
+		conn->device[conn->num_device++] = rec;
+		return;
+	}
+
+	// A URB that is turned down before all of its OUT data is in gets
+	// its reply before the frame is complete and recorded. That reply
+	// can't be something the frame waits for.
+	unsigned int need = conn->num_device;
+	if (frame_is_urb(rec)) {
+		__u32 seqnum = frame_header(rec).seqnum;
+		while (need > 0 && frame_is_urb(conn->device[need - 1]) &&
+		       frame_header(conn->device[need - 1]).seqnum == seqnum &&
+		       (conn->num_host == 0 ||
+			conn->device[need - 1]->ts >
+				conn->host[conn->num_host - 1]->ts))
+			need--;
+	}
+	conn->host = xrealloc(conn->host,
+			(conn->num_host + 1) * sizeof(conn->host[0]));
+	conn->need = xrealloc(conn->need,
+			(conn->num_host + 1) * sizeof(conn->need[0]));
+	conn->host[conn->num_host] = rec;
+	conn->need[conn->num_host++] = need;
+}
+
+void index_replies(struct replay_conn *conn) {
+	unsigned int size = 16;
+	while (size < 2 * conn->num_device)
+		size *= 2;
+	conn->by_seqnum = calloc(size, sizeof(conn->by_seqnum[0]));
+	if (conn->by_seqnum == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	conn->by_seqnum_mask = size - 1;
+	for (unsigned int i = 0; i < conn->num_device; i++) {
+		if (!frame_is_urb(conn->device[i]))
+			continue;
+		__u32 seqnum = frame_header(conn->device[i]).seqnum;
+		unsigned int slot = seqnum & conn->by_seqnum_mask;
+		while (conn->by_seqnum[slot] != 0)
+			slot = (slot + 1) & conn->by_seqnum_mask;
+		conn->by_seqnum[slot] = i + 1;
+	}
+}
+
+const struct capture_record *find_reply(struct replay_conn *conn,
+					__u32 seqnum) {
+	unsigned int slot = seqnum & conn->by_seqnum_mask;
+	for (; conn->by_seqnum[slot] != 0;
+			slot = (slot + 1) & conn->by_seqnum_mask) {
+		const struct capture_record *rec =
+			conn->device[conn->by_seqnum[slot] - 1];
+		if (frame_header(rec).seqnum == seqnum)
+			return rec;
+	}
+	return NULL;
+}
+
+void load_capture(const char *path, int only_conn) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open()");
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat()");
+		exit(EXIT_FAILURE);
+	}
+	capture_size = st.st_size;
+	if (capture_size < sizeof(struct capture_file_header)) {
+		fprintf(stderr, "%s: not a capture\n", path);
+		exit(EXIT_FAILURE);
+	}
+	capture = mmap(NULL, capture_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (capture == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	const struct capture_file_header *header =
+		(const struct capture_file_header *)capture;
+	if (memcmp(&header->magic[0], CAPTURE_MAGIC, sizeof(header->magic))
+			!= 0 || header->version != CAPTURE_VERSION ||
+	    header->record_size != sizeof(struct capture_record)) {
+		fprintf(stderr, "%s: not a capture or an unsupported "
+			"version\n", path);
+		exit(EXIT_FAILURE);
+	}
+	capture_walk(load_record);
+
+	// Connections that never sent anything have nothing to replay.
+	int n = 0;
+	for (int i = 0; i < num_conns; i++) {
+		if (conns[i]->num_host == 0 ||
+		    (only_conn > 0 && conns[i]->id != only_conn))
+			continue;
+		index_replies(conns[i]);
+		conns[n++] = conns[i];
+	}
+	num_conns = n;
+	if (num_conns == 0) {
+		fprintf(stderr, "%s: nothing to replay\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+const char *command_name(__u32 command) {
+	switch (command) {
+	case USBIP_CMD_SUBMIT:
+		return "CMD_SUBMIT";
+	case USBIP_CMD_UNLINK:
+		return "CMD_UNLINK";
+	case USBIP_RET_SUBMIT:
+		return "RET_SUBMIT";
+	case USBIP_RET_UNLINK:
+		return "RET_UNLINK";
+	}
+	return "?";
+}
+
+unsigned long list_last[MAX_CONNS + 1];
+
+void list_record(const struct capture_record *rec) {
+	unsigned int slot = rec->conn <= MAX_CONNS ? rec->conn : 0;
+	unsigned long since = list_last[slot] ? rec->ts - list_last[slot] : 0;
+	list_last[slot] = rec->ts;
+	printf("%12.6f %+10.3f ms  conn %-3u ",
+		(rec->ts - capture_start) / 1e9, since / 1e6, rec->conn);
+
+	const char *data = capture_record_data(rec);
+	switch (rec->type) {
+	case CAPTURE_OPEN:
+		printf("open %.*s\n", (int)rec->len, data);
+		return;
+	case CAPTURE_CLOSE:
+		printf("close\n");
+		return;
+	}
+
+	const char *dir = rec->type == CAPTURE_HOST ? "host  " : "device";
+	if (!frame_is_urb(rec)) {
+		struct usbip_op_common common;
+		memcpy(&common, data, sizeof(common));
+		unpack_usbip_op_common(&common);
+		printf("%s op 0x%04x status %u, %u bytes\n", dir, common.code,
+			common.status, rec->len);
+		return;
+	}
+
+	struct usbip_header uh;
+	memcpy(&uh, data, sizeof(uh));
+	unpack_usbip_header_basic(&uh.base);
+	printf("%s %s seqnum %u", dir, command_name(uh.base.command),
+		uh.base.seqnum);
+	switch (uh.base.command) {
+	case USBIP_CMD_SUBMIT:
+		unpack_usbip_header_cmd_submit(&uh.u.cmd_submit);
+		printf(" ep %u %s length %d", uh.base.ep,
+			uh.base.direction == USBIP_DIR_IN ? "in" : "out",
+			uh.u.cmd_submit.transfer_buffer_length);
+		if (uh.u.cmd_submit.number_of_packets > 0)
+			printf(" packets %d", uh.u.cmd_submit.number_of_packets);
+		if (uh.base.ep == 0) {
+			printf(" setup");
+			for (int i = 0; i < 8; i++)
+				printf(" %02x", (unsigned char)
+					uh.u.cmd_submit.setup[i]);
+		}
+		break;
+	case USBIP_RET_SUBMIT:
+		unpack_usbip_header_ret_submit(&uh.u.ret_submit);
+		printf(" status %d actual %d", uh.u.ret_submit.status,
+			uh.u.ret_submit.actual_length);
+		break;
+	case USBIP_CMD_UNLINK:
+		unpack_usbip_header_cmd_unlink(&uh.u.cmd_unlink);
+		printf(" unlinks %u", uh.u.cmd_unlink.seqnum);
+		break;
+	case USBIP_RET_UNLINK:
+		unpack_usbip_header_ret_unlink(&uh.u.ret_unlink);
+		printf(" status %d", uh.u.ret_unlink.status);
+		break;
+	}
+	printf("\n");
+}
+
+/*----------------------------------------------------------------------*/
+
+void conn_finish(struct replay_conn *conn, bool stalled) {
+	conn->done = true;
+	conn->stalled = stalled;
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+// Sends whatever the connection may send by now. Returns the time the
+// next frame is due, 0 if it isn't waiting for a time.
+unsigned long conn_send(struct replay_conn *conn, unsigned long start,
+			unsigned long now) {
+	while (conn->next_host < conn->num_host) {
+		const struct capture_record *rec = conn->host[conn->next_host];
+		if (conn->received < conn->need[conn->next_host])
+			return 0;
+		unsigned long due = start + (rec->ts - capture_start);
+		if (!max_speed && now < due)
+			return due;
+
+		const char *data = capture_record_data(rec);
+		ssize_t rv = send(conn->fd, data + conn->sent,
+				rec->len - conn->sent,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rv < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror("send()");
+			conn_finish(conn, false);
+			return 0;
+		}
+		conn->sent += rv;
+		conn->stats.host_bytes += rv;
+		conn->last_progress = now;
+		if (conn->sent < rec->len)
+			return 0;
+
+		if (frame_is_urb(rec)) {
+			struct usbip_header_basic basic = frame_header(rec);
+			if (basic.command == USBIP_CMD_SUBMIT)
+				conn->in[basic.seqnum & (MAX_PENDING - 1)] =
+					basic.direction == USBIP_DIR_IN;
+		}
+		conn->next_host++;
+		conn->sent = 0;
+	}
+	return 0;
+}
+
+// Returns the size of the reply at the head of rx, 0 if more is needed
+// to tell, -1 if it makes no sense.
+long reply_size(struct replay_conn *conn) {
+	if (!conn->urb_state) {
+		if (conn->received == conn->num_device)
+			return -1;
+		return conn->device[conn->received]->len;
+	}
+	if (conn->rx_len < sizeof(struct usbip_header))
+		return 0;
+
+	struct usbip_header uh;
+	memcpy(&uh, &conn->rx[0], sizeof(uh));
+	unpack_usbip_header_basic(&uh.base);
+	if (uh.base.command == USBIP_RET_UNLINK)
+		return sizeof(uh);
+	if (uh.base.command != USBIP_RET_SUBMIT)
+		return -1;
+	unpack_usbip_header_ret_submit(&uh.u.ret_submit);
+	long size = sizeof(uh);
+	if (conn->in[uh.base.seqnum & (MAX_PENDING - 1)] &&
+	    uh.u.ret_submit.actual_length > 0)
+		size += uh.u.ret_submit.actual_length;
+	if (uh.u.ret_submit.number_of_packets > 0)
+		size += uh.u.ret_submit.number_of_packets *
+			sizeof(struct usbip_iso_packet_descriptor);
+	return size;
+}
+
+void conn_reply(struct replay_conn *conn, const char *data, unsigned int len) {
+	const struct capture_record *rec;
+	if (!conn->urb_state) {
+		rec = conn->device[conn->received];
+		conn->urb_state = frame_is_import_ok(data, len);
+	} else {
+		struct usbip_header_basic basic;
+		memcpy(&basic, data, sizeof(basic));
+		unpack_usbip_header_basic(&basic);
+		rec = find_reply(conn, basic.seqnum);
+	}
+	if (rec == NULL || rec->len != len ||
+	    memcmp(capture_record_data(rec), data, len) != 0)
+		conn->stats.mismatches++;
+	conn->received++;
+	conn->stats.device_bytes += len;
+}
+
+void conn_recv(struct replay_conn *conn, unsigned long now) {
+	ssize_t rv = recv(conn->fd, &conn->rx[conn->rx_len],
+			sizeof(conn->rx) - conn->rx_len, MSG_DONTWAIT);
+	if (rv < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("recv()");
+		conn_finish(conn, false);
+		return;
+	}
+	if (rv == 0) {
+		if (conn->received < conn->num_device)
+			fprintf(stderr, "conn %u: closed by the server after "
+				"%u of %u replies\n", conn->id,
+				conn->received, conn->num_device);
+		conn_finish(conn, false);
+		return;
+	}
+	conn->rx_len += rv;
+	conn->last_progress = now;
+
+	unsigned int offset = 0;
+	while (true) {
+		conn->rx_len -= offset;
+		memmove(&conn->rx[0], &conn->rx[offset], conn->rx_len);
+		offset = 0;
+		long size = reply_size(conn);
+		if (size < 0 || size > sizeof(conn->rx)) {
+			fprintf(stderr, "conn %u: unexpected reply\n",
+				conn->id);
+			conn->stats.mismatches++;
+			conn_finish(conn, false);
+			return;
+		}
+		if (size == 0 || conn->rx_len < size)
+			return;
+		conn_reply(conn, &conn->rx[0], size);
+		offset = size;
+	}
+}
+
+void replay(void) {
+	struct pollfd pfds[MAX_CONNS];
+	unsigned long start = now_ns();
+	for (int i = 0; i < num_conns; i++)
+		conns[i]->last_progress = start;
+
+	while (true) {
+		unsigned long now = now_ns();
+		unsigned long wake = now + stall_ns;
+		int n = 0;
+		for (int i = 0; i < num_conns; i++) {
+			struct replay_conn *conn = conns[i];
+			if (conn->done)
+				continue;
+			unsigned long due = conn_send(conn, start, now);
+			if (conn->done)
+				continue;
+			if (conn->next_host == conn->num_host &&
+			    conn->received >= conn->num_device) {
+				conn_finish(conn, false);
+				continue;
+			}
+			if (now - conn->last_progress >= stall_ns &&
+			    (due == 0 || due <= now)) {
+				fprintf(stderr, "conn %u: stalled after %u of "
+					"%u frames, %u of %u replies\n",
+					conn->id, conn->next_host,
+					conn->num_host, conn->received,
+					conn->num_device);
+				conn_finish(conn, true);
+				continue;
+			}
+			if (due != 0 && due < wake)
+				wake = due;
+			if (due == 0 && conn->last_progress + stall_ns < wake)
+				wake = conn->last_progress + stall_ns;
+
+			pfds[n].fd = conn->fd;
+			pfds[n].events = POLLIN;
+			if (conn->sent > 0)
+				pfds[n].events |= POLLOUT;
+			n++;
+		}
+		if (n == 0)
+			break;
+
+		unsigned long timeout = wake > now ? wake - now : 0;
+		struct timespec ts = {
+			.tv_sec = timeout / 1000000000UL,
+			.tv_nsec = timeout % 1000000000UL,
+		};
+		if (ppoll(&pfds[0], n, &ts, NULL) < 0 && errno != EINTR) {
+			perror("ppoll()");
+			exit(EXIT_FAILURE);
+		}
+		now = now_ns();
+		for (int i = 0, j = 0; i < num_conns && j < n; i++) {
+			struct replay_conn *conn = conns[i];
+			if (conn->done || conn->fd != pfds[j].fd)
+				continue;
+			if (pfds[j++].revents & (POLLIN | POLLHUP | POLLERR))
+				conn_recv(conn, now);
+		}
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-H host] [-p port] [-c conn] [-m] "
+		"[-t stall_ms] capture [-- server args...]\n"
+		"       %s -l capture\n", argv0, argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *host = "127.0.0.1";
+	int port = USBIP_PORT;
+	int only_conn = 0;
+	bool list = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:lmt:")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			only_conn = atoi(optarg);
+			if (only_conn < 1)
+				usage(argv[0]);
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'm':
+			max_speed = true;
+			break;
+		case 't':
+			stall_ns = strtoul(optarg, NULL, 0) * 1000000UL;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+	const char *path = argv[optind++];
+
+	load_capture(path, only_conn);
+	if (list) {
+		capture_walk(list_record);
+		return 0;
+	}
+
+	pid_t server_pid = -1;
+	if (optind < argc) {
+		int fds[MAX_CONNS];
+		server_pid = spawn_server(&argv[optind], argc - optind, NULL,
+					&fds[0], num_conns);
+		for (int i = 0; i < num_conns; i++)
+			conns[i]->fd = fds[i];
+	} else {
+		for (int i = 0; i < num_conns; i++)
+			conns[i]->fd = connect_tcp(host, port);
+	}
+
+	unsigned long start = now_ns();
+	replay();
+	unsigned long elapsed = now_ns() - start;
+
+	unsigned long frames = 0, replies = 0, bytes = 0, mismatches = 0;
+	int stalled = 0;
+	for (int i = 0; i < num_conns; i++) {
+		frames += conns[i]->next_host;
+		replies += conns[i]->received;
+		bytes += conns[i]->stats.host_bytes +
+			conns[i]->stats.device_bytes;
+		mismatches += conns[i]->stats.mismatches;
+		stalled += conns[i]->stalled;
+	}
+	printf("%d connections, %lu frames and %lu replies in %.3f s "
+		"(recorded %.3f s)\n", num_conns, frames, replies,
+		elapsed / 1e9, (capture_end - capture_start) / 1e9);
+	printf("%.0f frames/s, %.1f MB/s\n",
+		(frames + replies) / (elapsed / 1e9),
+		bytes / (elapsed / 1e9) / 1e6);
+	printf("%lu replies differ from the capture, %d connections "
+		"stalled\n", mismatches, stalled);
+
+	if (server_pid > 0) {
+		int status;
+		waitpid(server_pid, &status, 0);
+	}
+
+	return mismatches == 0 && stalled == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -13,10 +13,17 @@ modprobe usbip_core
 
 echo 1 > /proc/sys/kernel/sysrq
 
-gcc keyboard.c -o keyboard
-./keyboard &
-usbip attach -r 127.0.0.1 -b 1-1
+gcc keyboard.c server.c hid.c storage.c uring.c -o keyboard -pthread
 
-sleep 3
+# The keyboard attaches itself to vhci_hcd and writes "ready" to fd 3,
+# which is the pipe read here, once the kernel has configured it. With
+# -x it detaches and exits once usbhid has polled all keys out of it.
+exec {READY_FD}< <(exec ./keyboard -a -x -r 3 3>&1 >&2)
+PID=$!
+if ! read -r -u $READY_FD READY || [ "$READY" != ready ]; then
+	echo "keyboard failed to attach" >&2
+	exit 1
+fi
+wait $PID
 
 echo "Done! Check dmesg."
@@ -0,0 +1,2986 @@
+// USB/IP server of keyboard.c and fuzz.c: device models, connections,
+// endpoint queues, report streams and workers, see server.h.
+//
+// Derived from:
+// - https://github.com/xairy/raw-gadget/blob/master/examples/keyboard.c
+// - https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/usb/usbip/libsrc/usbip_common.h
+// - https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/drivers/usb/usbip/usbip_common.h
+// - https://github.com/lcgamboa/USBIP-Virtual-USB-Device
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <linux/errqueue.h>
+#include <linux/hid.h>
+#include <linux/usb/ch9.h>
+
+#include "capture.h"
+#include "server.h"
+#include "usbip.h"
+#include "../trace/trace.h"
+
+/*----------------------------------------------------------------------*/
+
+#define MAX_PACKET_SIZE 64
+
+#define USB_VENDOR 0x046d
+#define USB_PRODUCT 0xc312
+
+#define STRING_ID_MANUFACTURER 0
+#define STRING_ID_PRODUCT 1
+#define STRING_ID_SERIAL 2
+#define STRING_ID_CONFIG 3
+#define STRING_ID_INTERFACE 4
+
+struct usb_device_descriptor usb_device = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = __constant_cpu_to_le16(0x0200),
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = MAX_PACKET_SIZE,
+	.idVendor = __constant_cpu_to_le16(USB_VENDOR),
+	.idProduct = __constant_cpu_to_le16(USB_PRODUCT),
+	.bcdDevice = 0,
+	.iManufacturer = STRING_ID_MANUFACTURER,
+	.iProduct = STRING_ID_PRODUCT,
+	.iSerialNumber = STRING_ID_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+struct usb_qualifier_descriptor usb_qualifier = {
+	.bLength = sizeof(struct usb_qualifier_descriptor),
+	.bDescriptorType = USB_DT_DEVICE_QUALIFIER,
+	.bcdUSB = __constant_cpu_to_le16(0x0200),
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = MAX_PACKET_SIZE,
+	.bNumConfigurations = 1,
+	.bRESERVED = 0,
+};
+
+struct usb_config_descriptor usb_config = {
+	.bLength =		USB_DT_CONFIG_SIZE,
+	.bDescriptorType =	USB_DT_CONFIG,
+	.wTotalLength =		0,  // computed later
+	.bNumInterfaces =	1,
+	.bConfigurationValue =	1,
+	.iConfiguration = 	STRING_ID_CONFIG,
+	.bmAttributes =		USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+	.bMaxPower =		0x32,
+};
+
+struct usb_interface_descriptor usb_interface = {
+	.bLength =		USB_DT_INTERFACE_SIZE,
+	.bDescriptorType =	USB_DT_INTERFACE,
+	.bInterfaceNumber =	0,
+	.bAlternateSetting =	0,
+	.bNumEndpoints =	1,
+	.bInterfaceClass =	USB_CLASS_HID,
+	.bInterfaceSubClass =	1,
+	.bInterfaceProtocol =	1,
+	.iInterface =		STRING_ID_INTERFACE,
+};
+
+struct usb_endpoint_descriptor usb_endpoint = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+	.bEndpointAddress =	USB_DIR_IN | 1,
+	.bmAttributes =		USB_ENDPOINT_XFER_INT,
+	.wMaxPacketSize =	8,
+	.bInterval =		5,
+};
+
+char usb_hid_report[] = {
+	0x05, 0x01,                    // Usage Page (Generic Desktop)        0
+	0x09, 0x06,                    // Usage (Keyboard)                    2
+	0xa1, 0x01,                    // Collection (Application)            4
+	0x05, 0x07,                    //  Usage Page (Keyboard)              6
+	0x19, 0xe0,                    //  Usage Minimum (224)                8
+	0x29, 0xe7,                    //  Usage Maximum (231)                10
+	0x15, 0x00,                    //  Logical Minimum (0)                12
+	0x25, 0x01,                    //  Logical Maximum (1)                14
+	0x75, 0x01,                    //  Report Size (1)                    16
+	0x95, 0x08,                    //  Report Count (8)                   18
+	0x81, 0x02,                    //  Input (Data,Var,Abs)               20
+	0x95, 0x01,                    //  Report Count (1)                   22
+	0x75, 0x08,                    //  Report Size (8)                    24
+	0x81, 0x01,                    //  Input (Cnst,Arr,Abs)               26
+	0x95, 0x03,                    //  Report Count (3)                   28
+	0x75, 0x01,                    //  Report Size (1)                    30
+	0x05, 0x08,                    //  Usage Page (LEDs)                  32
+	0x19, 0x01,                    //  Usage Minimum (1)                  34
+	0x29, 0x03,                    //  Usage Maximum (3)                  36
+	0x91, 0x02,                    //  Output (Data,Var,Abs)              38
+	0x95, 0x05,                    //  Report Count (5)                   40
+	0x75, 0x01,                    //  Report Size (1)                    42
+	0x91, 0x01,                    //  Output (Cnst,Arr,Abs)              44
+	0x95, 0x06,                    //  Report Count (6)                   46
+	0x75, 0x08,                    //  Report Size (8)                    48
+	0x15, 0x00,                    //  Logical Minimum (0)                50
+	0x26, 0xff, 0x00,              //  Logical Maximum (255)              52
+	0x05, 0x07,                    //  Usage Page (Keyboard)              55
+	0x19, 0x00,                    //  Usage Minimum (0)                  57
+	0x2a, 0xff, 0x00,              //  Usage Maximum (255)                59
+	0x81, 0x00,                    //  Input (Data,Arr,Abs)               62
+	0xc0,                          // End Collection                      64
+};
+
+struct hid_descriptor usb_hid = {
+	.bLength =		9,
+	.bDescriptorType =	HID_DT_HID,
+	.bcdHID =		__constant_cpu_to_le16(0x0110),
+	.bCountryCode =		0,
+	.bNumDescriptors =	1,
+	.desc =			{
+		{
+			.bDescriptorType =	HID_DT_REPORT,
+			.wDescriptorLength =	sizeof(usb_hid_report),
+		}
+	},
+};
+
+/*----------------------------------------------------------------------*/
+
+struct device_model *models[MAX_MODELS];
+int num_models;
+
+int append_desc(char *data, int length, int offset, void *desc, int size) {
+	assert(offset + size <= length);
+	memcpy(data + offset, desc, size);
+	return offset + size;
+}
+
+int build_config(struct device_model *model, char *data, int length) {
+	struct usb_config_descriptor *config =
+		(struct usb_config_descriptor *)data;
+	int total_length = 0;
+
+	total_length = append_desc(data, length, total_length,
+				&model->config, sizeof(model->config));
+	for (int i = 0; i < model->num_ifaces; i++) {
+		struct interface_model *iface = &model->ifaces[i];
+
+		total_length = append_desc(data, length, total_length,
+					&iface->desc, sizeof(iface->desc));
+		if (iface->desc.bInterfaceClass == USB_CLASS_HID)
+			total_length = append_desc(data, length, total_length,
+					&iface->hid, iface->hid.bLength);
+		for (int j = 0; j < iface->num_eps; j++)
+			total_length = append_desc(data, length, total_length,
+					&iface->eps[j].desc,
+					USB_DT_ENDPOINT_SIZE);
+	}
+
+	config->wTotalLength = __cpu_to_le16(total_length);
+	printf("%s: config->wTotalLength: %d\n", model->name, total_length);
+
+	return total_length;
+}
+
+// Index 0 holds the list of supported language IDs, the others are
+// UTF-16LE encoded strings.
+void build_string(struct desc_cache *cache, int index, const char *str) {
+	char *data = &cache->string_data[index][0];
+	int len = 0;
+
+	if (index == 0) {
+		data[2] = 0x09;		// en-US
+		data[3] = 0x04;
+		len = 1;
+	} else {
+		for (; str[len] != 0 && len < MAX_STRING_LEN; len++) {
+			data[2 + 2 * len] = str[len];
+			data[2 + 2 * len + 1] = 0;
+		}
+	}
+	data[0] = 2 + 2 * len;
+	data[1] = USB_DT_STRING;
+	cache->strings[index].data = data;
+	cache->strings[index].len = 2 + 2 * len;
+}
+
+void desc_cache_init(struct device_model *model) {
+	struct desc_cache *cache = &model->cache;
+
+	cache->device.data = (char *)&model->device;
+	cache->device.len = sizeof(model->device);
+	cache->qualifier.data = (char *)&model->qualifier;
+	cache->qualifier.len = sizeof(model->qualifier);
+
+	cache->config.data = &cache->config_data[0];
+	cache->config.len = build_config(model, &cache->config_data[0],
+					sizeof(cache->config_data));
+
+	for (int i = 0; i < model->num_ifaces; i++) {
+		struct interface_model *iface = &model->ifaces[i];
+		if (iface->desc.bInterfaceClass != USB_CLASS_HID)
+			continue;
+		cache->hid[i].data = (char *)&iface->hid;
+		cache->hid[i].len = iface->hid.bLength;
+		cache->hid_report[i].data = &iface->hid_report[0];
+		cache->hid_report[i].len = iface->hid_report_len;
+	}
+
+	for (int i = 0; i < MAX_STRING_DESCS; i++)
+		build_string(cache, i, model->strings[i][0] ?
+					model->strings[i] : USB_STRING);
+}
+
+// HID class descriptors are looked up by the interface number in wIndex.
+struct desc_blob *desc_lookup(struct desc_cache *cache, int type, int index,
+				int interface) {
+	struct desc_blob *blob;
+
+	switch (type) {
+	case USB_DT_DEVICE:
+		return &cache->device;
+	case USB_DT_DEVICE_QUALIFIER:
+		return &cache->qualifier;
+	case USB_DT_CONFIG:
+		return &cache->config;
+	case USB_DT_STRING:
+		if (index >= MAX_STRING_DESCS)
+			index = MAX_STRING_DESCS - 1;
+		return &cache->strings[index];
+	case HID_DT_HID:
+	case HID_DT_REPORT:
+		if (interface >= MAX_INTERFACES)
+			return NULL;
+		blob = (type == HID_DT_HID) ? &cache->hid[interface] :
+					&cache->hid_report[interface];
+		return blob->data ? blob : NULL;
+	default:
+		return NULL;
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+// Sizes of the arena's free list classes, see struct arena.
+const unsigned int buf_class_size[NUM_BUF_CLASSES] = {
+	64, 512, 4096, 32 * 1024, MAX_URB_BUFFER,
+};
+
+int arena_init(struct arena *arena) {
+	memset(arena, 0, sizeof(*arena));
+	arena->base = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena->base == MAP_FAILED) {
+		perror("mmap(arena)");
+		arena->base = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void arena_destroy(struct arena *arena) {
+	if (arena->base != NULL)
+		munmap(arena->base, ARENA_SIZE);
+	arena->base = NULL;
+}
+
+int buf_class(unsigned int len) {
+	for (int class = 0; class < NUM_BUF_CLASSES; class++) {
+		if (len <= buf_class_size[class])
+			return class;
+	}
+	return -1;
+}
+
+// Returns NULL with errno set if len is too large or the arena is full.
+void *arena_alloc(struct arena *arena, unsigned int len, int *class) {
+	*class = buf_class(len);
+	if (*class < 0) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	void *buf = arena->free[*class];
+	if (buf != NULL) {
+		arena->free[*class] = *(void **)buf;
+		arena->allocs++;
+		arena->reused++;
+		return buf;
+	}
+	unsigned int size = buf_class_size[*class];
+	if (arena->base == NULL || ARENA_SIZE - arena->used < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	buf = arena->base + arena->used;
+	arena->used += size;
+	arena->allocs++;
+	return buf;
+}
+
+void arena_free(struct arena *arena, void *buf, int class) {
+	*(void **)buf = arena->free[class];
+	arena->free[class] = buf;
+}
+
+int urb_table_init(struct urb_table *table) {
+	memset(table, 0, sizeof(*table));
+	for (int i = 0; i < MAX_INFLIGHT_URBS - 1; i++)
+		table->urbs[i].next = &table->urbs[i + 1];
+	table->free = &table->urbs[0];
+	return arena_init(&table->arena);
+}
+
+struct urb **urb_bucket(struct urb_table *table, __u32 seqnum) {
+	return &table->buckets[seqnum & (URB_HASH_SIZE - 1)];
+}
+
+struct urb *urb_lookup(struct urb_table *table, __u32 seqnum) {
+	struct urb *urb = *urb_bucket(table, seqnum);
+	while (urb != NULL && urb->seqnum != seqnum)
+		urb = urb->hash_next;
+	return urb;
+}
+
+// Returns NULL with errno set if there is no room for the URB or its
+// transfer buffer.
+struct urb *urb_alloc(struct urb_table *table, __u32 seqnum, int ep,
+			unsigned int length) {
+	struct urb *urb = table->free;
+	if (urb == NULL) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	char *buf = NULL;
+	int class = -1;
+	if (length != 0) {
+		buf = arena_alloc(&table->arena, length, &class);
+		if (buf == NULL)
+			return NULL;
+	}
+	table->free = urb->next;
+
+	struct urb **bucket = urb_bucket(table, seqnum);
+	memset(urb, 0, sizeof(*urb));
+	urb->seqnum = seqnum;
+	urb->ep = ep;
+	urb->length = length;
+	urb->buf = buf;
+	urb->buf_class = class;
+	urb->hash_next = *bucket;
+	*bucket = urb;
+	table->count++;
+	return urb;
+}
+
+struct usbip_iso_packet_descriptor *urb_iso_packets(struct urb *urb) {
+	return (struct usbip_iso_packet_descriptor *)(urb->buf + urb->length);
+}
+
+void urb_free(struct urb_table *table, struct urb *urb) {
+	struct urb **link = urb_bucket(table, urb->seqnum);
+	while (*link != urb)
+		link = &(*link)->hash_next;
+	*link = urb->hash_next;
+
+	if (urb->buf != NULL)
+		arena_free(&table->arena, urb->buf, urb->buf_class);
+	urb->buf = NULL;
+	urb->next = table->free;
+	table->free = urb;
+	table->count--;
+}
+
+// Set by -b for benchmarks: interrupt endpoints go without a timer like
+// bulk ones, so URBs complete as soon as they are queued, empty if there
+// is nothing to report, and round trips measure the server instead of
+// bInterval.
+bool unpaced = false;
+
+void ep_queue_push(struct ep_sched *sched, struct urb *urb) {
+	urb->prev = sched->last;
+	urb->next = NULL;
+	if (sched->last != NULL)
+		sched->last->next = urb;
+	else
+		sched->first = urb;
+	sched->last = urb;
+	sched->count++;
+}
+
+void ep_queue_remove(struct ep_sched *sched, struct urb *urb) {
+	if (urb->prev != NULL)
+		urb->prev->next = urb->next;
+	else
+		sched->first = urb->next;
+	if (urb->next != NULL)
+		urb->next->prev = urb->prev;
+	else
+		sched->last = urb->prev;
+	sched->count--;
+}
+
+// Replies at least this large are sent with MSG_ZEROCOPY, see -z.
+// Such replies must point to memory that outlives the send, like the
+// descriptors do.
+unsigned int zerocopy_threshold = 0;
+
+/*----------------------------------------------------------------------*/
+
+// Fills iov with the (at most two) segments of used or free space.
+int ring_iov(struct ring *ring, bool used, struct iovec *iov) {
+	unsigned int start = used ? ring->head : ring->tail;
+	unsigned int len = used ? ring_used(ring) : ring_free(ring);
+	unsigned int off = start & (ring->size - 1);
+	unsigned int first = ring->size - off;
+
+	if (len == 0)
+		return 0;
+	iov[0].iov_base = &ring->data[off];
+	if (len <= first) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = &ring->data[0];
+	iov[1].iov_len = len - first;
+	return 2;
+}
+
+void ring_peek(struct ring *ring, void *dst, unsigned int len) {
+	unsigned int off = ring->head & (ring->size - 1);
+	unsigned int first = ring->size - off;
+
+	if (len <= first) {
+		memcpy(dst, &ring->data[off], len);
+	} else {
+		memcpy(dst, &ring->data[off], first);
+		memcpy((char *)dst + first, &ring->data[0], len - first);
+	}
+}
+
+void ring_put(struct ring *ring, void *src, unsigned int len) {
+	unsigned int off = ring->tail & (ring->size - 1);
+	unsigned int first = ring->size - off;
+
+	if (len <= first) {
+		memcpy(&ring->data[off], src, len);
+	} else {
+		memcpy(&ring->data[off], src, first);
+		memcpy(&ring->data[0], (char *)src + first, len - first);
+	}
+	ring->tail += len;
+}
+
+// Returns a contiguous view of the first len bytes, copying them into
+// scratch only when they wrap around the end of the ring.
+char *ring_frame(struct ring *ring, unsigned int len, char *scratch) {
+	unsigned int off = ring->head & (ring->size - 1);
+
+	if (off + len <= ring->size)
+		return &ring->data[off];
+	ring_peek(ring, scratch, len);
+	return scratch;
+}
+
+/*----------------------------------------------------------------------*/
+
+int capture_fd = -1;
+void capture_frame(struct conn *conn, int type, struct iovec *iov,
+			int iovcnt);
+
+// Reading stops while replies are held back, see conn_handle_frames().
+int conn_poll(struct conn *conn, bool want_read, bool want_write) {
+	if (conn->want_read == want_read && conn->want_write == want_write)
+		return 0;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (want_read ? EPOLLIN | EPOLLRDHUP : 0) |
+			(want_write ? EPOLLOUT : 0);
+	ev.data.ptr = &conn->source;
+	if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	conn->want_read = want_read;
+	conn->want_write = want_write;
+	return 0;
+}
+
+int conn_want_write(struct conn *conn, bool want) {
+	return conn_poll(conn, conn->want_read, want);
+}
+
+// Returns how much the socket took, -1 on errors.
+ssize_t conn_sendmsg(struct conn *conn, struct iovec *iov, int iovcnt,
+			int flags) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	conn->stats.syscalls++;
+	ssize_t rv = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | flags);
+	if (rv < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		perror("sendmsg()");
+		return -1;
+	}
+	if (rv < 0)
+		return 0;
+	if (flags & MSG_ZEROCOPY)
+		conn->stats.zerocopy_sent++;
+	return rv;
+}
+
+// Sends a whole frame with a single sendmsg(). Whatever the socket does
+// not take right away is queued in conn->tx and flushed on EPOLLOUT;
+// frames queued behind it keep their order. io_uring connections queue
+// every frame and send the whole batch at once, except for frames that
+// don't fit into an empty ring. Only data from memory that outlives the
+// send (stable) may go out with MSG_ZEROCOPY, URB buffers get reused as
+// soon as the URB is freed. The kernel references zerocopy data until
+// the peer acks it, so the header in front of it, which is on the stack,
+// goes out first with a separate copying sendmsg().
+int conn_sendv(struct conn *conn, struct iovec *iov, int iovcnt,
+			bool stable) {
+	size_t total = 0, sent = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (capture_fd >= 0)
+		capture_frame(conn, CAPTURE_DEVICE, iov, iovcnt);
+
+	bool direct = !conn->uring || total > ring_free(&conn->tx);
+	if (direct && ring_used(&conn->tx) == 0) {
+		ssize_t rv;
+		if (conn->zerocopy && stable && iovcnt > 1 &&
+		    total >= zerocopy_threshold) {
+			rv = conn_sendmsg(conn, &iov[0], 1, MSG_MORE);
+			if (rv == iov[0].iov_len) {
+				ssize_t more = conn_sendmsg(conn, &iov[1],
+						iovcnt - 1, MSG_ZEROCOPY);
+				rv = more < 0 ? more : rv + more;
+			}
+		} else {
+			rv = conn_sendmsg(conn, iov, iovcnt, 0);
+		}
+		if (rv < 0)
+			return -1;
+		sent = rv;
+		if (sent == total)
+			return 0;
+	}
+
+	if (ring_free(&conn->tx) < total - sent) {
+		fprintf(stderr, "send queue overflow\n");
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
+		}
+		ring_put(&conn->tx, (char *)iov[i].iov_base + sent,
+			iov[i].iov_len - sent);
+		sent = 0;
+	}
+	if (conn->uring) {
+		uring_mark_dirty(conn);
+		return 0;
+	}
+	return conn_want_write(conn, true);
+}
+
+int conn_send(struct conn *conn, void *data, unsigned int size) {
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	return conn_sendv(conn, &iov, 1, true);
+}
+
+// Returns non-zero if the connection should be closed.
+int conn_flush(struct conn *conn) {
+	struct iovec iov[2];
+	int iovcnt = ring_iov(&conn->tx, true, &iov[0]);
+	if (iovcnt == 0)
+		return conn_want_write(conn, false);
+
+	conn->stats.syscalls++;
+	ssize_t rv = writev(conn->fd, &iov[0], iovcnt);
+	if (rv < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("writev()");
+		return -1;
+	}
+	conn->tx.head += rv;
+	if (ring_used(&conn->tx) == 0) {
+		if (conn->draining)
+			return 1;
+		if (conn_want_write(conn, false) < 0)
+			return -1;
+	}
+	return conn_resume(conn);
+}
+
+// MSG_ZEROCOPY completions arrive on the socket error queue and wake
+// epoll with EPOLLERR. Returns -1 if there was a real error instead.
+int conn_drain_errqueue(struct conn *conn) {
+	while (true) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		conn->stats.syscalls++;
+		if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0)
+			return (errno == EAGAIN) ? 0 : -1;
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		if (cm == NULL)
+			return -1;
+		struct sock_extended_err *err =
+			(struct sock_extended_err *)CMSG_DATA(cm);
+		if (err->ee_errno != 0 ||
+		    err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			return -1;
+		// ee_info..ee_data is the range of completed sends.
+		conn->stats.zerocopy_done += err->ee_data - err->ee_info + 1;
+	}
+}
+
+// Sends a RET_SUBMIT header made from ret followed by count (at most
+// two) segments of data.
+int usbip_send_ret_submit(struct conn *conn, __u32 seqnum,
+			struct usbip_header_ret_submit *ret,
+			struct iovec *data, int count, bool stable) {
+	struct usbip_header uh;
+	memset(&uh, 0, sizeof(uh));
+	uh.base.command = USBIP_RET_SUBMIT;
+	uh.base.seqnum = seqnum;
+	uh.u.ret_submit = *ret;
+	trace_emit(TRACE_RET_SUBMIT, conn->fd, seqnum, 0, ret->status,
+		ret->actual_length, count > 0 ? data[0].iov_base : NULL,
+		count > 0 ? data[0].iov_len : 0);
+	pack_usbip_header_basic(&uh.base);
+	pack_usbip_header_ret_submit(&uh.u.ret_submit);
+
+	struct iovec iov[3];
+	assert(count <= 2);
+	iov[0].iov_base = &uh;
+	iov[0].iov_len = sizeof(uh);
+	for (int i = 0; i < count; i++)
+		iov[1 + i] = data[i];
+	return conn_sendv(conn, &iov[0], 1 + count, stable);
+}
+
+int usbip_reply_status(struct conn *conn, __u32 seqnum, int status,
+			void *data, unsigned int size, bool stable) {
+	struct usbip_header_ret_submit ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.status = status;
+	ret.actual_length = size;
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	return usbip_send_ret_submit(conn, seqnum, &ret, &iov, size > 0,
+					stable);
+}
+
+// Replies with data that stays valid, like the descriptor cache.
+int usbip_reply(struct conn *conn, __u32 seqnum, void *data,
+			unsigned int size) {
+	return usbip_reply_status(conn, seqnum, 0, data, size, true);
+}
+
+// Replies with the first size bytes of the URB's transfer buffer.
+int usbip_reply_urb(struct conn *conn, struct urb *urb, unsigned int size) {
+	if (size > urb->length)
+		size = urb->length;
+	return usbip_reply_status(conn, urb->seqnum, 0, urb->buf, size, false);
+}
+
+// Replies to an IN URB with data that stays valid instead of the
+// transfer buffer, so that large replies can go out with MSG_ZEROCOPY.
+int usbip_reply_urb_stable(struct conn *conn, struct urb *urb, void *data,
+				unsigned int size) {
+	if (size > urb->length)
+		size = urb->length;
+	return usbip_reply_status(conn, urb->seqnum, 0, data, size, true);
+}
+
+// OUT URBs get back how much of their data was taken, but not the data.
+int usbip_reply_out(struct conn *conn, struct urb *urb, unsigned int actual) {
+	struct usbip_header_ret_submit ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.actual_length = actual;
+	return usbip_send_ret_submit(conn, urb->seqnum, &ret, NULL, 0, true);
+}
+
+// Replies to an isochronous URB once the handler has set actual_length
+// and status of every packet and, for IN, filled the packets in at their
+// offsets. IN data goes out packed, each packet right after the previous
+// one as vhci_hcd expects, followed by the descriptors. Offsets were
+// checked to be increasing when the URB was submitted, so packing in
+// place only ever moves data back.
+int usbip_reply_iso(struct conn *conn, struct urb *urb) {
+	struct usbip_iso_packet_descriptor *packets = urb_iso_packets(urb);
+	struct usbip_header_ret_submit ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.number_of_packets = urb->number_of_packets;
+	for (int i = 0; i < urb->number_of_packets; i++) {
+		struct usbip_iso_packet_descriptor *packet = &packets[i];
+		if (urb->in && packet->offset != ret.actual_length)
+			memmove(urb->buf + ret.actual_length,
+				urb->buf + packet->offset,
+				packet->actual_length);
+		ret.actual_length += packet->actual_length;
+		if (packet->status != 0)
+			ret.error_count++;
+		pack_usbip_iso_packet_descriptor(packet);
+	}
+
+	struct iovec iov[2] = {
+		{ .iov_base = urb->buf, .iov_len = ret.actual_length },
+		{ .iov_base = packets, .iov_len = urb->number_of_packets *
+							sizeof(*packets) },
+	};
+	if (!urb->in)
+		return usbip_send_ret_submit(conn, urb->seqnum, &ret,
+						&iov[1], 1, false);
+	return usbip_send_ret_submit(conn, urb->seqnum, &ret, &iov[0], 2,
+					false);
+}
+
+int usbip_reply_unlink(struct conn *conn, __u32 seqnum, int status) {
+	struct usbip_header uh;
+	memset(&uh, 0, sizeof(uh));
+	uh.base.command = USBIP_RET_UNLINK;
+	uh.base.seqnum = seqnum;
+	uh.u.ret_unlink.status = status;
+	trace_emit(TRACE_RET_UNLINK, conn->fd, seqnum, 0, status, 0, NULL, 0);
+	pack_usbip_header_basic(&uh.base);
+	pack_usbip_header_ret_unlink(&uh.u.ret_unlink);
+
+	return conn_send(conn, &uh, sizeof(uh));
+}
+
+/*----------------------------------------------------------------------*/
+
+struct export exports[MAX_EXPORTS];
+int num_exports;
+
+void add_export(struct device_model *model) {
+	if (num_exports == MAX_EXPORTS) {
+		fprintf(stderr, "too many exported devices\n");
+		exit(EXIT_FAILURE);
+	}
+	struct export *export = &exports[num_exports];
+	export->busnum = 1;
+	export->devnum = num_exports + 2;
+	snprintf(export->busid, sizeof(export->busid), "%u-%d",
+		export->busnum, num_exports + 1);
+	export->model = model;
+	printf("exporting %s as %s\n", model->name, export->busid);
+	num_exports++;
+}
+
+struct export *find_export(const char *busid) {
+	for (int i = 0; i < num_exports; i++) {
+		if (strcmp(exports[i].busid, busid) == 0)
+			return &exports[i];
+	}
+	return NULL;
+}
+
+// With -a, "ready" is written to ready_fd (and the fd closed) once every
+// attached export has been configured by the host, i.e. enumeration is
+// over and a driver is bound.
+int ready_fd = -1;
+int attach_pending;
+struct timespec attach_start;
+
+void export_configured(struct export *export) {
+	if (export == NULL ||
+	    !__atomic_exchange_n(&export->attaching, false, __ATOMIC_ACQ_REL))
+		return;
+	printf("%s configured\n", export->busid);
+	if (__atomic_sub_fetch(&attach_pending, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("all devices ready in %.1f ms\n",
+		(now.tv_sec - attach_start.tv_sec) * 1e3 +
+		(now.tv_nsec - attach_start.tv_nsec) / 1e6);
+	if (ready_fd >= 0) {
+		if (write(ready_fd, "ready\n", 6) != 6)
+			perror("write(ready_fd)");
+		close(ready_fd);
+		ready_fd = -1;
+	}
+}
+
+void fill_usb_device(struct usbip_usb_device *udev, struct export *export) {
+	struct device_model *model = export->model;
+
+	memset(udev, 0, sizeof(*udev));
+	snprintf(udev->path, sizeof(udev->path),
+		"/sys/devices/pci0000:00/0000:00:01.2/usb%u/%s",
+		export->busnum, export->busid);
+	strcpy(udev->busid, export->busid);
+	udev->busnum = export->busnum;
+	udev->devnum = export->devnum;
+	udev->speed = model->speed;
+	udev->idVendor = __le16_to_cpu(model->device.idVendor);
+	udev->idProduct = __le16_to_cpu(model->device.idProduct);
+	udev->bcdDevice = __le16_to_cpu(model->device.bcdDevice);
+	udev->bDeviceClass = model->device.bDeviceClass;
+	udev->bDeviceSubClass = model->device.bDeviceSubClass;
+	udev->bDeviceProtocol = model->device.bDeviceProtocol;
+	udev->bNumConfigurations = model->device.bNumConfigurations;
+	udev->bConfigurationValue = model->config.bConfigurationValue;
+	udev->bNumInterfaces = model->config.bNumInterfaces;
+}
+
+// Only fills in the common header, op may be as short as that, like the
+// start of the device list buffer.
+void init_op_reply(struct usbip_op *op, int code, int status) {
+	memset(&op->common, 0, sizeof(op->common));
+	op->common.version = 273;
+	op->common.code = code;
+	op->common.status = status;
+	pack_usbip_op_common(&op->common);
+}
+
+void init_import_reply(struct usbip_op* op, struct export *export) {
+	init_op_reply(op, OP_REP_IMPORT, ST_OK);
+
+	struct usbip_op_import_reply *rep = &op->u.import_reply;
+	memset(rep, 0, sizeof(*rep));
+	fill_usb_device(&rep->udev, export);
+	pack_usbip_op_import_reply(rep);
+}
+
+// The whole device list goes out as one frame: the common header, the
+// device count and every device followed by its interfaces.
+int send_devlist_reply(struct conn *conn) {
+	size_t size = sizeof(struct usbip_op_common) +
+			sizeof(struct usbip_op_devlist_reply);
+	for (int i = 0; i < num_exports; i++)
+		size += sizeof(struct usbip_usb_device) +
+			exports[i].model->num_ifaces *
+				sizeof(struct usbip_usb_interface);
+
+	char *data = malloc(size);
+	if (data == NULL) {
+		perror("malloc()");
+		return -1;
+	}
+
+	struct usbip_op *op = (struct usbip_op *)data;
+	init_op_reply(op, OP_REP_DEVLIST, ST_OK);
+	op->u.devlist_reply.ndev = num_exports;
+	pack_usbip_op_devlist_reply(&op->u.devlist_reply);
+
+	char *ptr = data + sizeof(struct usbip_op_common) +
+			sizeof(struct usbip_op_devlist_reply);
+	for (int i = 0; i < num_exports; i++) {
+		struct usbip_usb_device *udev = (struct usbip_usb_device *)ptr;
+		fill_usb_device(udev, &exports[i]);
+		pack_usbip_usb_device(udev);
+		ptr += sizeof(*udev);
+
+		struct device_model *model = exports[i].model;
+		for (int j = 0; j < model->num_ifaces; j++) {
+			struct usbip_usb_interface *uinf =
+				(struct usbip_usb_interface *)ptr;
+			struct usb_interface_descriptor *desc =
+				&model->ifaces[j].desc;
+			uinf->bInterfaceClass = desc->bInterfaceClass;
+			uinf->bInterfaceSubClass = desc->bInterfaceSubClass;
+			uinf->bInterfaceProtocol = desc->bInterfaceProtocol;
+			uinf->padding = 0;
+			ptr += sizeof(*uinf);
+		}
+	}
+
+	int rv = conn_send(conn, data, size);
+	free(data);
+	return rv;
+}
+
+// With a fallback, requests the model doesn't know get its data if they
+// are IN ones, or a stall if it's empty, and succeed if they are OUT.
+int reply_fallback(struct conn *conn, struct usbip_header *uh,
+			const char *error) {
+	struct usb_ctrlrequest *ctrl =
+		(struct usb_ctrlrequest *)&uh->u.cmd_submit.setup[0];
+	struct desc_blob *blob = &conn->model->fallback;
+	if (blob->data == NULL) {
+		fprintf(stderr, "%s\n", error);
+		return -1;
+	}
+	if (!(ctrl->bRequestType & USB_DIR_IN))
+		return usbip_reply(conn, uh->base.seqnum, "", 0);
+	if (blob->len == 0)
+		return usbip_reply_status(conn, uh->base.seqnum, -EPIPE,
+					NULL, 0, true);
+	unsigned int len = blob->len;
+	if (len > ctrl->wLength)
+		len = ctrl->wLength;
+	return usbip_reply(conn, uh->base.seqnum, (void *)blob->data, len);
+}
+
+void (*control_hook)(struct conn *conn, const struct usb_ctrlrequest *ctrl);
+
+int handle_control_request(struct conn *conn, struct usbip_header *uh,
+				char *payload) {
+	struct usb_ctrlrequest *ctrl =
+		(struct usb_ctrlrequest *)&uh->u.cmd_submit.setup[0];
+
+	if (control_hook != NULL)
+		control_hook(conn, ctrl);
+
+	switch (ctrl->bRequestType & USB_TYPE_MASK) {
+	case USB_TYPE_STANDARD:
+		switch (ctrl->bRequest) {
+		case USB_REQ_GET_DESCRIPTOR: {
+			struct desc_blob *blob = desc_lookup(&conn->model->cache,
+					ctrl->wValue >> 8, ctrl->wValue & 0xff,
+					ctrl->wIndex);
+			if (blob == NULL)
+				return reply_fallback(conn, uh,
+						"unknown descriptor");
+			unsigned int len = blob->len;
+			if (len > ctrl->wLength)
+				len = ctrl->wLength;
+			return usbip_reply(conn, uh->base.seqnum,
+				(void *)blob->data, len);
+		}
+		case USB_REQ_SET_CONFIGURATION:
+			if (ctrl->wValue != 0)
+				export_configured(conn->export);
+			return usbip_reply(conn, uh->base.seqnum, "", 0);
+		case USB_REQ_SET_INTERFACE:
+		case USB_REQ_CLEAR_FEATURE:
+			return usbip_reply(conn, uh->base.seqnum, "", 0);
+		default:
+			return reply_fallback(conn, uh,
+					"unknown request type");
+		}
+	case USB_TYPE_CLASS:
+		switch (ctrl->bRequest) {
+		case HID_REQ_SET_REPORT:
+			// The report itself arrived as the OUT payload of
+			// this URB and is ignored.
+			return usbip_reply(conn, uh->base.seqnum, "", 0);
+		case HID_REQ_SET_IDLE:
+			return usbip_reply(conn, uh->base.seqnum, "", 0);
+		case USB_BOT_GET_MAX_LUN:
+			// A single LUN, numbered 0.
+			return usbip_reply(conn, uh->base.seqnum, "",
+					ctrl->wLength ? 1 : 0);
+		case USB_BOT_RESET:
+			memset(&conn->bot, 0, sizeof(conn->bot));
+			return usbip_reply(conn, uh->base.seqnum, "", 0);
+		default:
+			return reply_fallback(conn, uh,
+					"unknown request type");
+		}
+	default:
+		return reply_fallback(conn, uh, "unknown request type");
+	}
+};
+
+struct worker workers[MAX_WORKERS];
+int num_workers = 1;
+
+// Session capture (-w), see capture.h. Each worker collects records in
+// its own buffer and appends it to the file with a single write() after
+// every batch of events, so capturing costs a copy per frame and no
+// syscalls on the URB path. Records that don't fit into the buffer are
+// written directly. capture_lock keeps the writes of different workers
+// from splitting each other's records.
+
+#define CAPTURE_BUF_SIZE (1024 * 1024)
+
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int capture_conns;
+
+void capture_start(const char *path) {
+	capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+				O_CLOEXEC, 0644);
+	if (capture_fd < 0) {
+		perror("open(capture)");
+		exit(EXIT_FAILURE);
+	}
+
+	struct capture_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header.magic[0], CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	header.record_size = sizeof(struct capture_record);
+	if (write(capture_fd, &header, sizeof(header)) != sizeof(header)) {
+		perror("write(capture)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Writes len bytes of data, or of zeros if data is NULL. Must be called
+// with capture_lock held.
+void capture_write(const char *data, size_t len) {
+	static const char zeros[4096];
+	while (len > 0) {
+		size_t chunk = len;
+		if (data == NULL && chunk > sizeof(zeros))
+			chunk = sizeof(zeros);
+		ssize_t rv = write(capture_fd, data ? data : &zeros[0], chunk);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			perror("write(capture)");
+			return;
+		}
+		if (data != NULL)
+			data += rv;
+		len -= rv;
+	}
+}
+
+void capture_flush(struct worker *worker) {
+	if (worker->capture_used == 0)
+		return;
+	pthread_mutex_lock(&capture_lock);
+	capture_write(worker->capture_buf, worker->capture_used);
+	pthread_mutex_unlock(&capture_lock);
+	worker->capture_used = 0;
+}
+
+// Records a frame made of iov, segments with a NULL base are recorded as
+// zeros.
+void capture_frame(struct conn *conn, int type, struct iovec *iov,
+			int iovcnt) {
+	struct worker *worker = conn->worker;
+	struct capture_record rec;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec.conn = conn->capture_id;
+	rec.type = type;
+	for (int i = 0; i < iovcnt; i++)
+		rec.len += iov[i].iov_len;
+	size_t size = capture_record_size(&rec);
+	size_t pad = size - sizeof(rec) - rec.len;
+
+	if (CAPTURE_BUF_SIZE - worker->capture_used < size)
+		capture_flush(worker);
+	if (size > CAPTURE_BUF_SIZE) {
+		pthread_mutex_lock(&capture_lock);
+		capture_write((char *)&rec, sizeof(rec));
+		for (int i = 0; i < iovcnt; i++)
+			capture_write(iov[i].iov_base, iov[i].iov_len);
+		capture_write(NULL, pad);
+		pthread_mutex_unlock(&capture_lock);
+		return;
+	}
+
+	char *ptr = worker->capture_buf + worker->capture_used;
+	memcpy(ptr, &rec, sizeof(rec));
+	ptr += sizeof(rec);
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base != NULL)
+			memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		else
+			memset(ptr, 0, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+	memset(ptr, 0, pad);
+	worker->capture_used += size;
+}
+
+// Report streams turn a script of key and mouse events into HID reports.
+// The script comes from a file, a pipe or stdin (see -s) and is compiled
+// ahead of the devices into a ring of input states, which every endpoint
+// using the "stream" handler then packs with the layout of its interface
+// and replays at its own pace. Script lines:
+//
+//   down <key>...	press keys
+//   up <key>...|all	release keys
+//   tap <key>...	press and release each key in turn
+//   type <text>	tap the keys needed to type text
+//   move <x> <y> [<wheel> [<pan>]]	move the mouse
+//   wait <ms>		delay the next report
+//
+// Keys are the names in stream_keys[], raw HID usages like 0x46 or mouse
+// buttons button1 to button32. Every down, up, tap or move step produces
+// one state. Once the script runs out the endpoints keep their URBs
+// pending, so more input can follow any time, unless -x is given.
+
+// The default script, which is what keyboard.c has always sent.
+const char *sysrq_script =
+	"up all\n"
+	"down leftalt\n"
+	"down sysrq\n"
+	"down x\n"
+	"up all\n";
+
+struct stream_key {
+	const char *name;
+	unsigned int usage;
+};
+
+struct stream_key stream_keys[] = {
+	{ "enter", 0x28 }, { "esc", 0x29 }, { "backspace", 0x2a },
+	{ "tab", 0x2b }, { "space", 0x2c }, { "minus", 0x2d },
+	{ "equal", 0x2e }, { "capslock", 0x39 }, { "sysrq", 0x46 },
+	{ "scrolllock", 0x47 }, { "pause", 0x48 }, { "insert", 0x49 },
+	{ "home", 0x4a }, { "pageup", 0x4b }, { "delete", 0x4c },
+	{ "end", 0x4d }, { "pagedown", 0x4e }, { "right", 0x4f },
+	{ "left", 0x50 }, { "down", 0x51 }, { "up", 0x52 },
+	{ "leftctrl", 0xe0 }, { "leftshift", 0xe1 }, { "leftalt", 0xe2 },
+	{ "leftmeta", 0xe3 }, { "rightctrl", 0xe4 }, { "rightshift", 0xe5 },
+	{ "rightalt", 0xe6 }, { "rightmeta", 0xe7 },
+};
+
+// Returns the hid_state bit of a key name, which is the HID usage for
+// keyboard keys, or 0 if there is none.
+unsigned int stream_key_usage(const char *name) {
+	if (name[0] != 0 && name[1] == 0) {
+		if (name[0] >= 'a' && name[0] <= 'z')
+			return 0x04 + name[0] - 'a';
+		if (name[0] >= '1' && name[0] <= '9')
+			return 0x1e + name[0] - '1';
+		if (name[0] == '0')
+			return 0x27;
+	}
+	if (name[0] == 'f' && name[1] >= '1' && name[1] <= '9') {
+		int n = atoi(&name[1]);
+		if (n >= 1 && n <= 12)
+			return 0x3a + n - 1;
+	}
+	if (strncmp(name, "button", 6) == 0) {
+		int n = atoi(&name[6]);
+		if (n >= 1 && n <= 32)
+			return HID_STATE_BUTTON + n - 1;
+	}
+	if (strncmp(name, "0x", 2) == 0) {
+		unsigned long usage = strtoul(name, NULL, 16);
+		return usage < HID_STATE_BUTTON ? usage : 0;
+	}
+	for (int i = 0; i < sizeof(stream_keys) / sizeof(stream_keys[0]); i++) {
+		if (strcmp(stream_keys[i].name, name) == 0)
+			return stream_keys[i].usage;
+	}
+	return 0;
+}
+
+// Returns the usage of the key that types c and whether Shift is needed.
+unsigned int stream_char_usage(char c, bool *shift) {
+	const char *shifted = "!@#$%^&*()";
+	char name[2] = { c, 0 };
+
+	*shift = false;
+	if (c >= 'A' && c <= 'Z') {
+		*shift = true;
+		name[0] = c - 'A' + 'a';
+	} else if (c != 0 && strchr(shifted, c) != NULL) {
+		*shift = true;
+		name[0] = (c == ')') ? '0' : '1' + (strchr(shifted, c) - shifted);
+	} else if (c == ' ') {
+		return 0x2c;
+	} else if (c == '-') {
+		return 0x2d;
+	} else if (c == '=') {
+		return 0x2e;
+	} else if (c == '.') {
+		return 0x37;
+	} else if (c == ',') {
+		return 0x36;
+	}
+	return stream_key_usage(name);
+}
+
+unsigned int stream_free(struct stream *stream) {
+	return STREAM_RING_SIZE - (stream->tail - stream->head);
+}
+
+void stream_emit(struct stream *stream) {
+	struct stream_report *report =
+		&stream->ring[stream->tail & (STREAM_RING_SIZE - 1)];
+
+	report->state = stream->state;
+	report->delay_us = stream->delay_us;
+	// Movement is relative and only goes into one report.
+	memset(&stream->state.axes[0], 0, sizeof(stream->state.axes));
+	stream->delay_us = 0;
+	stream->tail++;
+}
+
+void stream_key(struct stream *stream, unsigned int bit, bool down) {
+	struct hid_state *state = &stream->state;
+	if (down)
+		state->bits[bit / 8] |= 1 << (bit % 8);
+	else
+		state->bits[bit / 8] &= ~(1 << (bit % 8));
+	// Modifiers and buttons only ever go into variable fields.
+	if (bit >= 0xe0)
+		return;
+
+	for (int i = 0; i < state->num_keys; i++) {
+		if (state->keys[i] != bit)
+			continue;
+		if (!down) {
+			memmove(&state->keys[i], &state->keys[i + 1],
+				state->num_keys - i - 1);
+			state->num_keys--;
+		}
+		return;
+	}
+	if (down && state->num_keys < HID_MAX_KEYS)
+		state->keys[state->num_keys++] = bit;
+}
+
+// Compiles one script line into reports. Returns -1 on a syntax error.
+int stream_compile_line(struct stream *stream, char *line) {
+	char *comment = strchr(line, '#');
+	if (comment != NULL)
+		*comment = 0;
+	char *save;
+	char *cmd = strtok_r(line, " \t\r\n", &save);
+	if (cmd == NULL)
+		return 0;
+
+	if (strcmp(cmd, "wait") == 0) {
+		char *ms = strtok_r(NULL, " \t\r\n", &save);
+		if (ms == NULL)
+			return -1;
+		stream->delay_us += strtoul(ms, NULL, 0) * 1000;
+		return 0;
+	}
+
+	if (strcmp(cmd, "type") == 0) {
+		char *text = strtok_r(NULL, "\r\n", &save);
+		for (; text != NULL && *text != 0; text++) {
+			bool shift;
+			unsigned int usage = stream_char_usage(*text, &shift);
+			if (usage == 0)
+				return -1;
+			if (shift)
+				stream_key(stream, 0xe1, true);
+			stream_key(stream, usage, true);
+			stream_emit(stream);
+			stream_key(stream, usage, false);
+			if (shift)
+				stream_key(stream, 0xe1, false);
+			stream_emit(stream);
+		}
+		return 0;
+	}
+
+	if (strcmp(cmd, "move") == 0) {
+		for (int axis = 0; axis < HID_NUM_AXES; axis++) {
+			char *value = strtok_r(NULL, " \t\r\n", &save);
+			if (value == NULL && axis < HID_AXIS_WHEEL)
+				return -1;
+			stream->state.axes[axis] =
+				value ? strtol(value, NULL, 0) : 0;
+		}
+		stream_emit(stream);
+		return 0;
+	}
+
+	bool down = strcmp(cmd, "down") == 0;
+	bool tap = strcmp(cmd, "tap") == 0;
+	if (!down && !tap && strcmp(cmd, "up") != 0)
+		return -1;
+
+	for (char *key = strtok_r(NULL, " \t\r\n", &save); key != NULL;
+			key = strtok_r(NULL, " \t\r\n", &save)) {
+		if (strcmp(cmd, "up") == 0 && strcmp(key, "all") == 0) {
+			memset(&stream->state.bits[0], 0,
+				sizeof(stream->state.bits));
+			stream->state.num_keys = 0;
+			continue;
+		}
+		unsigned int usage = stream_key_usage(key);
+		if (usage == 0)
+			return -1;
+		stream_key(stream, usage, down || tap);
+		if (tap) {
+			stream_emit(stream);
+			stream_key(stream, usage, false);
+		}
+	}
+	stream_emit(stream);
+	return 0;
+}
+
+// Compiles complete lines out of stream->line for as long as the ring
+// has room for everything a line can produce.
+void stream_compile(struct stream *stream) {
+	while (true) {
+		char *end = memchr(&stream->line[0], '\n', stream->line_len);
+		if (end == NULL) {
+			if (!stream->eof || stream->line_len == 0)
+				return;
+			// The last line of a script may lack the newline.
+			if (stream->line_len == STREAM_LINE_SIZE)
+				stream->line_len--;
+			end = &stream->line[stream->line_len++];
+			*end = '\n';
+		}
+
+		unsigned int len = end - &stream->line[0] + 1;
+		if (stream_free(stream) < 2 * len + 1)
+			return;
+
+		*end = 0;
+		if (stream_compile_line(stream, &stream->line[0]) < 0)
+			fprintf(stderr, "bad stream line ignored\n");
+		memmove(&stream->line[0], &stream->line[len],
+			stream->line_len - len);
+		stream->line_len -= len;
+	}
+}
+
+void stream_watch(struct stream *stream, bool watch) {
+	if (!stream->pollable || stream->watching == watch)
+		return;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = watch ? EPOLLIN : 0;
+	ev.data.ptr = &stream->source;
+	if (epoll_ctl(stream->epoll_fd, EPOLL_CTL_MOD, stream->fd, &ev) < 0)
+		perror("epoll_ctl()");
+	stream->watching = watch;
+}
+
+// Reads and compiles as much of the script as fits into the ring. The
+// source is only watched while there is room, so a fast writer on the
+// other end of a pipe is throttled by the slowest device.
+void stream_fill(struct stream *stream) {
+	while (stream->fd >= 0) {
+		stream_compile(stream);
+		if (stream->line_len == STREAM_LINE_SIZE) {
+			fprintf(stderr, "stream line too long\n");
+			stream->line_len = 0;
+		}
+		if (stream_free(stream) < 2 * STREAM_LINE_SIZE + 1) {
+			stream_watch(stream, false);
+			return;
+		}
+
+		int rv = read(stream->fd, &stream->line[stream->line_len],
+				STREAM_LINE_SIZE - stream->line_len);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				stream_watch(stream, true);
+				return;
+			}
+			perror("read(stream)");
+			rv = 0;
+		}
+		if (rv == 0) {
+			stream->eof = true;
+			stream_compile(stream);
+			stream_watch(stream, false);
+			if (stream->fd != STDIN_FILENO)
+				close(stream->fd);
+			stream->fd = -1;
+			return;
+		}
+		stream->line_len += rv;
+	}
+}
+
+// path is a script file, "-" for stdin, or NULL for sysrq_script.
+void stream_init(struct stream *stream, const char *path, int epoll_fd) {
+	memset(stream, 0, sizeof(*stream));
+	stream->source.type = SOURCE_STREAM;
+	stream->epoll_fd = epoll_fd;
+	stream->fd = -1;
+
+	if (path == NULL) {
+		char line[STREAM_LINE_SIZE];
+		for (const char *ptr = sysrq_script; *ptr != 0; ) {
+			const char *end = strchr(ptr, '\n');
+			snprintf(&line[0], sizeof(line), "%.*s",
+				(int)(end - ptr), ptr);
+			stream_compile_line(stream, &line[0]);
+			ptr = end + 1;
+		}
+		stream->eof = true;
+		return;
+	}
+
+	// A FIFO is opened for writing too: opening it read-only would block
+	// until a writer shows up, before the server even listens, and every
+	// writer that closes it would end the stream.
+	struct stat st;
+	if (strcmp(path, "-") == 0)
+		stream->fd = STDIN_FILENO;
+	else if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+		stream->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	else
+		stream->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (stream->fd < 0) {
+		perror("open()");
+		exit(EXIT_FAILURE);
+	}
+	int flags = fcntl(stream->fd, F_GETFL);
+	fcntl(stream->fd, F_SETFL, flags | O_NONBLOCK);
+
+	// Regular files can't be polled and are simply read on demand.
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = 0;
+	ev.data.ptr = &stream->source;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stream->fd, &ev) == 0)
+		stream->pollable = true;
+	else if (errno != EPERM) {
+		perror("epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+
+	stream_fill(stream);
+}
+
+// Drops reports every consumer has sent and reads more of the script.
+void stream_release(struct stream *stream) {
+	if (stream->consumers == NULL)
+		return;
+	unsigned long head = stream->tail;
+	for (struct ep_sched *sched = stream->consumers; sched != NULL;
+			sched = sched->stream_next) {
+		if (sched->stream_pos < head)
+			head = sched->stream_pos;
+	}
+	stream->head = head;
+	if (stream->fd >= 0 && !stream->watching)
+		stream_fill(stream);
+	else if (stream->fd < 0 && stream->line_len != 0)
+		stream_compile(stream);
+}
+
+void stream_attach(struct ep_sched *sched) {
+	struct stream *stream = &sched->source.conn->worker->stream;
+	sched->stream_pos = stream->head;
+	clock_gettime(CLOCK_MONOTONIC, &sched->stream_last);
+	memset(&sched->stream_sent[0], 0, sizeof(sched->stream_sent));
+	sched->stream_pending = 0;
+	sched->stream_tx_end = sched->source.conn->tx.tail;
+	sched->stream_next = stream->consumers;
+	stream->consumers = sched;
+}
+
+void stream_detach(struct ep_sched *sched) {
+	struct stream *stream = &sched->source.conn->worker->stream;
+	struct ep_sched **link = &stream->consumers;
+	while (*link != NULL && *link != sched)
+		link = &(*link)->stream_next;
+	if (*link != NULL)
+		*link = sched->stream_next;
+	stream_release(stream);
+}
+
+// Set by -x: once the script has ended and every endpoint replaying it
+// has sent all of it, their connections are closed. With -a that
+// detaches the devices and the server exits.
+bool stream_exit = false;
+
+// Called after every round of events. The host still reads the last
+// reports from the socket after it's closed, but they have to be in it:
+// tx must have been written out up to where the last one ended.
+void stream_check_done(struct worker *worker) {
+	struct stream *stream = &worker->stream;
+	if (!stream_exit || !stream->eof || stream->line_len != 0 ||
+	    stream->consumers == NULL)
+		return;
+	for (struct ep_sched *sched = stream->consumers; sched != NULL;
+			sched = sched->stream_next) {
+		struct conn *conn = sched->source.conn;
+		if (sched->stream_pos != stream->tail ||
+		    sched->stream_pending != 0 ||
+		    (int)(conn->tx.head - sched->stream_tx_end) < 0)
+			return;
+	}
+	printf("script sent\n");
+	while (stream->consumers != NULL)
+		conn_close(stream->consumers->source.conn);
+}
+
+long timespec_diff_us(struct timespec *a, struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000L +
+		(a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+// Returns whether the next state of the stream is due.
+bool stream_due(struct ep_sched *sched, struct stream *stream) {
+	if (sched->stream_pos == stream->tail)
+		return false;
+	struct stream_report *report =
+		&stream->ring[sched->stream_pos & (STREAM_RING_SIZE - 1)];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return report->delay_us == 0 ||
+		timespec_diff_us(&now, &sched->stream_last) >= report->delay_us;
+}
+
+// Every state of the stream is packed into all reports of the layout,
+// the ones that changed since they were last sent go out one per URB. A
+// state that changes nothing still sends the first report, so each step
+// of the script reaches the host. Unpaced endpoints don't wait for the
+// stream, their URBs complete empty while it has nothing due.
+int complete_stream(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb) {
+	struct stream *stream = &conn->worker->stream;
+	const struct hid_layout *layout = sched->model->layout;
+
+	if (sched->stream_pending == 0 && unpaced &&
+	    !stream_due(sched, stream)) {
+		if (usbip_reply_urb(conn, urb, 0) < 0)
+			return -1;
+		return URB_DONE;
+	}
+	if (sched->stream_pending == 0) {
+		if (sched->stream_pos == stream->tail)
+			return URB_NOT_READY;
+
+		struct stream_report *report = &stream->ring[
+			sched->stream_pos & (STREAM_RING_SIZE - 1)];
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (report->delay_us != 0 &&
+		    timespec_diff_us(&now, &sched->stream_last) <
+				report->delay_us)
+			return URB_NOT_READY;
+
+		hid_pack(layout, &report->state, &sched->stream_packed[0]);
+		for (int r = 0; r < layout->num_reports; r++) {
+			unsigned int off = r * HID_REPORT_STRIDE;
+			if (memcmp(&sched->stream_packed[off],
+				   &sched->stream_sent[off],
+				   layout->reports[r].len) != 0)
+				sched->stream_pending |= 1 << r;
+		}
+		if (sched->stream_pending == 0)
+			sched->stream_pending = 1;
+		sched->stream_pos++;
+		sched->stream_last = now;
+		stream_release(stream);
+	}
+
+	int r = __builtin_ctz(sched->stream_pending);
+	sched->stream_pending &= sched->stream_pending - 1;
+	char *packed = &sched->stream_packed[r * HID_REPORT_STRIDE];
+	memcpy(&sched->stream_sent[r * HID_REPORT_STRIDE], packed,
+		layout->reports[r].len);
+
+	unsigned int len = __le16_to_cpu(sched->model->desc.wMaxPacketSize);
+	if (len > layout->reports[r].len)
+		len = layout->reports[r].len;
+	if (len > urb->length)
+		len = urb->length;
+	memcpy(urb->buf, packed, len);
+	if (usbip_reply_urb(conn, urb, len) < 0)
+		return -1;
+	sched->stream_tx_end = conn->tx.tail;
+	return URB_DONE;
+}
+
+// Reports that nothing happened, for devices that only need to exist.
+int complete_zero(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb) {
+	unsigned int len = __le16_to_cpu(sched->model->desc.wMaxPacketSize);
+	if (len > urb->length)
+		len = urb->length;
+	memset(urb->buf, 0, len);
+	if (usbip_reply_urb(conn, urb, len) < 0)
+		return -1;
+	return URB_DONE;
+}
+
+// Data for throughput tests, a repeating pattern so that the host can
+// check what it got. Replies come straight from here and are sent with
+// MSG_ZEROCOPY if they are large enough, see -z.
+char source_pattern[MAX_URB_BUFFER];
+
+void source_init(void) {
+	for (int i = 0; i < MAX_URB_BUFFER; i++)
+		source_pattern[i] = i % 251;
+}
+
+// Bytes an isochronous endpoint moves per service interval.
+unsigned int ep_iso_bytes(struct usb_endpoint_descriptor *desc) {
+	return usb_endpoint_maxp(desc) * usb_endpoint_maxp_mult(desc);
+}
+
+int complete_source(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb) {
+	if (urb->number_of_packets == 0) {
+		if (usbip_reply_urb_stable(conn, urb, &source_pattern[0],
+						urb->length) < 0)
+			return -1;
+		return URB_DONE;
+	}
+
+	struct usbip_iso_packet_descriptor *packets = urb_iso_packets(urb);
+	unsigned int max = ep_iso_bytes(&sched->model->desc);
+	for (int i = 0; i < urb->number_of_packets; i++) {
+		struct usbip_iso_packet_descriptor *packet = &packets[i];
+		unsigned int len = packet->length;
+		if (len > max)
+			len = max;
+		memcpy(urb->buf + packet->offset,
+			&source_pattern[packet->offset], len);
+		packet->actual_length = len;
+		packet->status = 0;
+	}
+	if (usbip_reply_iso(conn, urb) < 0)
+		return -1;
+	return URB_DONE;
+}
+
+// Takes whatever the host sends.
+int complete_sink(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb) {
+	if (urb->number_of_packets == 0) {
+		if (usbip_reply_out(conn, urb, urb->length) < 0)
+			return -1;
+		return URB_DONE;
+	}
+
+	struct usbip_iso_packet_descriptor *packets = urb_iso_packets(urb);
+	for (int i = 0; i < urb->number_of_packets; i++) {
+		packets[i].actual_length = packets[i].length;
+		packets[i].status = 0;
+	}
+	if (usbip_reply_iso(conn, urb) < 0)
+		return -1;
+	return URB_DONE;
+}
+
+struct ep_handler ep_handlers[] = {
+	{ "stream", HANDLER_IN, complete_stream, stream_attach,
+		stream_detach },
+	{ "zero", HANDLER_IN, complete_zero, NULL, NULL },
+	{ "source", HANDLER_IN | HANDLER_ISO, complete_source, NULL, NULL },
+	{ "sink", HANDLER_OUT | HANDLER_ISO, complete_sink, NULL, NULL },
+	{ "storage", HANDLER_IN | HANDLER_OUT, complete_storage, NULL, NULL },
+};
+
+struct ep_handler *find_ep_handler(const char *name) {
+	for (int i = 0; i < sizeof(ep_handlers) / sizeof(ep_handlers[0]); i++) {
+		if (strcmp(ep_handlers[i].name, name) == 0)
+			return &ep_handlers[i];
+	}
+	return NULL;
+}
+
+// Polling period of an interrupt or isochronous endpoint. bInterval is
+// a 2^(bInterval-1) exponent, of microframes for high-speed devices and
+// of frames for full-speed isochronous endpoints, and a frame count for
+// full-speed interrupt endpoints.
+void ep_interval(struct usb_endpoint_descriptor *desc, int speed,
+			struct timespec *period) {
+	long usec;
+	int exp = desc->bInterval;
+	if (exp < 1)
+		exp = 1;
+	if (exp > 16)
+		exp = 16;
+	if (speed == USB_SPEED_HIGH) {
+		usec = 125L << (exp - 1);
+	} else if (usb_endpoint_xfer_isoc(desc)) {
+		usec = 1000L << (exp - 1);
+	} else {
+		usec = (desc->bInterval ? desc->bInterval : 1) * 1000L;
+	}
+	period->tv_sec = usec / 1000000;
+	period->tv_nsec = (usec % 1000000) * 1000;
+}
+
+// conn->eps has the IN endpoints first and then the OUT ones.
+int ep_index(int ep, bool in) {
+	return in ? ep : MAX_ENDPOINTS + ep;
+}
+
+int ep_sched_init(struct conn *conn, int index, struct ep_model *model) {
+	struct ep_sched *sched = &conn->eps[index];
+
+	sched->source.type = SOURCE_TIMER;
+	sched->source.conn = conn;
+	sched->source.ep = index;
+	sched->model = model;
+	if (model->handler->attach != NULL)
+		model->handler->attach(sched);
+	if (usb_endpoint_xfer_bulk(&model->desc) ||
+	    (unpaced && usb_endpoint_xfer_int(&model->desc)))
+		return 0;
+
+	sched->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sched->timer_fd < 0) {
+		perror("timerfd_create()");
+		return -1;
+	}
+	ep_interval(&model->desc, conn->model->speed, &sched->period);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sched->source;
+	if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, sched->timer_fd,
+			&ev) < 0) {
+		perror("epoll_ctl()");
+		close(sched->timer_fd);
+		sched->timer_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// An isochronous URB takes as many intervals as it has packets, the
+// timer fires once per URB at the head of the queue.
+int ep_sched_arm(struct ep_sched *sched, bool arm) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (arm) {
+		int packets = sched->first->number_of_packets;
+		long long ns = (sched->period.tv_sec * 1000000000LL +
+				sched->period.tv_nsec) *
+				(packets > 0 ? packets : 1);
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+		its.it_interval = its.it_value;
+		sched->armed_packets = packets;
+	}
+	if (timerfd_settime(sched->timer_fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime()");
+		return -1;
+	}
+	sched->armed = arm;
+	return 0;
+}
+
+// Completes queued URBs in order for as long as the handler has data for
+// them, at most limit of them. Replies can be as large as a whole URB
+// buffer, once tx can't take one more the rest waits: for the next
+// expiration on timer driven endpoints, for conn_resume() on bulk ones.
+// Returns -1 on errors and 1 if the connection should be closed.
+int ep_sched_run(struct ep_sched *sched, uint64_t limit) {
+	struct conn *conn = sched->source.conn;
+	for (; limit > 0 && sched->count > 0; limit--) {
+		if (ring_free(&conn->tx) < MAX_REPLY_SIZE) {
+			if (sched->timer_fd < 0)
+				conn->bulk_blocked = true;
+			return 0;
+		}
+		struct urb *urb = sched->first;
+		int rv = sched->model->handler->complete(conn, sched, urb);
+		if (rv == URB_NOT_READY)
+			return 0;
+		if (rv < 0)
+			return rv;
+		ep_queue_remove(sched, urb);
+		urb_free(&conn->urbs, urb);
+		if (rv == URB_CLOSE)
+			return 1;
+	}
+	return 0;
+}
+
+// A bulk URB completing may be what other bulk endpoints were waiting
+// for, as with the phases of the storage transport.
+int conn_run_bulk(struct conn *conn) {
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		for (int i = 0; i < 2 * MAX_ENDPOINTS; i++) {
+			struct ep_sched *sched = &conn->eps[i];
+			if (sched->count == 0 || sched->timer_fd >= 0)
+				continue;
+			unsigned int count = sched->count;
+			int rv = ep_sched_run(sched, UINT64_MAX);
+			if (rv != 0)
+				return rv;
+			if (sched->count != count)
+				progress = true;
+		}
+	}
+	return 0;
+}
+
+// Queues a URB whose data has arrived in full.
+int ep_submit(struct conn *conn, struct urb *urb) {
+	struct ep_sched *sched = &conn->eps[urb->ep];
+	ep_queue_push(sched, urb);
+	if (sched->timer_fd < 0)
+		return conn_run_bulk(conn);
+	if (!sched->armed)
+		return ep_sched_arm(sched, true);
+	return 0;
+}
+
+// Turns down a URB, the connection goes on. OUT data that hasn't arrived
+// yet is skipped.
+int reject_urb(struct conn *conn, struct usbip_header *cmd, int status,
+			char *payload, unsigned int payload_len) {
+	if (payload == NULL) {
+		conn->rx_payload.urb = NULL;
+		conn->rx_payload.left = payload_len;
+	}
+	return usbip_reply_status(conn, cmd->base.seqnum, status, NULL, 0,
+					true);
+}
+
+// Packets have to lie within the transfer buffer, one after another.
+bool iso_packets_valid(struct urb *urb) {
+	struct usbip_iso_packet_descriptor *packets = urb_iso_packets(urb);
+	unsigned int end = 0;
+	for (int i = 0; i < urb->number_of_packets; i++) {
+		struct usbip_iso_packet_descriptor *packet = &packets[i];
+		unpack_usbip_iso_packet_descriptor(packet);
+		if (packet->offset < end || packet->length > urb->length ||
+		    packet->offset > urb->length - packet->length)
+			return false;
+		end = packet->offset + packet->length;
+	}
+	return true;
+}
+
+// Every byte of the URB has arrived, it goes to its endpoint.
+int urb_arrived(struct conn *conn, struct urb *urb) {
+	if (urb->number_of_packets > 0 && !iso_packets_valid(urb)) {
+		int rv = usbip_reply_status(conn, urb->seqnum, -EINVAL, NULL, 0,
+						true);
+		urb_free(&conn->urbs, urb);
+		return rv;
+	}
+	return ep_submit(conn, urb);
+}
+
+// Data URBs get a transfer buffer from the arena with the OUT data and
+// the isochronous packet descriptors. payload is NULL when the frame is
+// too large for rx, the rest then goes into the buffer as it arrives,
+// see conn_handle_frames().
+int handle_data_request(struct conn *conn, struct usbip_header *cmd,
+			char *payload) {
+	unsigned int ep = cmd->base.ep;
+	bool in = cmd->base.direction == USBIP_DIR_IN;
+	int length = cmd->u.cmd_submit.transfer_buffer_length;
+	int packets = cmd->u.cmd_submit.number_of_packets;
+	struct ep_model *model = NULL;
+	if (ep < MAX_ENDPOINTS)
+		model = in ? conn->model->ep_in[ep] : conn->model->ep_out[ep];
+	if (model == NULL && conn->model->fallback.data != NULL &&
+	    packets >= 0 && packets <= USBIP_MAX_ISO_PACKETS)
+		return reject_urb(conn, cmd, -EPIPE, payload,
+			packets * sizeof(struct usbip_iso_packet_descriptor) +
+			(!in && length > 0 ? length : 0));
+	if (model == NULL || packets < 0 || packets > USBIP_MAX_ISO_PACKETS) {
+		fprintf(stderr, "invalid endpoint %d\n", ep);
+		return -1;
+	}
+
+	int index = ep_index(ep, in);
+	if (conn->eps[index].model == NULL &&
+	    ep_sched_init(conn, index, model) < 0)
+		return -1;
+
+	unsigned int iso_len =
+		packets * sizeof(struct usbip_iso_packet_descriptor);
+	unsigned int payload_len = iso_len + (!in && length > 0 ? length : 0);
+	if (length < 0 || (packets > 0) != usb_endpoint_xfer_isoc(&model->desc))
+		return reject_urb(conn, cmd, -EINVAL, payload, payload_len);
+	struct urb *urb = urb_alloc(&conn->urbs, cmd->base.seqnum, index,
+					length + iso_len);
+	if (urb == NULL && errno == EBUSY) {
+		fprintf(stderr, "too many in-flight URBs\n");
+		return -1;
+	}
+	// The host gets the URB back failed, the connection goes on.
+	if (urb == NULL)
+		return reject_urb(conn, cmd, -errno, payload, payload_len);
+	urb->in = in;
+	urb->length = length;
+	urb->number_of_packets = packets;
+
+	// IN URBs only come with the packet descriptors.
+	unsigned int off = in ? length : 0;
+	if (payload == NULL) {
+		conn->rx_payload.urb = urb;
+		conn->rx_payload.off = off;
+		conn->rx_payload.left = payload_len;
+		return 0;
+	}
+	if (payload_len > 0)
+		memcpy(urb->buf + off, payload, payload_len);
+	return urb_arrived(conn, urb);
+}
+
+// Completes one queued URB per timer expiration.
+int ep_sched_tick(struct ep_sched *sched) {
+	struct conn *conn = sched->source.conn;
+	uint64_t expirations;
+	int rv = read(sched->timer_fd, &expirations, sizeof(expirations));
+	if (rv != sizeof(expirations)) {
+		if (rv < 0 && errno == EAGAIN)
+			return 0;
+		perror("read(timerfd)");
+		return -1;
+	}
+
+	trace_emit(TRACE_EP_TIMER, conn->fd, 0,
+		sched->source.ep % MAX_ENDPOINTS, expirations, sched->count,
+		NULL, 0);
+	rv = ep_sched_run(sched, expirations);
+	if (rv != 0)
+		return rv;
+
+	if (sched->count == 0)
+		return ep_sched_arm(sched, false);
+	if (sched->first->number_of_packets != sched->armed_packets)
+		return ep_sched_arm(sched, true);
+	return 0;
+}
+
+// payload is NULL if the OUT data hasn't arrived yet.
+int handle_usb_request(struct conn *conn, struct usbip_header *uh,
+			char *payload) {
+	if (uh->base.ep != 0)
+		return handle_data_request(conn, uh, payload);
+	if (payload == NULL) {
+		fprintf(stderr, "control transfer too large\n");
+		return -1;
+	}
+	return handle_control_request(conn, uh, payload);
+};
+
+// A URB still waiting in an endpoint queue is dropped and reported as
+// -ECONNRESET. One that has already been completed (or never queued, as
+// control URBs are answered right away) gets status 0, the same as
+// stub_rx does for URBs that have already been given back.
+int handle_unlink_request(struct conn *conn, struct usbip_header *uh) {
+	int status = 0;
+	struct urb *urb = urb_lookup(&conn->urbs, uh->u.cmd_unlink.seqnum);
+	if (urb != NULL) {
+		ep_queue_remove(&conn->eps[urb->ep], urb);
+		urb_free(&conn->urbs, urb);
+		status = -ECONNRESET;
+	}
+	return usbip_reply_unlink(conn, uh->base.seqnum, status);
+}
+
+/*----------------------------------------------------------------------*/
+
+// Fills in the fields of a model that follow from the others and
+// serializes its descriptors.
+void model_finish(struct device_model *model) {
+	model->device.bNumConfigurations = 1;
+
+	model->qualifier = usb_qualifier;
+	model->qualifier.bcdUSB = model->device.bcdUSB;
+	model->qualifier.bDeviceClass = model->device.bDeviceClass;
+	model->qualifier.bDeviceSubClass = model->device.bDeviceSubClass;
+	model->qualifier.bDeviceProtocol = model->device.bDeviceProtocol;
+	model->qualifier.bMaxPacketSize0 = model->device.bMaxPacketSize0;
+	model->qualifier.bNumConfigurations = 1;
+
+	model->config.bNumInterfaces = model->num_ifaces;
+	for (int i = 0; i < model->num_ifaces; i++) {
+		struct interface_model *iface = &model->ifaces[i];
+
+		iface->desc.bInterfaceNumber = i;
+		iface->desc.bNumEndpoints = iface->num_eps;
+		iface->hid.desc[0].wDescriptorLength =
+			__cpu_to_le16(iface->hid_report_len);
+		for (int j = 0; j < iface->num_eps; j++) {
+			struct ep_model *ep = &iface->eps[j];
+			int num = usb_endpoint_num(&ep->desc);
+			if (iface->hid_report_len != 0)
+				ep->layout = &iface->layout;
+			if (usb_endpoint_dir_in(&ep->desc))
+				model->ep_in[num] = ep;
+			else
+				model->ep_out[num] = ep;
+		}
+	}
+
+	desc_cache_init(model);
+}
+
+struct device_model *builtin_keyboard(void) {
+	struct device_model *model = calloc(1, sizeof(*model));
+	if (model == NULL) {
+		perror("calloc()");
+		return NULL;
+	}
+
+	strcpy(model->name, "keyboard");
+	model->speed = USB_SPEED_HIGH;
+	model->device = usb_device;
+	model->config = usb_config;
+
+	struct interface_model *iface = &model->ifaces[0];
+	iface->desc = usb_interface;
+	iface->hid = usb_hid;
+	memcpy(&iface->hid_report[0], &usb_hid_report[0],
+		sizeof(usb_hid_report));
+	iface->hid_report_len = sizeof(usb_hid_report);
+	hid_compile(&iface->layout, &iface->hid_report[0],
+			iface->hid_report_len);
+	iface->eps[0].desc = usb_endpoint;
+	iface->eps[0].handler = find_ep_handler("stream");
+	iface->num_eps = 1;
+	model->num_ifaces = 1;
+
+	model_finish(model);
+	return model;
+}
+
+// Device descriptions are line based, '#' starts a comment:
+//
+//   name <name>
+//   device <idVendor>:<idProduct> [<class> <subclass> <protocol>]
+//   speed low|full|high
+//   string manufacturer|product|serial|interface <text>
+//   config <bmAttributes> <bMaxPower>
+//   storage <file>
+//   interface <class> <subclass> <protocol>
+//   report <hex byte>...
+//   endpoint <address> int|bulk|iso <wMaxPacketSize> <bInterval> <handler>
+//
+// report lines append to the HID report descriptor of the last interface,
+// which "stream" endpoints pack their reports by (see hid_compile()),
+// endpoint lines add an endpoint to it. storage maps a file as the medium
+// of the "storage" handler, its size is rounded down to whole blocks and
+// it's used read-only if it can't be written. See devices/ for examples.
+struct device_model *load_model(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror("fopen()");
+		return NULL;
+	}
+
+	struct device_model *model = calloc(1, sizeof(*model));
+	if (model == NULL) {
+		perror("calloc()");
+		fclose(file);
+		return NULL;
+	}
+	snprintf(model->name, sizeof(model->name), "%s", path);
+	model->speed = USB_SPEED_HIGH;
+	model->device = usb_device;
+	model->device.iManufacturer = 0;
+	model->device.iProduct = 0;
+	model->device.iSerialNumber = 0;
+	model->config = usb_config;
+	model->config.iConfiguration = 0;
+
+	struct interface_model *iface = NULL;
+	bool uses_storage = false;
+	int next_string = 1;
+	int lineno = 0;
+	char line[1024];
+	const char *error = NULL;
+
+	while (error == NULL && fgets(&line[0], sizeof(line), file) != NULL) {
+		lineno++;
+		char *comment = strchr(&line[0], '#');
+		if (comment != NULL)
+			*comment = 0;
+		char *key = strtok(&line[0], " \t\r\n");
+		if (key == NULL)
+			continue;
+		char *rest = strtok(NULL, "\r\n");
+		if (rest == NULL)
+			rest = "";
+
+		if (strcmp(key, "name") == 0) {
+			if (sscanf(rest, "%63s", model->name) != 1)
+				error = "expected a name";
+		} else if (strcmp(key, "device") == 0) {
+			unsigned int vendor, product;
+			unsigned char cls = 0, subclass = 0, protocol = 0;
+			if (sscanf(rest, "%x:%x %hhi %hhi %hhi", &vendor,
+					&product, &cls, &subclass,
+					&protocol) < 2) {
+				error = "expected <idVendor>:<idProduct>";
+				break;
+			}
+			model->device.idVendor = __cpu_to_le16(vendor);
+			model->device.idProduct = __cpu_to_le16(product);
+			model->device.bDeviceClass = cls;
+			model->device.bDeviceSubClass = subclass;
+			model->device.bDeviceProtocol = protocol;
+		} else if (strcmp(key, "speed") == 0) {
+			if (strncmp(rest, "low", 3) == 0)
+				model->speed = USB_SPEED_LOW;
+			else if (strncmp(rest, "full", 4) == 0)
+				model->speed = USB_SPEED_FULL;
+			else if (strncmp(rest, "high", 4) == 0)
+				model->speed = USB_SPEED_HIGH;
+			else
+				error = "unknown speed";
+		} else if (strcmp(key, "string") == 0) {
+			char role[16], text[MAX_STRING_LEN + 1];
+			if (sscanf(rest, "%15s %126[^\n]", role, text) != 2) {
+				error = "expected a role and a string";
+				break;
+			}
+			if (next_string == MAX_STRING_DESCS) {
+				error = "too many strings";
+				break;
+			}
+			if (strcmp(role, "manufacturer") == 0)
+				model->device.iManufacturer = next_string;
+			else if (strcmp(role, "product") == 0)
+				model->device.iProduct = next_string;
+			else if (strcmp(role, "serial") == 0)
+				model->device.iSerialNumber = next_string;
+			else if (strcmp(role, "interface") == 0 && iface)
+				iface->desc.iInterface = next_string;
+			else {
+				error = "unknown string role";
+				break;
+			}
+			strcpy(model->strings[next_string++], text);
+		} else if (strcmp(key, "storage") == 0) {
+			char file[PATH_MAX];
+			if (sscanf(rest, "%4095s", file) != 1) {
+				error = "expected a file";
+				break;
+			}
+			error = storage_open(model, file);
+		} else if (strcmp(key, "config") == 0) {
+			if (sscanf(rest, "%hhi %hhi",
+					&model->config.bmAttributes,
+					&model->config.bMaxPower) != 2)
+				error = "expected <bmAttributes> <bMaxPower>";
+		} else if (strcmp(key, "interface") == 0) {
+			if (model->num_ifaces == MAX_INTERFACES) {
+				error = "too many interfaces";
+				break;
+			}
+			iface = &model->ifaces[model->num_ifaces++];
+			iface->desc = usb_interface;
+			iface->desc.iInterface = 0;
+			iface->hid = usb_hid;
+			if (sscanf(rest, "%hhi %hhi %hhi",
+					&iface->desc.bInterfaceClass,
+					&iface->desc.bInterfaceSubClass,
+					&iface->desc.bInterfaceProtocol) != 3)
+				error = "expected <class> <subclass> <protocol>";
+		} else if (strcmp(key, "report") == 0) {
+			if (iface == NULL) {
+				error = "report outside of an interface";
+				break;
+			}
+			for (char *byte = strtok(rest, " \t"); byte != NULL;
+					byte = strtok(NULL, " \t")) {
+				if (iface->hid_report_len == MAX_HID_REPORT_SIZE) {
+					error = "report descriptor too long";
+					break;
+				}
+				iface->hid_report[iface->hid_report_len++] =
+					strtoul(byte, NULL, 16);
+			}
+		} else if (strcmp(key, "endpoint") == 0) {
+			char type[8], handler[32];
+			unsigned char address, interval;
+			unsigned short max_packet;
+			if (iface == NULL) {
+				error = "endpoint outside of an interface";
+				break;
+			}
+			if (iface->num_eps == MAX_ENDPOINTS) {
+				error = "too many endpoints";
+				break;
+			}
+			if (sscanf(rest, "%hhi %7s %hi %hhi %31s", &address,
+					type, &max_packet, &interval,
+					handler) != 5) {
+				error = "expected <bEndpointAddress> <type> "
+					"<wMaxPacketSize> <bInterval> <handler>";
+				break;
+			}
+			struct ep_model *ep = &iface->eps[iface->num_eps++];
+			ep->desc = usb_endpoint;
+			ep->desc.bEndpointAddress = address;
+			ep->desc.wMaxPacketSize = __cpu_to_le16(max_packet);
+			ep->desc.bInterval = interval;
+			if (strcmp(type, "int") == 0)
+				ep->desc.bmAttributes = USB_ENDPOINT_XFER_INT;
+			else if (strcmp(type, "bulk") == 0)
+				ep->desc.bmAttributes = USB_ENDPOINT_XFER_BULK;
+			else if (strcmp(type, "iso") == 0)
+				ep->desc.bmAttributes = USB_ENDPOINT_XFER_ISOC;
+			else
+				error = "unknown endpoint type";
+			ep->handler = find_ep_handler(handler);
+			int need = (address & USB_DIR_IN) ? HANDLER_IN :
+								HANDLER_OUT;
+			if (usb_endpoint_xfer_isoc(&ep->desc))
+				need |= HANDLER_ISO;
+			if (ep->handler == NULL)
+				error = "unknown endpoint handler";
+			else if ((ep->handler->flags & need) != need)
+				error = "handler can't serve this endpoint";
+			else if (ep->handler->complete == complete_storage)
+				uses_storage = true;
+		} else {
+			error = "unknown keyword";
+		}
+	}
+	fclose(file);
+
+	if (error == NULL && model->num_ifaces == 0)
+		error = "no interfaces";
+	if (error == NULL && uses_storage && model->disk == NULL)
+		error = "storage endpoint without a storage file";
+	for (int i = 0; error == NULL && i < model->num_ifaces; i++) {
+		struct interface_model *iface = &model->ifaces[i];
+		for (int j = 0; j < iface->num_eps; j++) {
+			if (iface->eps[j].handler->complete ==
+					complete_stream &&
+			    iface->hid_report_len == 0)
+				error = "stream endpoint without a report "
+					"descriptor";
+		}
+		if (error == NULL && iface->hid_report_len != 0)
+			error = hid_compile(&iface->layout,
+					&iface->hid_report[0],
+					iface->hid_report_len);
+	}
+	if (error != NULL) {
+		fprintf(stderr, "%s:%d: %s\n", path, lineno, error);
+		if (model->disk != NULL)
+			munmap(model->disk, model->disk_size);
+		free(model);
+		return NULL;
+	}
+
+	model_finish(model);
+	return model;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Returns the size of the frame at the head of the rx ring, or 0 if not
+// enough bytes have arrived yet to tell.
+unsigned int conn_frame_size(struct conn *conn) {
+	unsigned int avail = ring_used(&conn->rx);
+
+	if (conn->state == CONN_STATE_OP) {
+		struct usbip_op_common common;
+		if (avail < sizeof(common))
+			return 0;
+		ring_peek(&conn->rx, &common, sizeof(common));
+		unpack_usbip_op_common(&common);
+		switch (common.code) {
+		case OP_REQ_IMPORT:
+			return sizeof(common) +
+				sizeof(struct usbip_op_import_request);
+		default:
+			return sizeof(common);
+		}
+	}
+
+	struct usbip_header uh;
+	if (avail < sizeof(uh))
+		return 0;
+	ring_peek(&conn->rx, &uh, sizeof(uh));
+	unpack_usbip_header_basic(&uh.base);
+	if (uh.base.command != USBIP_CMD_SUBMIT)
+		return sizeof(uh);
+	unpack_usbip_header_cmd_submit(&uh.u.cmd_submit);
+
+	// OUT data and then isochronous packet descriptors follow.
+	unsigned int size = sizeof(uh);
+	int packets = uh.u.cmd_submit.number_of_packets;
+	if (packets > 0 && packets <= USBIP_MAX_ISO_PACKETS)
+		size += packets * sizeof(struct usbip_iso_packet_descriptor);
+	if (uh.base.direction == USBIP_DIR_OUT &&
+	    uh.u.cmd_submit.transfer_buffer_length > 0)
+		size += uh.u.cmd_submit.transfer_buffer_length;
+	return size;
+}
+
+// Returns -1 on error and 1 if the connection should be closed.
+int conn_handle_op(struct conn *conn, char *frame) {
+	struct usbip_op op, ret;
+	memcpy(&op.common, frame, sizeof(op.common));
+	unpack_usbip_op_common(&op.common);
+
+	switch (op.common.code) {
+	case OP_REQ_DEVLIST:
+		printf("OP_REQ_DEVLIST\n");
+		if (send_devlist_reply(conn) < 0)
+			return -1;
+		conn->draining = true;
+		return 0;
+	case OP_REQ_IMPORT: {
+		memcpy(&op.u.import_request, frame + sizeof(op.common),
+			sizeof(op.u.import_request));
+		op.u.import_request.busid[SYSFS_BUS_ID_SIZE - 1] = 0;
+		printf("OP_REQ_IMPORT %s\n", op.u.import_request.busid);
+
+		// Other workers may be importing the same export right now.
+		struct export *export = find_export(op.u.import_request.busid);
+		struct conn *owner = NULL;
+		int status = ST_OK;
+		if (export == NULL)
+			status = ST_NODEV;
+		else if (!__atomic_compare_exchange_n(&export->conn, &owner,
+				conn, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			status = ST_DEV_BUSY;
+		if (status != ST_OK) {
+			fprintf(stderr, "can't import %s: status %d\n",
+				op.u.import_request.busid, status);
+			init_op_reply(&ret, OP_REP_IMPORT, status);
+			if (conn_send(conn, &ret.common, sizeof(ret.common)) < 0)
+				return -1;
+			conn->draining = true;
+			return 0;
+		}
+
+		conn->export = export;
+		init_import_reply(&ret, export);
+		if (conn_send(conn, &ret, USBIP_OP_IMPORT_REPLY_SIZE) < 0)
+			return -1;
+		conn->model = export->model;
+		conn->state = CONN_STATE_URB;
+		return 0;
+	}
+	default:
+		fprintf(stderr, "unsupported op 0x%02hx\n", op.common.code);
+		return -1;
+	}
+}
+
+// payload is NULL if only the header is in, see conn_handle_frames().
+int conn_handle_urb(struct conn *conn, char *frame, char *payload) {
+	struct usbip_header uh;
+	memcpy(&uh, frame, sizeof(uh));
+	unpack_usbip_header_basic(&uh.base);
+
+	conn->stats.urbs++;
+	switch (uh.base.command) {
+	case USBIP_CMD_SUBMIT:
+		unpack_usbip_header_cmd_submit(&uh.u.cmd_submit);
+		trace_emit(TRACE_CMD_SUBMIT, conn->fd, uh.base.seqnum,
+			uh.base.ep, uh.u.cmd_submit.transfer_buffer_length,
+			uh.base.direction, &uh.u.cmd_submit.setup[0], 8);
+		return handle_usb_request(conn, &uh, payload);
+	case USBIP_CMD_UNLINK:
+		unpack_usbip_header_cmd_unlink(&uh.u.cmd_unlink);
+		trace_emit(TRACE_CMD_UNLINK, conn->fd, uh.base.seqnum,
+			uh.base.ep, uh.u.cmd_unlink.seqnum, 0, NULL, 0);
+		return handle_unlink_request(conn, &uh);
+	default:
+		fprintf(stderr, "unsupported command %d\n", uh.base.command);
+		return -1;
+	}
+}
+
+// Moves what has arrived of a large OUT payload from rx to its URB.
+int conn_take_payload(struct conn *conn) {
+	struct urb *urb = conn->rx_payload.urb;
+	unsigned int len = min_len(ring_used(&conn->rx),
+					conn->rx_payload.left);
+	if (urb != NULL)
+		ring_peek(&conn->rx, urb->buf + conn->rx_payload.off, len);
+	conn->rx.head += len;
+	conn->rx_payload.off += len;
+	conn->rx_payload.left -= len;
+	if (conn->rx_payload.left == 0 && conn->capture_split) {
+		struct iovec iov[2] = {
+			{ &conn->capture_header[0], sizeof(conn->capture_header) },
+			{ urb ? urb->buf + conn->capture_off : NULL,
+			  conn->capture_len },
+		};
+		capture_frame(conn, CAPTURE_HOST, &iov[0], 2);
+		conn->capture_split = false;
+	}
+	if (conn->rx_payload.left > 0 || urb == NULL)
+		return 0;
+	conn->rx_payload.urb = NULL;
+	return urb_arrived(conn, urb);
+}
+
+// Handles every complete frame in the rx ring. Frames with more OUT data
+// than fits into rx are handled as soon as the header is in, the data is
+// then moved into the URB buffer as it arrives. Returns non-zero if the
+// connection should be closed.
+int conn_handle_frames(struct conn *conn) {
+	while (true) {
+		// Replies pile up in tx while the socket doesn't take them
+		// and, on io_uring, until the end of the batch. Leave the
+		// rest for conn_resume() once there's room for the largest
+		// reply again.
+		if (ring_free(&conn->tx) < MAX_REPLY_SIZE) {
+			if (conn->uring)
+				return 0;
+			return conn_poll(conn, false, conn->want_write);
+		}
+
+		if (conn->rx_payload.left > 0 || conn->rx_payload.urb) {
+			int rv = conn_take_payload(conn);
+			if (rv != 0 || conn->rx_payload.left > 0)
+				return rv;
+			continue;
+		}
+
+		unsigned int size = conn_frame_size(conn);
+		bool split = size > RING_SIZE;
+		if (split && conn->state != CONN_STATE_URB) {
+			fprintf(stderr, "frame too large: %u\n", size);
+			return -1;
+		}
+		if (split)
+			size = sizeof(struct usbip_header);
+		if (size == 0 || ring_used(&conn->rx) < size)
+			return 0;
+
+		char *frame = ring_frame(&conn->rx, size, &conn->scratch[0]);
+		if (capture_fd >= 0 && split)
+			memcpy(&conn->capture_header[0], frame, size);
+		else if (capture_fd >= 0) {
+			struct iovec iov = { frame, size };
+			capture_frame(conn, CAPTURE_HOST, &iov, 1);
+		}
+		int rv;
+		if (conn->state == CONN_STATE_OP)
+			rv = conn_handle_op(conn, frame);
+		else
+			rv = conn_handle_urb(conn, frame, split ? NULL :
+					frame + sizeof(struct usbip_header));
+		if (rv != 0)
+			return rv;
+		if (capture_fd >= 0 && split) {
+			conn->capture_split = true;
+			conn->capture_off = conn->rx_payload.off;
+			conn->capture_len = conn->rx_payload.left;
+		}
+
+		conn->rx.head += size;
+
+		// The last reply has been queued, close once it's out.
+		if (conn->draining)
+			return ring_used(&conn->tx) == 0;
+	}
+}
+
+// Reads whatever fits into the rx ring with a single readv() and handles
+// every complete frame. The rest of a large OUT payload is read straight
+// into its URB buffer, along with whatever follows it into rx. Returns
+// non-zero if the connection should be closed.
+int conn_read(struct conn *conn) {
+	if (conn->draining)
+		return 0;
+
+	struct iovec iov[3];
+	int iovcnt = 0;
+	unsigned int direct = 0;
+	struct urb *urb = conn->rx_payload.urb;
+	if (urb != NULL && ring_used(&conn->rx) == 0) {
+		direct = conn->rx_payload.left;
+		iov[0].iov_base = urb->buf + conn->rx_payload.off;
+		iov[0].iov_len = direct;
+		iovcnt = 1;
+	}
+	iovcnt += ring_iov(&conn->rx, false, &iov[iovcnt]);
+	// Full while frames are held back, see conn_handle_frames().
+	if (iovcnt == 0)
+		return 0;
+
+	conn->stats.syscalls++;
+	ssize_t rv = readv(conn->fd, &iov[0], iovcnt);
+	if (rv < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("readv()");
+		return -1;
+	}
+	if (rv == 0)
+		return 1;
+	unsigned int taken = min_len(rv, direct);
+	conn->rx_payload.off += taken;
+	conn->rx_payload.left -= taken;
+	conn->rx.tail += rv - taken;
+
+	return conn_handle_frames(conn);
+}
+
+// Picks up the frames and bulk URBs held back by a full tx once it has
+// room again. Returns non-zero if the connection should be closed.
+int conn_resume(struct conn *conn) {
+	if (conn->draining || ring_free(&conn->tx) < MAX_REPLY_SIZE)
+		return 0;
+	if (conn->bulk_blocked) {
+		conn->bulk_blocked = false;
+		int rv = conn_run_bulk(conn);
+		if (rv != 0)
+			return rv;
+	}
+	if (conn->uring)
+		return uring_conn_input(conn);
+	if (!conn->want_read && conn_poll(conn, true, conn->want_write) < 0)
+		return -1;
+	return conn_handle_frames(conn);
+}
+
+/*----------------------------------------------------------------------*/
+
+void conn_close(struct conn *conn) {
+	if (conn->closed)
+		return;
+	printf("closing connection from %s\n", conn->name);
+	printf("%lu URBs, %lu syscalls (%.2f per URB), "
+		"%lu/%lu zerocopy sends completed\n",
+		conn->stats.urbs, conn->stats.syscalls,
+		conn->stats.urbs ?
+			(double)conn->stats.syscalls / conn->stats.urbs : 0.0,
+		conn->stats.zerocopy_done, conn->stats.zerocopy_sent);
+	printf("%lu URB buffers (%lu reused), %zu KiB of arena used\n",
+		conn->urbs.arena.allocs, conn->urbs.arena.reused,
+		conn->urbs.arena.used / 1024);
+	trace_emit(TRACE_CONN_CLOSE, conn->fd, 0, 0, conn->stats.urbs, 0,
+		NULL, 0);
+	if (capture_fd >= 0)
+		capture_frame(conn, CAPTURE_CLOSE, NULL, 0);
+	for (int i = 0; i < 2 * MAX_ENDPOINTS; i++) {
+		struct ep_sched *sched = &conn->eps[i];
+		if (sched->model == NULL)
+			continue;
+		if (sched->timer_fd >= 0)
+			close(sched->timer_fd);
+		if (sched->model->handler->detach != NULL)
+			sched->model->handler->detach(sched);
+	}
+	if (conn->uring) {
+		// Ends the multishot recv, the conn is only freed once all
+		// of its SQEs have completed.
+		shutdown(conn->fd, SHUT_RDWR);
+		uring_conn_drop_stash(conn);
+	}
+	close(conn->fd);
+	if (conn->export != NULL)
+		__atomic_store_n(&conn->export->conn, NULL, __ATOMIC_RELEASE);
+	conn->closed = true;
+	conn->worker->num_conns--;
+	conn->next_closed = conn->worker->closed_conns;
+	conn->worker->closed_conns = conn;
+}
+
+void free_closed_conns(struct worker *worker) {
+	struct conn **link = &worker->closed_conns;
+	while (*link != NULL) {
+		struct conn *conn = *link;
+		if (conn->ur_ops > 0) {
+			link = &conn->next_closed;
+			continue;
+		}
+		*link = conn->next_closed;
+		arena_destroy(&conn->urbs.arena);
+		free(conn);
+	}
+}
+
+struct conn *add_conn(struct worker *worker, int fd, const char *name) {
+	printf("connection from %s\n", name);
+
+	int nodelay = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		       &nodelay, sizeof(nodelay)) < 0 && errno != EOPNOTSUPP)
+		perror("setsockopt(TCP_NODELAY)");
+
+	struct conn *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		perror("calloc()");
+		close(fd);
+		return NULL;
+	}
+	conn->source.type = SOURCE_CONN;
+	conn->source.conn = conn;
+	conn->worker = worker;
+	conn->fd = fd;
+	conn->epoll_fd = worker->epoll_fd;
+	conn->state = CONN_STATE_OP;
+	conn->rx.data = &conn->rx_data[0];
+	conn->rx.size = RING_SIZE;
+	conn->tx.data = &conn->tx_data[0];
+	conn->tx.size = TX_RING_SIZE;
+	conn->want_read = true;
+	snprintf(conn->name, sizeof(conn->name), "%s", name);
+	if (urb_table_init(&conn->urbs) < 0) {
+		close(fd);
+		free(conn);
+		return NULL;
+	}
+	for (int i = 0; i < 2 * MAX_ENDPOINTS; i++)
+		conn->eps[i].timer_fd = -1;
+	conn->capture_id = __atomic_add_fetch(&capture_conns, 1,
+						__ATOMIC_RELAXED);
+	if (capture_fd >= 0) {
+		struct iovec iov = { conn->name, strlen(conn->name) };
+		capture_frame(conn, CAPTURE_OPEN, &iov, 1);
+	}
+
+	if (worker->uring.fd >= 0) {
+		conn->uring = true;
+		worker->num_conns++;
+		uring_arm_recv(conn);
+		trace_emit(TRACE_CONN_OPEN, fd, 0, 0, 0, 0, NULL, 0);
+		return conn;
+	}
+
+	if (zerocopy_threshold != 0) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+			       &one, sizeof(one)) < 0)
+			perror("setsockopt(SO_ZEROCOPY)");
+		else
+			conn->zerocopy = true;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = &conn->source;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		close(fd);
+		arena_destroy(&conn->urbs.arena);
+		free(conn);
+		return NULL;
+	}
+	worker->num_conns++;
+	trace_emit(TRACE_CONN_OPEN, fd, 0, 0, 0, 0, NULL, 0);
+	return conn;
+}
+
+void accept_connections(struct worker *worker) {
+	while (true) {
+		struct sockaddr_in client;
+		unsigned int addrlen = sizeof(client);
+		char name[INET_ADDRSTRLEN];
+		int fd = accept4(worker->server_fd, (struct sockaddr*)&client, &addrlen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("accept4()");
+			return;
+		}
+		inet_ntop(AF_INET, &client.sin_addr, &name[0], sizeof(name));
+		add_conn(worker, fd, &name[0]);
+	}
+}
+
+// Connected sockets handed over with -f, e.g. one end of a socketpair.
+void adopt_conn(struct worker *worker, int fd) {
+	char name[32];
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl()");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	snprintf(&name[0], sizeof(name), "fd %d", fd);
+	add_conn(worker, fd, &name[0]);
+}
+
+// With -a exports are attached to vhci_hcd directly, the way the usbip
+// CLI does it after importing a device over TCP: one end of a socketpair
+// and the device's identity are written to the attach file and the kernel
+// starts sending URBs into it. No TCP and no OP_REQ_IMPORT.
+#define VDEV_ST_NULL 4
+
+// Finds a free root hub port for a device of the given speed. Each
+// controller has its own status file (status, status.1, ...), port
+// numbers in them are global.
+int vhci_free_port(int speed) {
+	const char *want = speed == USB_SPEED_SUPER ? "ss" : "hs";
+	for (int hcd = 0; ; hcd++) {
+		char path[64];
+		if (hcd == 0)
+			snprintf(&path[0], sizeof(path), VHCI_PATH "/status");
+		else
+			snprintf(&path[0], sizeof(path),
+				VHCI_PATH "/status.%d", hcd);
+		FILE *file = fopen(&path[0], "r");
+		if (file == NULL)
+			return -1;
+
+		char line[256];
+		int port = -1;
+		while (port < 0 && fgets(&line[0], sizeof(line), file)) {
+			char hub[8];
+			unsigned int num, status;
+			if (sscanf(&line[0], "%7s %u %u", &hub[0], &num,
+					&status) == 3 &&
+			    strcmp(&hub[0], want) == 0 &&
+			    status == VDEV_ST_NULL)
+				port = num;
+		}
+		fclose(file);
+		if (port >= 0)
+			return port;
+	}
+}
+
+// Plugs export into a vhci_hcd port. Returns the connection that the
+// kernel sends its URBs into, or NULL.
+struct conn *vhci_plug(struct worker *worker, struct export *export,
+			int port) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, &fds[0]) < 0) {
+		perror("socketpair()");
+		return NULL;
+	}
+
+	int attach_fd = open(VHCI_PATH "/attach", O_WRONLY | O_CLOEXEC);
+	if (attach_fd < 0) {
+		perror("open(" VHCI_PATH "/attach)");
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	char request[64];
+	int len = snprintf(&request[0], sizeof(request), "%d %d %u %d",
+		port, fds[1], (export->busnum << 16) | export->devnum,
+		export->model->speed);
+	int rv = write(attach_fd, &request[0], len);
+	if (rv != len)
+		perror("write(" VHCI_PATH "/attach)");
+	close(attach_fd);
+	// The kernel holds its own reference to the socket now.
+	close(fds[1]);
+	if (rv != len) {
+		close(fds[0]);
+		return NULL;
+	}
+
+	int flags = fcntl(fds[0], F_GETFL);
+	if (flags < 0 || fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl()");
+		close(fds[0]);
+		return NULL;
+	}
+	char name[32];
+	snprintf(&name[0], sizeof(name), "vhci port %d", port);
+	struct conn *conn = add_conn(worker, fds[0], &name[0]);
+	if (conn == NULL)
+		return NULL;
+	export->conn = conn;
+	conn->export = export;
+	conn->model = export->model;
+	conn->state = CONN_STATE_URB;
+	return conn;
+}
+
+void vhci_attach(struct worker *worker, struct export *export) {
+	int port = vhci_free_port(export->model->speed);
+	if (port < 0) {
+		fprintf(stderr, "no free vhci_hcd port for %s "
+			"(is vhci_hcd loaded?)\n", export->busid);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("attaching %s to vhci_hcd port %d\n", export->busid, port);
+	export->attaching = true;
+	attach_pending++;
+	if (vhci_plug(worker, export, port) == NULL)
+		exit(EXIT_FAILURE);
+}
+
+int listen_usbip(int port, bool reuseport) {
+	int server_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (server_fd < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	int reuse = 1;
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
+		       (const char*)&reuse, sizeof(reuse)) < 0)
+		perror("setsockopt(SO_REUSEADDR)");
+	if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT,
+				    &reuse, sizeof(reuse)) < 0) {
+		perror("setsockopt(SO_REUSEPORT)");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in serv;
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv.sin_port = htons(port);
+
+	if (bind(server_fd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(server_fd, SOMAXCONN) < 0) {
+		perror("listen()");
+		exit(EXIT_FAILURE);
+	}
+
+	return server_fd;
+}
+
+bool script_is_file(const char *path) {
+	struct stat st;
+	return strcmp(path, "-") != 0 && stat(path, &st) == 0 &&
+		S_ISREG(st.st_mode);
+}
+
+// With -p 0 only the -f sockets are served, and the worker exits once
+// they are all closed.
+void worker_init(struct worker *worker, int id, const char *script,
+			int port, bool uring) {
+	worker->id = id;
+	worker->server_fd = -1;
+	worker->uring.fd = -1;
+	if (capture_fd >= 0) {
+		worker->capture_buf = malloc(CAPTURE_BUF_SIZE);
+		if (worker->capture_buf == NULL) {
+			perror("malloc()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (uring && uring_init(&worker->uring) < 0)
+		perror("io_uring unavailable, using epoll");
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll_fd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+
+	stream_init(&worker->stream, script, worker->epoll_fd);
+
+	if (port == 0)
+		return;
+
+	worker->server_fd = listen_usbip(port, num_workers > 1);
+	worker->server_source.type = SOURCE_SERVER;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &worker->server_source;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD,
+		      worker->server_fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void worker_dispatch(struct worker *worker, struct epoll_event *events,
+			int n) {
+	for (int i = 0; i < n; i++) {
+		struct poll_source *source = events[i].data.ptr;
+		struct conn *conn = source->conn;
+		switch (source->type) {
+		case SOURCE_SERVER:
+			accept_connections(worker);
+			break;
+		case SOURCE_CONN:
+			if (conn->closed)
+				break;
+			if (events[i].events & EPOLLHUP) {
+				conn_close(conn);
+				break;
+			}
+			if ((events[i].events & EPOLLERR) &&
+			    conn_drain_errqueue(conn) != 0) {
+				conn_close(conn);
+				break;
+			}
+			if ((events[i].events & EPOLLOUT) &&
+			    conn_flush(conn) != 0) {
+				conn_close(conn);
+				break;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) &&
+			    conn_read(conn) != 0)
+				conn_close(conn);
+			break;
+		case SOURCE_TIMER:
+			if (conn->closed)
+				break;
+			if (ep_sched_tick(&conn->eps[source->ep]) != 0)
+				conn_close(conn);
+			break;
+		case SOURCE_STREAM:
+			stream_fill(&worker->stream);
+			break;
+		}
+	}
+}
+
+void *worker_main(void *arg) {
+	struct worker *worker = arg;
+
+	if (worker->uring.fd >= 0) {
+		worker_loop_uring(worker);
+		return NULL;
+	}
+
+	while (worker->server_fd >= 0 || worker->num_conns > 0) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(worker->epoll_fd, &events[0], MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+		worker_dispatch(worker, &events[0], n);
+		stream_check_done(worker);
+		free_closed_conns(worker);
+		capture_flush(worker);
+	}
+
+	return NULL;
+}
+
+void add_model(const char *name) {
+	if (num_models == MAX_MODELS) {
+		fprintf(stderr, "too many device models\n");
+		exit(EXIT_FAILURE);
+	}
+	struct device_model *model;
+	if (strcmp(name, "keyboard") == 0)
+		model = builtin_keyboard();
+	else
+		model = load_model(name);
+	if (model == NULL)
+		exit(EXIT_FAILURE);
+	models[num_models++] = model;
+}
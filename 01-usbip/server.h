@@ -0,0 +1,493 @@
+// Core of the USB/IP server in server.c: device models, connections,
+// endpoint queues and workers, shared with the io_uring transport, the
+// mass storage handler and the HID report packer next to it. keyboard.c
+// and fuzz.c run it.
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/usb/ch9.h>
+
+#include "hid.h"
+#include "storage.h"
+#include "uring.h"
+#include "usbip.h"
+
+/*----------------------------------------------------------------------*/
+
+struct hid_class_descriptor {
+	__u8 bDescriptorType;
+	__le16 wDescriptorLength;
+} __attribute__((packed));
+
+struct hid_descriptor {
+	__u8 bLength;
+	__u8 bDescriptorType;
+	__le16 bcdHID;
+	__u8 bCountryCode;
+	__u8 bNumDescriptors;
+
+	struct hid_class_descriptor desc[1];
+} __attribute__((packed));
+
+/*----------------------------------------------------------------------*/
+
+// A device model is a complete descriptor set plus the handlers that
+// produce data for its IN endpoints and consume it from its OUT ones.
+// The keyboard is built in, other models are loaded from text
+// descriptions, see load_model().
+
+#define MAX_MODELS 32
+#define MAX_INTERFACES 8
+#define MAX_ENDPOINTS 16
+#define MAX_HID_REPORT_SIZE 1024
+#define MAX_CONFIG_SIZE 1024
+#define MAX_STRING_DESCS 8
+#define MAX_STRING_LEN 126
+
+// The host gets this string for every index the model leaves undefined.
+#define USB_STRING "x"
+
+struct conn;
+struct ep_sched;
+
+// Return values of ep_handler.complete(), which returns -1 on errors.
+#define URB_DONE	0
+#define URB_CLOSE	1	// completed, and the connection should go
+#define URB_NOT_READY	2	// no data yet, keep the URB queued
+
+struct urb;
+
+// What a handler can serve: endpoint directions and whether it knows
+// about isochronous packets.
+#define HANDLER_IN	1
+#define HANDLER_OUT	2
+#define HANDLER_ISO	4
+
+struct ep_handler {
+	const char *name;
+	int flags;
+	int (*complete)(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb);
+	// Optional, called when an endpoint starts and stops being used.
+	void (*attach)(struct ep_sched *sched);
+	void (*detach)(struct ep_sched *sched);
+};
+
+struct ep_model {
+	struct usb_endpoint_descriptor desc;
+	struct ep_handler *handler;
+	// Report layout of the interface, NULL if it has no report
+	// descriptor. Filled in by model_finish().
+	struct hid_layout *layout;
+};
+
+struct interface_model {
+	struct usb_interface_descriptor desc;
+	struct hid_descriptor hid;
+	char hid_report[MAX_HID_REPORT_SIZE];
+	unsigned int hid_report_len;
+	struct hid_layout layout;	// compiled hid_report
+	struct ep_model eps[MAX_ENDPOINTS];
+	int num_eps;
+};
+
+// Every descriptor the device can return, serialized once when the model
+// is set up so that answering GET_DESCRIPTOR is a lookup plus a single
+// send.
+struct desc_blob {
+	const char *data;
+	unsigned int len;
+};
+
+struct desc_cache {
+	struct desc_blob device;
+	struct desc_blob qualifier;
+	struct desc_blob config;
+	struct desc_blob hid[MAX_INTERFACES];
+	struct desc_blob hid_report[MAX_INTERFACES];
+	struct desc_blob strings[MAX_STRING_DESCS];
+
+	char config_data[MAX_CONFIG_SIZE];
+	char string_data[MAX_STRING_DESCS][2 + 2 * MAX_STRING_LEN];
+};
+
+struct device_model {
+	char name[64];
+	int speed;
+
+	struct usb_device_descriptor device;
+	struct usb_qualifier_descriptor qualifier;
+	struct usb_config_descriptor config;
+	struct interface_model ifaces[MAX_INTERFACES];
+	int num_ifaces;
+	char strings[MAX_STRING_DESCS][MAX_STRING_LEN + 1];
+
+	// Endpoints by number, filled in by model_finish().
+	struct ep_model *ep_in[MAX_ENDPOINTS];
+	struct ep_model *ep_out[MAX_ENDPOINTS];
+
+	// Backing file of the "storage" handler, mapped shared.
+	char *disk;
+	size_t disk_size;
+	bool disk_read_only;
+
+	struct desc_cache cache;
+
+	// Answer to control requests the model doesn't know, see
+	// reply_fallback(). Without one (data is NULL) they, and URBs for
+	// endpoints it doesn't have, end the connection.
+	struct desc_blob fallback;
+};
+
+/*----------------------------------------------------------------------*/
+
+// Devices offered to clients, one per bus ID. The same model can be
+// exported many times (see -n), each export can be attached by one
+// client at a time.
+
+#define MAX_EXPORTS 256
+
+struct export {
+	char busid[SYSFS_BUS_ID_SIZE];
+	unsigned int busnum;
+	unsigned int devnum;
+	struct device_model *model;
+	struct conn *conn;
+	bool attaching;		// attached with -a, not configured yet
+};
+
+/*----------------------------------------------------------------------*/
+
+#define MAX_EVENTS 64
+
+enum poll_source_type {
+	SOURCE_SERVER,
+	SOURCE_CONN,
+	SOURCE_TIMER,
+	SOURCE_STREAM,
+};
+
+// What epoll_event.data.ptr points to.
+struct poll_source {
+	enum poll_source_type type;
+	struct conn *conn;
+	int ep;
+};
+
+// Transfer buffers of queued URBs come from a per-connection arena. It's
+// a single MAP_NORESERVE reservation that buffers are carved from with a
+// bump pointer, so only what the connection has actually used is backed
+// by memory. Freed buffers go to a free list per size class and are
+// handed out again, nothing is allocated per URB. A connection never
+// holds more than ARENA_SIZE of buffers whatever the host submits; a
+// URB that doesn't fit fails with -ENOMEM, one larger than the largest
+// class with -EMSGSIZE.
+#define ARENA_SIZE (4 * 1024 * 1024)
+#define NUM_BUF_CLASSES 5
+#define MAX_URB_BUFFER (128 * 1024)
+
+struct arena {
+	char *base;
+	size_t used;
+	void *free[NUM_BUF_CLASSES];	// linked through the first word
+	unsigned long allocs;
+	unsigned long reused;
+};
+
+// URBs the host has submitted but that have not been completed yet.
+// Seqnums are handed out sequentially by vhci_hcd, so masking them is a
+// good enough hash and lookups by seqnum for CMD_UNLINK are O(1).
+#define MAX_INFLIGHT_URBS 1024
+#define URB_HASH_SIZE 1024
+
+struct urb {
+	__u32 seqnum;
+	int ep;			// index into conn->eps, see ep_index()
+	bool in;
+	unsigned int length;	// transfer_buffer_length
+	char *buf;		// from the arena, NULL if length is 0
+	int buf_class;
+	// Isochronous URBs keep their packet descriptors, unpacked, in the
+	// same buffer right after the data, see urb_iso_packets().
+	int number_of_packets;
+	struct urb *hash_next;
+	struct urb *prev;	// endpoint queue, or free list via next
+	struct urb *next;
+};
+
+struct urb_table {
+	struct urb urbs[MAX_INFLIGHT_URBS];
+	struct urb *free;
+	struct urb *buckets[URB_HASH_SIZE];
+	unsigned int count;
+	struct arena arena;
+};
+
+// URBs submitted by the host wait here until the endpoint's handler
+// completes them. Interrupt and isochronous URBs are completed when the
+// endpoint's timer fires, so that they are paced by bInterval rather than
+// by blocking the whole server. Bulk endpoints have no timer, their URBs
+// are completed as soon as the handler has data, see ep_sched_run().
+// IN and OUT endpoints with the same number get separate queues.
+struct ep_sched {
+	struct poll_source source;
+	struct ep_model *model;		// NULL until the endpoint is used
+	int timer_fd;
+	bool armed;
+	struct timespec period;
+	int armed_packets;		// intervals per timer expiration
+
+	// Position in the report stream, see complete_stream().
+	unsigned long stream_pos;
+	struct timespec stream_last;
+	struct ep_sched *stream_next;
+	// Reports of the last state taken from the stream and of what went
+	// out last, one HID_REPORT_STRIDE slot per report of the layout.
+	char stream_packed[HID_MAX_REPORTS * HID_REPORT_STRIDE];
+	char stream_sent[HID_MAX_REPORTS * HID_REPORT_STRIDE];
+	unsigned int stream_pending;	// reports of stream_packed to send
+	unsigned int stream_tx_end;	// conn->tx.tail after the last one
+
+	struct urb *first;
+	struct urb *last;
+	unsigned int count;
+};
+
+// Byte ring used to reassemble incoming frames out of partial reads and
+// to hold replies the socket could not take right away. head and tail
+// are free-running, sizes must be powers of two. Frames larger than
+// RING_SIZE only come with bulk and isochronous OUT data, which goes
+// straight into the URB buffer instead, see conn_handle_frames(). The
+// transmit ring holds whole replies of up to a full URB buffer.
+#define RING_SIZE (16 * 1024)
+#define TX_RING_SIZE (256 * 1024)
+
+// Largest single reply, see conn_handle_frames(). Isochronous packet
+// descriptors share the URB buffer with the data.
+#define MAX_REPLY_SIZE (sizeof(struct usbip_header) + MAX_URB_BUFFER)
+
+struct ring {
+	char *data;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+};
+
+static inline unsigned int ring_used(struct ring *ring) {
+	return ring->tail - ring->head;
+}
+
+static inline unsigned int ring_free(struct ring *ring) {
+	return ring->size - ring_used(ring);
+}
+
+/*----------------------------------------------------------------------*/
+
+enum conn_state {
+	CONN_STATE_OP,		// waiting for OP_REQ_IMPORT
+	CONN_STATE_URB,		// attached, exchanging USBIP_CMD_* / USBIP_RET_*
+};
+
+// Per-connection state. Everything that used to live in globals or
+// function-scope statics while only one client was served lives here.
+struct conn {
+	struct poll_source source;
+	struct worker *worker;
+	int fd;
+	int epoll_fd;
+	enum conn_state state;
+	char name[32];
+	struct device_model *model;
+	struct export *export;
+	bool draining;
+	bool closed;
+	struct conn *next_closed;
+
+	struct ring rx;
+	struct ring tx;
+	char rx_data[RING_SIZE];
+	char tx_data[TX_RING_SIZE];
+	char scratch[RING_SIZE];
+	bool want_write;
+	bool want_read;
+	bool zerocopy;
+
+	// OUT payload that is too large for rx and goes into the URB buffer
+	// (or nowhere, when urb is NULL) as it arrives.
+	struct {
+		struct urb *urb;
+		unsigned int off;
+		unsigned int left;
+	} rx_payload;
+	// Bulk URBs wait for room in tx, see ep_sched_run().
+	bool bulk_blocked;
+
+	// Number of the connection in the capture (-w). A frame whose OUT
+	// data goes straight into the URB buffer is captured once the data
+	// is all in, its header waits in capture_header until then.
+	unsigned int capture_id;
+	bool capture_split;
+	char capture_header[sizeof(struct usbip_header)];
+	unsigned int capture_off;
+	unsigned int capture_len;
+
+	// Served through the worker's io_uring instead of epoll. Received
+	// buffers wait in ur_stash until rx has room for them.
+	bool uring;
+	bool ur_recv_armed;
+	bool ur_dirty;
+	struct conn *ur_next_dirty;
+	unsigned int ur_ops;		// SQEs in flight
+	unsigned int ur_sends;
+	struct ur_stash_entry ur_stash[UR_NUM_BUFS];
+	unsigned int ur_stash_head;
+	unsigned int ur_stash_tail;
+	unsigned int ur_stash_off;
+
+	struct {
+		unsigned long urbs;
+		unsigned long syscalls;
+		unsigned long zerocopy_sent;
+		unsigned long zerocopy_done;
+	} stats;
+
+	struct urb_table urbs;
+	struct ep_sched eps[2 * MAX_ENDPOINTS];
+	struct bot bot;
+};
+
+// Report stream of a worker, see stream_init().
+#define STREAM_RING_SIZE 4096	// states, must be a power of two
+#define STREAM_LINE_SIZE 1024
+
+struct stream_report {
+	struct hid_state state;
+	unsigned int delay_us;		// since the previous report
+};
+
+struct stream {
+	struct stream_report ring[STREAM_RING_SIZE];
+	unsigned long head;		// oldest report someone still needs
+	unsigned long tail;
+
+	int fd;
+	int epoll_fd;
+	bool pollable;
+	bool watching;
+	bool eof;
+	struct poll_source source;
+	char line[STREAM_LINE_SIZE];
+	unsigned int line_len;
+
+	// Input state of the script at the tail of the ring.
+	struct hid_state state;
+	unsigned int delay_us;
+
+	struct ep_sched *consumers;
+};
+
+// With -j N the server runs N workers, each in its own thread with its
+// own epoll loop, listening socket (bound with SO_REUSEPORT, so the kernel
+// spreads connections across them), report stream and connections. A
+// connection never leaves the worker that accepted it, so nothing on the
+// URB path is shared between threads. The only shared mutable state is
+// export->conn, which is claimed with a compare-and-swap on import.
+struct worker {
+	int id;
+	pthread_t thread;
+	int epoll_fd;
+	int server_fd;
+	struct poll_source server_source;
+	struct stream stream;
+	struct uring uring;
+
+	// Connections closed while handling a batch of events are only
+	// freed once the batch is done, as later events in it may still
+	// refer to them.
+	struct conn *closed_conns;
+	int num_conns;
+
+	// Capture records not yet written, see capture_frame().
+	char *capture_buf;
+	size_t capture_used;
+};
+
+#define MAX_WORKERS 64
+
+/*----------------------------------------------------------------------*/
+
+static inline unsigned int min_len(unsigned int a, unsigned int b) {
+	return a < b ? a : b;
+}
+
+int ring_iov(struct ring *ring, bool used, struct iovec *iov);
+void ring_put(struct ring *ring, void *src, unsigned int len);
+
+int usbip_reply_status(struct conn *conn, __u32 seqnum, int status,
+			void *data, unsigned int size, bool stable);
+int usbip_reply_out(struct conn *conn, struct urb *urb, unsigned int actual);
+
+int conn_handle_frames(struct conn *conn);
+int conn_resume(struct conn *conn);
+void conn_close(struct conn *conn);
+
+void worker_dispatch(struct worker *worker, struct epoll_event *events,
+			int n);
+void stream_check_done(struct worker *worker);
+void free_closed_conns(struct worker *worker);
+void capture_flush(struct worker *worker);
+
+/*----------------------------------------------------------------------*/
+
+// Set up by the programs running the server, mostly from their options.
+
+extern struct device_model *models[MAX_MODELS];
+extern int num_models;
+extern struct export exports[MAX_EXPORTS];
+extern int num_exports;
+extern struct worker workers[MAX_WORKERS];
+extern int num_workers;
+
+extern bool unpaced;
+extern bool stream_exit;
+extern unsigned int zerocopy_threshold;
+extern int ready_fd;
+extern int attach_pending;
+extern struct timespec attach_start;
+
+// Called for every control request before it's answered. fuzz.c hashes
+// the setup packets with it to tell how enumeration went.
+extern void (*control_hook)(struct conn *conn,
+				const struct usb_ctrlrequest *ctrl);
+
+// Loads a model from a text description, or "keyboard" for the built-in
+// one, and adds it to models[].
+void add_model(const char *name);
+void add_export(struct device_model *model);
+void source_init(void);
+void capture_start(const char *path);
+bool script_is_file(const char *path);
+
+void worker_init(struct worker *worker, int id, const char *script,
+			int port, bool uring);
+void *worker_main(void *arg);
+void adopt_conn(struct worker *worker, int fd);
+
+#define VHCI_PATH "/sys/devices/platform/vhci_hcd.0"
+
+int vhci_free_port(int speed);
+struct conn *vhci_plug(struct worker *worker, struct export *export,
+			int port);
+void vhci_attach(struct worker *worker, struct export *export);
+
+#endif // SERVER_H
@@ -0,0 +1,279 @@
+// Mass storage handler of the USB/IP server, see storage.h.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/usb/ch9.h>
+
+#include "server.h"
+
+#define BOT_CBW_SIGNATURE	0x43425355	// "USBC"
+#define BOT_CSW_SIGNATURE	0x53425355	// "USBS"
+#define BOT_BLOCK_SIZE		512
+
+struct bot_cbw {
+	__le32 dCBWSignature;
+	__le32 dCBWTag;
+	__le32 dCBWDataTransferLength;
+	__u8 bmCBWFlags;
+	__u8 bCBWLUN;
+	__u8 bCBWCBLength;
+	__u8 CBWCB[16];
+} __attribute__((packed));
+
+struct bot_csw {
+	__le32 dCSWSignature;
+	__le32 dCSWTag;
+	__le32 dCSWDataResidue;
+	__u8 bCSWStatus;
+} __attribute__((packed));
+
+#define SCSI_TEST_UNIT_READY		0x00
+#define SCSI_REQUEST_SENSE		0x03
+#define SCSI_INQUIRY			0x12
+#define SCSI_MODE_SENSE_6		0x1a
+#define SCSI_START_STOP_UNIT		0x1b
+#define SCSI_PREVENT_ALLOW_REMOVAL	0x1e
+#define SCSI_READ_CAPACITY_10		0x25
+#define SCSI_READ_10			0x28
+#define SCSI_WRITE_10			0x2a
+#define SCSI_VERIFY_10			0x2f
+#define SCSI_SYNCHRONIZE_CACHE_10	0x35
+#define SCSI_MODE_SENSE_10		0x5a
+
+#define SENSE_NOT_READY			0x02
+#define SENSE_MEDIUM_ERROR		0x03
+#define SENSE_ILLEGAL_REQUEST		0x05
+#define SENSE_DATA_PROTECT		0x07
+
+static unsigned int get_be16(const __u8 *p) {
+	return p[0] << 8 | p[1];
+}
+
+static unsigned int get_be32(const __u8 *p) {
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(char *p, unsigned int value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static unsigned int scsi_fail(struct bot *bot, __u8 key, __u8 asc, __u8 ascq) {
+	bot->status = 1;
+	bot->sense[0] = key;
+	bot->sense[1] = asc;
+	bot->sense[2] = ascq;
+	bot->data = NULL;
+	return 0;
+}
+
+// Runs a command and returns how much data the device has for it (or
+// wants, with *out set), which bot->data then points to.
+static unsigned int scsi_command(struct conn *conn, __u8 *cdb, bool *out) {
+	struct device_model *model = conn->model;
+	struct bot *bot = &conn->bot;
+	char *resp = &bot->response[0];
+	unsigned long blocks = model->disk_size / BOT_BLOCK_SIZE;
+
+	*out = false;
+	memset(resp, 0, BOT_RESPONSE_SIZE);
+	bot->data = resp;
+	bot->stable = false;
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_PREVENT_ALLOW_REMOVAL:
+	case SCSI_VERIFY_10:
+		return 0;
+	case SCSI_SYNCHRONIZE_CACHE_10:
+		if (msync(model->disk, model->disk_size, MS_SYNC) < 0)
+			return scsi_fail(bot, SENSE_MEDIUM_ERROR, 0x0c, 0);
+		return 0;
+	case SCSI_REQUEST_SENSE:
+		resp[0] = 0x70;		// current error, fixed format
+		resp[2] = bot->sense[0];
+		resp[7] = 10;
+		resp[12] = bot->sense[1];
+		resp[13] = bot->sense[2];
+		memset(&bot->sense[0], 0, sizeof(bot->sense));
+		return min_len(18, cdb[4]);
+	case SCSI_INQUIRY:
+		if (cdb[1] & 1)		// no vital product data pages
+			return scsi_fail(bot, SENSE_ILLEGAL_REQUEST, 0x24, 0);
+		resp[1] = 0x80;		// removable
+		resp[2] = 2;		// SCSI-2
+		resp[3] = 2;
+		resp[4] = 36 - 5;
+		memcpy(&resp[8], "USB/IP  Disk            0001", 28);
+		return min_len(36, get_be16(&cdb[3]));
+	case SCSI_MODE_SENSE_6:
+		resp[0] = 3;
+		resp[2] = model->disk_read_only ? 0x80 : 0;
+		return min_len(4, cdb[4]);
+	case SCSI_MODE_SENSE_10:
+		resp[1] = 6;
+		resp[3] = model->disk_read_only ? 0x80 : 0;
+		return min_len(8, get_be16(&cdb[7]));
+	case SCSI_READ_CAPACITY_10:
+		put_be32(&resp[0], blocks > 0xffffffffUL ? 0xffffffff :
+					blocks - 1);
+		put_be32(&resp[4], BOT_BLOCK_SIZE);
+		return 8;
+	case SCSI_READ_10:
+	case SCSI_WRITE_10: {
+		unsigned long lba = get_be32(&cdb[2]);
+		unsigned long count = get_be16(&cdb[7]);
+		if (lba + count > blocks)
+			return scsi_fail(bot, SENSE_ILLEGAL_REQUEST, 0x21, 0);
+		if (cdb[0] == SCSI_WRITE_10 && model->disk_read_only)
+			return scsi_fail(bot, SENSE_DATA_PROTECT, 0x27, 0);
+		*out = (cdb[0] == SCSI_WRITE_10);
+		bot->data = model->disk + lba * BOT_BLOCK_SIZE;
+		bot->stable = true;
+		return count * BOT_BLOCK_SIZE;
+	}
+	default:
+		return scsi_fail(bot, SENSE_ILLEGAL_REQUEST, 0x20, 0);
+	}
+}
+
+// A CBW starts the next command. Invalid ones stall the endpoint, the
+// host then resets the transport.
+static int bot_command(struct conn *conn, struct urb *urb) {
+	struct bot *bot = &conn->bot;
+	struct bot_cbw *cbw = (struct bot_cbw *)urb->buf;
+	if (urb->length != sizeof(*cbw) ||
+	    __le32_to_cpu(cbw->dCBWSignature) != BOT_CBW_SIGNATURE) {
+		if (usbip_reply_status(conn, urb->seqnum, -EPIPE, NULL, 0,
+					true) < 0)
+			return -1;
+		return URB_DONE;
+	}
+
+	unsigned int host_len = __le32_to_cpu(cbw->dCBWDataTransferLength);
+	bool host_in = cbw->bmCBWFlags & USB_DIR_IN;
+	bot->tag = __le32_to_cpu(cbw->dCBWTag);
+	bot->residue = host_len;
+	bot->status = 0;
+	bool out;
+	unsigned int len = scsi_command(conn, &cbw->CBWCB[0], &out);
+	if (len > 0 && (host_len == 0 || out == host_in))
+		len = scsi_fail(bot, SENSE_ILLEGAL_REQUEST, 0x24, 0);
+
+	// Data the host expects and the device doesn't have is cut short
+	// on IN and thrown away on OUT, the difference is the residue.
+	if (host_len == 0) {
+		bot->phase = BOT_CSW;
+	} else if (host_in) {
+		bot->phase = BOT_DATA_IN;
+		bot->left = min_len(len, host_len);
+	} else {
+		bot->phase = BOT_DATA_OUT;
+		bot->left = host_len;
+		if (len < host_len)
+			bot->data = NULL;
+	}
+
+	if (usbip_reply_out(conn, urb, urb->length) < 0)
+		return -1;
+	return URB_DONE;
+}
+
+int complete_storage(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb) {
+	struct bot *bot = &conn->bot;
+	unsigned int len;
+
+	if (!urb->in) {
+		if (bot->phase == BOT_CBW)
+			return bot_command(conn, urb);
+		if (bot->phase != BOT_DATA_OUT)
+			return URB_NOT_READY;
+		len = min_len(urb->length, bot->left);
+		if (bot->data != NULL) {
+			memcpy(bot->data, urb->buf, len);
+			bot->data += len;
+			bot->residue -= len;
+		}
+		bot->left -= len;
+		if (bot->left == 0)
+			bot->phase = BOT_CSW;
+		if (usbip_reply_out(conn, urb, len) < 0)
+			return -1;
+		return URB_DONE;
+	}
+
+	switch (bot->phase) {
+	case BOT_DATA_IN:
+		len = min_len(urb->length, bot->left);
+		if (usbip_reply_status(conn, urb->seqnum, 0, bot->data, len,
+					bot->stable) < 0)
+			return -1;
+		bot->data += len;
+		bot->left -= len;
+		bot->residue -= len;
+		if (bot->left == 0 || len < urb->length)
+			bot->phase = BOT_CSW;
+		return URB_DONE;
+	case BOT_CSW: {
+		struct bot_csw csw;
+		csw.dCSWSignature = __cpu_to_le32(BOT_CSW_SIGNATURE);
+		csw.dCSWTag = __cpu_to_le32(bot->tag);
+		csw.dCSWDataResidue = __cpu_to_le32(bot->residue);
+		csw.bCSWStatus = bot->status;
+		if (usbip_reply_status(conn, urb->seqnum, 0, &csw,
+					min_len(sizeof(csw), urb->length),
+					false) < 0)
+			return -1;
+		bot->phase = BOT_CBW;
+		return URB_DONE;
+	}
+	default:
+		return URB_NOT_READY;
+	}
+}
+
+const char *storage_open(struct device_model *model, const char *path) {
+	if (model->disk != NULL)
+		return "more than one storage file";
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		model->disk_read_only = true;
+	}
+	if (fd < 0) {
+		perror(path);
+		return "can't open the storage file";
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat()");
+		close(fd);
+		return "can't open the storage file";
+	}
+	size_t size = st.st_size / BOT_BLOCK_SIZE * BOT_BLOCK_SIZE;
+	if (size == 0) {
+		close(fd);
+		return "storage file smaller than a block";
+	}
+	int prot = PROT_READ | (model->disk_read_only ? 0 : PROT_WRITE);
+	char *disk = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (disk == MAP_FAILED) {
+		perror("mmap()");
+		return "can't map the storage file";
+	}
+	model->disk = disk;
+	model->disk_size = size;
+	return NULL;
+}
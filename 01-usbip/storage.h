@@ -0,0 +1,52 @@
+// A USB flash drive: SCSI commands over the Bulk-Only Transport, with
+// the model's storage file as the medium. The same handler serves both
+// bulk endpoints, each URB waits until the transport gets to the phase
+// it belongs to. READ(10) data is sent straight from the file mapping,
+// WRITE(10) data is copied into it. Copies of a model (-n) share the
+// file.
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+
+#include <linux/types.h>
+
+struct conn;
+struct device_model;
+struct ep_sched;
+struct urb;
+
+// Bulk-Only Transport state of a "storage" device, see complete_storage().
+enum bot_phase {
+	BOT_CBW,		// waiting for a command on the OUT endpoint
+	BOT_DATA_IN,
+	BOT_DATA_OUT,
+	BOT_CSW,		// status goes out on the IN endpoint
+};
+
+#define BOT_RESPONSE_SIZE 64
+
+// Class requests of the mass storage interface.
+#define USB_BOT_GET_MAX_LUN	0xfe
+#define USB_BOT_RESET		0xff
+
+struct bot {
+	enum bot_phase phase;
+	__u32 tag;
+	__u32 residue;		// what's left of dCBWDataTransferLength
+	__u8 status;
+	char *data;		// NULL while OUT data is being thrown away
+	unsigned int left;	// bytes the device still moves in this phase
+	bool stable;		// data points into the disk mapping
+	__u8 sense[3];		// key, ASC and ASCQ for REQUEST SENSE
+	char response[BOT_RESPONSE_SIZE];
+};
+
+int complete_storage(struct conn *conn, struct ep_sched *sched,
+			struct urb *urb);
+
+// Maps path as the medium of the model. Returns an error message or NULL.
+const char *storage_open(struct device_model *model, const char *path);
+
+#endif // STORAGE_H
@@ -0,0 +1,392 @@
+// io_uring transport of the USB/IP server, see uring.h.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+
+enum uring_op {
+	UR_OP_EPOLL = 1,
+	UR_OP_RECV = 2,
+	UR_OP_SEND = 3,
+};
+
+#define UR_OP_MASK 3UL
+#define UR_SQ_ENTRIES 256
+#define UR_CQ_ENTRIES 4096
+
+static int uring_enter(struct uring *ur, unsigned int wait) {
+	unsigned int to_submit = ur->sq_pending - *ur->sq_tail;
+	__atomic_store_n(ur->sq_tail, ur->sq_pending, __ATOMIC_RELEASE);
+	while (true) {
+		ur->enters++;
+		int rv = syscall(__NR_io_uring_enter, ur->fd, to_submit, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (rv >= 0 || errno != EINTR)
+			return rv;
+		// The SQEs were consumed if the interrupted call got that far.
+		to_submit = 0;
+	}
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ur) {
+	if (ur->sq_pending - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) ==
+			ur->sq_entries) {
+		if (uring_enter(ur, 0) < 0) {
+			perror("io_uring_enter()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	unsigned int index = ur->sq_pending & ur->sq_mask;
+	struct io_uring_sqe *sqe = &ur->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[index] = index;
+	ur->sq_pending++;
+	return sqe;
+}
+
+static char *uring_buf(struct uring *ur, unsigned short bid) {
+	return ur->buf_data + (size_t)bid * UR_BUF_SIZE;
+}
+
+// Gives a receive buffer back to the kernel. Only the first three fields
+// are written, the fourth one of bufs[0] is the ring tail.
+static void uring_provide(struct uring *ur, unsigned short bid) {
+	struct io_uring_buf *buf =
+		&ur->bufs->bufs[ur->buf_tail & (UR_NUM_BUFS - 1)];
+	buf->addr = (unsigned long)uring_buf(ur, bid);
+	buf->len = UR_BUF_SIZE;
+	buf->bid = bid;
+	ur->buf_tail++;
+	__atomic_store_n(&ur->bufs->tail, ur->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_init(struct uring *ur) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = UR_CQ_ENTRIES;
+	ur->fd = syscall(__NR_io_uring_setup, UR_SQ_ENTRIES, &params);
+	if (ur->fd < 0)
+		return -1;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_NODROP)) {
+		errno = EOPNOTSUPP;
+		goto err;
+	}
+
+	size_t sq_size = params.sq_off.array +
+			params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t size = sq_size > cq_size ? sq_size : cq_size;
+	char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+		goto err;
+	ur->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		goto err;
+
+	ur->sq_head = (unsigned int *)(rings + params.sq_off.head);
+	ur->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+	ur->sq_array = (unsigned int *)(rings + params.sq_off.array);
+	ur->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+	ur->sq_entries = params.sq_entries;
+	ur->sq_pending = *ur->sq_tail;
+	ur->cq_head = (unsigned int *)(rings + params.cq_off.head);
+	ur->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+	ur->cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	ur->bufs = mmap(NULL, UR_NUM_BUFS * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	ur->buf_data = malloc((size_t)UR_NUM_BUFS * UR_BUF_SIZE);
+	if (ur->bufs == MAP_FAILED || ur->buf_data == NULL)
+		goto err;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ur->bufs;
+	reg.ring_entries = UR_NUM_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, ur->fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto err;
+	for (int bid = 0; bid < UR_NUM_BUFS; bid++)
+		uring_provide(ur, bid);
+	return 0;
+
+err:
+	close(ur->fd);
+	ur->fd = -1;
+	return -1;
+}
+
+void uring_arm_recv(struct conn *conn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&conn->worker->uring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (unsigned long)conn | UR_OP_RECV;
+	conn->ur_recv_armed = true;
+	conn->ur_ops++;
+}
+
+static void uring_send(struct conn *conn) {
+	struct iovec iov[2];
+	int iovcnt = ring_iov(&conn->tx, true, &iov[0]);
+	for (int i = 0; i < iovcnt; i++) {
+		struct io_uring_sqe *sqe = uring_get_sqe(&conn->worker->uring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (unsigned long)iov[i].iov_base;
+		sqe->len = iov[i].iov_len;
+		// MSG_WAITALL makes a short send retry instead of breaking
+		// the link.
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		if (i + 1 < iovcnt)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (unsigned long)conn | UR_OP_SEND;
+		conn->ur_sends++;
+		conn->ur_ops++;
+	}
+}
+
+// Queues the connection for uring_flush_dirty() at the end of the batch.
+void uring_mark_dirty(struct conn *conn) {
+	if (conn->ur_dirty)
+		return;
+	conn->ur_dirty = true;
+	conn->ur_next_dirty = conn->worker->uring.dirty;
+	conn->worker->uring.dirty = conn;
+}
+
+void uring_conn_drop_stash(struct conn *conn) {
+	struct uring *ur = &conn->worker->uring;
+	for (; conn->ur_stash_head != conn->ur_stash_tail;
+			conn->ur_stash_head++) {
+		struct ur_stash_entry *entry = &conn->ur_stash[
+			conn->ur_stash_head & (UR_NUM_BUFS - 1)];
+		uring_provide(ur, entry->bid);
+	}
+	conn->ur_stash_off = 0;
+}
+
+// Moves received buffers into rx as far as it has room and handles the
+// frames. Buffers are returned to the kernel once fully copied; while
+// frames are held back by a full tx, they stay stashed and recv stops
+// once the worker runs out of buffers.
+int uring_conn_input(struct conn *conn) {
+	struct uring *ur = &conn->worker->uring;
+	if (conn->draining) {
+		uring_conn_drop_stash(conn);
+		return 0;
+	}
+
+	while (true) {
+		bool moved = false;
+		while (conn->ur_stash_head != conn->ur_stash_tail) {
+			struct ur_stash_entry *entry = &conn->ur_stash[
+				conn->ur_stash_head & (UR_NUM_BUFS - 1)];
+			unsigned int len = entry->len - conn->ur_stash_off;
+			if (len > ring_free(&conn->rx))
+				len = ring_free(&conn->rx);
+			if (len == 0)
+				break;
+			ring_put(&conn->rx,
+				uring_buf(ur, entry->bid) + conn->ur_stash_off,
+				len);
+			moved = true;
+			conn->ur_stash_off += len;
+			if (conn->ur_stash_off == entry->len) {
+				uring_provide(ur, entry->bid);
+				conn->ur_stash_head++;
+				conn->ur_stash_off = 0;
+			}
+		}
+
+		int rv = conn_handle_frames(conn);
+		if (rv != 0 || !moved)
+			return rv;
+	}
+}
+
+static void uring_arm_epoll(struct worker *worker) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&worker->uring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = worker->epoll_fd;
+	sqe->poll32_events = EPOLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = UR_OP_EPOLL;
+}
+
+// Kernels without multishot recv reject it with -EINVAL on the first
+// completion, before anything was sent, so the connection can still move
+// over to epoll.
+static void uring_fallback(struct conn *conn) {
+	fprintf(stderr, "multishot recv not supported, using epoll\n");
+	conn->uring = false;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = &conn->source;
+	if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		conn_close(conn);
+	}
+}
+
+static void uring_handle_recv(struct conn *conn, struct io_uring_cqe *cqe) {
+	struct uring *ur = &conn->worker->uring;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		conn->ur_recv_armed = false;
+		uring_mark_dirty(conn);
+	}
+
+	if (cqe->res > 0) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (conn->closed) {
+			uring_provide(ur, bid);
+			return;
+		}
+		struct ur_stash_entry *entry = &conn->ur_stash[
+			conn->ur_stash_tail++ & (UR_NUM_BUFS - 1)];
+		entry->bid = bid;
+		entry->len = cqe->res;
+		if (uring_conn_input(conn) != 0)
+			conn_close(conn);
+		return;
+	}
+
+	if (conn->closed)
+		return;
+	if (cqe->res == -ENOBUFS)	// rearmed by uring_flush_dirty()
+		return;
+	if (cqe->res == -EINVAL && conn->stats.urbs == 0 &&
+	    conn->state == CONN_STATE_OP) {
+		uring_fallback(conn);
+		return;
+	}
+	if (cqe->res < 0)
+		fprintf(stderr, "recv(): %s\n", strerror(-cqe->res));
+	conn_close(conn);
+}
+
+static void uring_handle_send(struct conn *conn, struct io_uring_cqe *cqe) {
+	conn->ur_sends--;
+	if (conn->closed)
+		return;
+	if (cqe->res > 0)
+		conn->tx.head += cqe->res;
+	else if (cqe->res != -ECANCELED) {
+		fprintf(stderr, "send(): %s\n", strerror(-cqe->res));
+		conn_close(conn);
+		return;
+	}
+	if (conn->ur_sends > 0)
+		return;
+
+	if (ring_used(&conn->tx) > 0)
+		uring_mark_dirty(conn);
+	else if (conn->draining) {
+		conn_close(conn);
+		return;
+	}
+	// Frames held back by a full tx can go now.
+	if (conn_resume(conn) != 0)
+		conn_close(conn);
+}
+
+static void uring_handle_cqe(struct worker *worker, struct io_uring_cqe *cqe) {
+	struct conn *conn = (struct conn *)(cqe->user_data & ~UR_OP_MASK);
+	switch (cqe->user_data & UR_OP_MASK) {
+	case UR_OP_EPOLL: {
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_epoll(worker);
+		// A full batch may leave more events behind without another
+		// wakeup of the epoll fd.
+		int n;
+		do {
+			struct epoll_event events[MAX_EVENTS];
+			n = epoll_wait(worker->epoll_fd, &events[0],
+					MAX_EVENTS, 0);
+			if (n < 0 && errno != EINTR) {
+				perror("epoll_wait()");
+				exit(EXIT_FAILURE);
+			}
+			if (n > 0)
+				worker_dispatch(worker, &events[0], n);
+		} while (n == MAX_EVENTS);
+		break;
+	}
+	case UR_OP_RECV:
+		conn->ur_ops--;
+		uring_handle_recv(conn, cqe);
+		break;
+	case UR_OP_SEND:
+		conn->ur_ops--;
+		uring_handle_send(conn, cqe);
+		break;
+	}
+}
+
+// Sends what the batch has queued and rearms recvs that have stopped.
+static void uring_flush_dirty(struct worker *worker) {
+	while (worker->uring.dirty != NULL) {
+		struct conn *conn = worker->uring.dirty;
+		worker->uring.dirty = conn->ur_next_dirty;
+		conn->ur_dirty = false;
+		if (conn->closed || !conn->uring)
+			continue;
+		if (conn->ur_sends == 0 && ring_used(&conn->tx) > 0)
+			uring_send(conn);
+		if (!conn->ur_recv_armed && !conn->draining &&
+		    conn->ur_stash_head == conn->ur_stash_tail)
+			uring_arm_recv(conn);
+	}
+}
+
+void worker_loop_uring(struct worker *worker) {
+	struct uring *ur = &worker->uring;
+	uring_arm_epoll(worker);
+
+	while (worker->server_fd >= 0 || worker->num_conns > 0) {
+		if (uring_enter(ur, 1) < 0) {
+			perror("io_uring_enter()");
+			exit(EXIT_FAILURE);
+		}
+
+		unsigned int head = *ur->cq_head;
+		unsigned int tail = __atomic_load_n(ur->cq_tail,
+						__ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe cqe = ur->cqes[head & ur->cq_mask];
+			__atomic_store_n(ur->cq_head, head + 1,
+					__ATOMIC_RELEASE);
+			ur->completions++;
+			uring_handle_cqe(worker, &cqe);
+		}
+		uring_flush_dirty(worker);
+		stream_check_done(worker);
+		free_closed_conns(worker);
+		capture_flush(worker);
+	}
+
+	printf("worker %d: %lu io_uring_enter() calls, %lu completions\n",
+		worker->id, ur->enters, ur->completions);
+}
@@ -0,0 +1,65 @@
+// io_uring transport (-u). Each worker gets an io_uring instance and a
+// ring of UR_NUM_BUFS provided receive buffers. Every connection has a
+// multishot recv armed that picks buffers from that ring, so data keeps
+// arriving without any SQE per read. Received buffers are copied into
+// conn->rx and the frames go through conn_handle_frames() exactly like
+// on the epoll path. Replies are collected in conn->tx for the whole
+// batch of completions and then sent with one IORING_OP_SEND, or two
+// linked ones when the data wraps around the ring. The epoll instance
+// with the listening socket, endpoint timers and the report stream is
+// itself polled through the ring, so one io_uring_enter() both submits
+// and waits for everything. Raw syscalls are used, as liburing is not
+// something this tool wants to depend on.
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+struct conn;
+struct worker;
+
+// Receive buffers handed to io_uring per worker, see uring_conn_input().
+#define UR_NUM_BUFS 256		// must be a power of two
+#define UR_BUF_SIZE 4096
+
+struct ur_stash_entry {
+	unsigned short bid;
+	unsigned short len;
+};
+
+struct uring {
+	int fd;			// -1 if the worker uses epoll only
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_pending;	// queued but not yet published tail
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *bufs;
+	char *buf_data;
+	unsigned short buf_tail;
+
+	struct conn *dirty;
+	unsigned long enters;
+	unsigned long completions;
+};
+
+// Returns -1 if this kernel can't do what the transport needs, the
+// worker then stays on epoll.
+int uring_init(struct uring *ur);
+
+void uring_arm_recv(struct conn *conn);
+void uring_mark_dirty(struct conn *conn);
+void uring_conn_drop_stash(struct conn *conn);
+int uring_conn_input(struct conn *conn);
+
+void worker_loop_uring(struct worker *worker);
+
+#endif // URING_H
@@ -0,0 +1,301 @@
+// USB/IP protocol definitions shared by keyboard.c and the tools next to it.
+//
+// Derived from:
+// - https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/usb/usbip/libsrc/usbip_common.h
+// - https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/drivers/usb/usbip/usbip_common.h
+
+#ifndef USBIP_H
+#define USBIP_H
+
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+#include <linux/types.h>
+
+#define USBIP_PORT 3240
+
+/*----------------------------------------------------------------------*/
+
+// tools/usb/usbip/libsrc/usbip_common.h
+
+#define SYSFS_PATH_MAX		256
+#define SYSFS_BUS_ID_SIZE	32
+
+#define ST_OK			0x00
+#define ST_NA			0x01
+#define ST_DEV_BUSY		0x02
+#define ST_DEV_ERR		0x03
+#define ST_NODEV		0x04
+#define ST_ERROR		0x05
+
+#define OP_REQUEST		(0x80 << 8)
+#define OP_REPLY		(0x00 << 8)
+
+#define OP_IMPORT		0x03
+#define OP_REQ_IMPORT		(OP_REQUEST | OP_IMPORT)
+#define OP_REP_IMPORT   	(OP_REPLY   | OP_IMPORT)
+
+#define OP_DEVLIST		0x05
+#define OP_REQ_DEVLIST		(OP_REQUEST | OP_DEVLIST)
+#define OP_REP_DEVLIST		(OP_REPLY   | OP_DEVLIST)
+
+#define USBIP_CMD_SUBMIT	0x0001
+#define USBIP_CMD_UNLINK	0x0002
+#define USBIP_RET_SUBMIT	0x0003
+#define USBIP_RET_UNLINK	0x0004
+
+#define USBIP_DIR_OUT		0x00
+#define USBIP_DIR_IN		0x01
+
+#define USBIP_MAX_ISO_PACKETS	1024
+
+struct usbip_usb_device {
+	char path[SYSFS_PATH_MAX];
+	char busid[SYSFS_BUS_ID_SIZE];
+
+	uint32_t busnum;
+	uint32_t devnum;
+	uint32_t speed;
+
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bConfigurationValue;
+	uint8_t bNumConfigurations;
+	uint8_t bNumInterfaces;
+} __attribute__((packed));
+
+struct usbip_usb_interface {
+        uint8_t bInterfaceClass;
+        uint8_t bInterfaceSubClass;
+        uint8_t bInterfaceProtocol;
+        uint8_t padding;
+} __attribute__((packed));
+
+struct usbip_op_common {
+	uint16_t version;
+	uint16_t code;
+	uint32_t status;
+} __attribute__((packed));
+
+struct usbip_op_import_request {
+	char busid[SYSFS_BUS_ID_SIZE];
+} __attribute__((packed));
+
+struct usbip_op_import_reply {
+	struct usbip_usb_device udev;
+	// struct usbip_usb_interface uinf[];
+} __attribute__((packed));
+
+struct usbip_op_devlist_reply {
+	uint32_t ndev;
+	// followed by ndev times:
+	// struct usbip_usb_device udev;
+	// struct usbip_usb_interface uinf[udev.bNumInterfaces];
+} __attribute__((packed));
+
+struct usbip_op {
+	struct usbip_op_common common;
+
+	union {
+		struct usbip_op_import_request	import_request;
+		struct usbip_op_import_reply	import_reply;
+		struct usbip_op_devlist_reply	devlist_reply;
+	} u;
+};
+
+#define USBIP_OP_IMPORT_REPLY_SIZE \
+	(sizeof(struct usbip_op_common) + sizeof(struct usbip_op_import_reply))
+
+// drivers/usb/usbip/usbip_common.h
+
+struct usbip_header_basic {
+	__u32 command;
+	__u32 seqnum;
+	__u32 devid;
+	__u32 direction;
+	__u32 ep;
+} __attribute__((packed));
+
+struct usbip_header_cmd_submit {
+	__u32 transfer_flags;
+	__s32 transfer_buffer_length;
+	__s32 start_frame;
+	__s32 number_of_packets;
+	__s32 interval;
+	unsigned char setup[8];
+} __attribute__((packed));
+
+struct usbip_header_ret_submit {
+	__s32 status;
+	__s32 actual_length;
+	__s32 start_frame;
+	__s32 number_of_packets;
+	__s32 error_count;
+} __attribute__((packed));
+
+struct usbip_header_cmd_unlink {
+	__u32 seqnum;
+} __attribute__((packed));
+
+struct usbip_header_ret_unlink {
+	__s32 status;
+} __attribute__((packed));
+
+// Isochronous URBs carry one of these per packet after the transfer
+// buffer, in both directions.
+struct usbip_iso_packet_descriptor {
+	__u32 offset;
+	__u32 length;
+	__u32 actual_length;
+	__u32 status;
+} __attribute__((packed));
+
+struct usbip_header {
+	struct usbip_header_basic base;
+
+	union {
+		struct usbip_header_cmd_submit	cmd_submit;
+		struct usbip_header_ret_submit	ret_submit;
+		struct usbip_header_cmd_unlink	cmd_unlink;
+		struct usbip_header_ret_unlink	ret_unlink;
+	} u;
+} __attribute__((packed));
+
+/*----------------------------------------------------------------------*/
+
+static inline void unpack_usbip_op_common(struct usbip_op_common *s) {
+	s->version = ntohs(s->version);
+	s->code = ntohs(s->code);
+	s->status = ntohl(s->status);
+}
+
+static inline void pack_usbip_op_common(struct usbip_op_common *s) {
+	s->version = htons(s->version);
+	s->code = htons(s->code);
+	s->status = htonl(s->status);
+}
+
+static inline void pack_usbip_usb_device(struct usbip_usb_device *s) {
+	s->busnum = htonl(s->busnum);
+	s->devnum = htonl(s->devnum);
+	s->speed = htonl(s->speed);
+	s->idVendor = htons(s->idVendor);
+	s->idProduct = htons(s->idProduct);
+	s->bcdDevice = htons(s->bcdDevice);
+}
+
+static inline void pack_usbip_op_import_reply(struct usbip_op_import_reply *s) {
+	pack_usbip_usb_device(&s->udev);
+}
+
+static inline void pack_usbip_op_devlist_reply(
+		struct usbip_op_devlist_reply *s) {
+	s->ndev = htonl(s->ndev);
+}
+
+static inline void unpack_usbip_header_basic(struct usbip_header_basic *s) {
+	s->command = ntohl(s->command);
+	s->seqnum = ntohl(s->seqnum);
+	s->devid = ntohl(s->devid);
+	s->direction = ntohl(s->direction);
+	s->ep = ntohl(s->ep);
+}
+
+static inline void unpack_usbip_header_cmd_submit(
+		struct usbip_header_cmd_submit *s) {
+	s->transfer_flags = ntohl(s->transfer_flags);
+	s->transfer_buffer_length = ntohl(s->transfer_buffer_length);
+	s->start_frame = ntohl(s->start_frame);
+	s->number_of_packets = ntohl(s->number_of_packets);
+	s->interval = ntohl(s->interval);
+}
+
+static inline void pack_usbip_header_basic(struct usbip_header_basic *s) {
+	s->command = htonl(s->command);
+	s->seqnum = htonl(s->seqnum);
+	s->devid = htonl(s->devid);
+	s->direction = htonl(s->direction);
+	s->ep = htonl(s->ep);
+}
+
+static inline void pack_usbip_header_ret_submit(
+		struct usbip_header_ret_submit *s) {
+	s->status = htonl(s->status);
+	s->actual_length = htonl(s->actual_length);
+	s->start_frame = htonl(s->start_frame);
+	s->number_of_packets = htonl(s->number_of_packets);
+	s->error_count = htonl(s->error_count);
+}
+
+static inline void unpack_usbip_iso_packet_descriptor(
+		struct usbip_iso_packet_descriptor *s) {
+	s->offset = ntohl(s->offset);
+	s->length = ntohl(s->length);
+	s->actual_length = ntohl(s->actual_length);
+	s->status = ntohl(s->status);
+}
+
+static inline void pack_usbip_iso_packet_descriptor(
+		struct usbip_iso_packet_descriptor *s) {
+	s->offset = htonl(s->offset);
+	s->length = htonl(s->length);
+	s->actual_length = htonl(s->actual_length);
+	s->status = htonl(s->status);
+}
+
+static inline void unpack_usbip_header_cmd_unlink(
+		struct usbip_header_cmd_unlink *s) {
+	s->seqnum = ntohl(s->seqnum);
+}
+
+static inline void pack_usbip_header_ret_unlink(
+		struct usbip_header_ret_unlink *s) {
+	s->status = htonl(s->status);
+}
+
+// The other direction, for tools that act as the USB/IP client.
+
+static inline void unpack_usbip_usb_device(struct usbip_usb_device *s) {
+	s->busnum = ntohl(s->busnum);
+	s->devnum = ntohl(s->devnum);
+	s->speed = ntohl(s->speed);
+	s->idVendor = ntohs(s->idVendor);
+	s->idProduct = ntohs(s->idProduct);
+	s->bcdDevice = ntohs(s->bcdDevice);
+}
+
+static inline void pack_usbip_header_cmd_submit(
+		struct usbip_header_cmd_submit *s) {
+	s->transfer_flags = htonl(s->transfer_flags);
+	s->transfer_buffer_length = htonl(s->transfer_buffer_length);
+	s->start_frame = htonl(s->start_frame);
+	s->number_of_packets = htonl(s->number_of_packets);
+	s->interval = htonl(s->interval);
+}
+
+static inline void unpack_usbip_header_ret_submit(
+		struct usbip_header_ret_submit *s) {
+	s->status = ntohl(s->status);
+	s->actual_length = ntohl(s->actual_length);
+	s->start_frame = ntohl(s->start_frame);
+	s->number_of_packets = ntohl(s->number_of_packets);
+	s->error_count = ntohl(s->error_count);
+}
+
+static inline void pack_usbip_header_cmd_unlink(
+		struct usbip_header_cmd_unlink *s) {
+	s->seqnum = htonl(s->seqnum);
+}
+
+static inline void unpack_usbip_header_ret_unlink(
+		struct usbip_header_ret_unlink *s) {
+	s->status = ntohl(s->status);
+}
+
+#endif // USBIP_H
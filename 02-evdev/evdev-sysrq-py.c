@@ -0,0 +1,273 @@
+// Python module with the device index and event batching of
+// evdev-sysrq (see evdev.h), which evdev-sysrq.py uses when it's built:
+//
+//   gcc -shared -fPIC -fvisibility=hidden -O2 -DTRACE_DISABLED -pthread
+//     $(python3-config --includes) evdev-sysrq-py.c evdev.c
+//     -o evdev_sysrq$(python3-config --extension-suffix)
+//
+//   import evdev_sysrq
+//   evdev_sysrq.scan()
+//   for n in evdev_sysrq.match([EV_KEY, EV_SYN], [KEY_SYSRQ]): ...
+//   fd = evdev_sysrq.find_device()
+//   evdev_sysrq.write_events(fd, struct.pack('<' + 'HHi' * 2, ...))
+//
+// Capabilities are Python ints with a bit per event type or key, so a
+// check is (caps >> code) & 1 instead of a dict per device. Events are
+// passed as packed struct inject_event (see inject.h) and written with
+// one write() per call.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "evdev.h"
+
+bool scanned;
+struct injector module_injector = { .fd = -1, .event = -1 };
+
+PyObject *raise_errno(int error, const char *what) {
+	errno = error;
+	return PyErr_SetFromErrnoWithFilename(PyExc_OSError, what);
+}
+
+// The GIL is kept during the scan, other calls read the index it fills.
+PyObject *py_scan(PyObject *self, PyObject *args) {
+	const char *cache_path = NULL;
+	if (!PyArg_ParseTuple(args, "|z", &cache_path))
+		return NULL;
+
+	int count = index_scan(&device_index, cache_path);
+	if (count < 0)
+		return raise_errno(errno, SYSFS_INPUT);
+	scanned = true;
+	return PyLong_FromLong(count);
+}
+
+PyObject *py_devices(PyObject *self, PyObject *args) {
+	PyObject *list = PyList_New(0);
+	if (list == NULL)
+		return NULL;
+	for (unsigned int n = 0; n < MAX_INPUT_DEVICES; n++) {
+		if (!device_index.devices[n].present)
+			continue;
+		PyObject *item = PyLong_FromUnsignedLong(n);
+		if (item == NULL || PyList_Append(list, item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+	return list;
+}
+
+struct input_device *lookup_device(unsigned int n) {
+	if (n >= MAX_INPUT_DEVICES || !device_index.devices[n].present) {
+		PyErr_Format(PyExc_KeyError, "no device event%u", n);
+		return NULL;
+	}
+	return &device_index.devices[n];
+}
+
+PyObject *bitmap_to_int(const unsigned long *bits, unsigned int nbits) {
+	return PyObject_CallMethod((PyObject *)&PyLong_Type, "from_bytes",
+			"y#s", (const char *)bits,
+			(Py_ssize_t)(BITS_TO_LONGS(nbits) * sizeof(long)),
+			"little");
+}
+
+PyObject *py_info(PyObject *self, PyObject *args) {
+	unsigned int n;
+	if (!PyArg_ParseTuple(args, "I", &n))
+		return NULL;
+	struct input_device *dev = lookup_device(n);
+	if (dev == NULL)
+		return NULL;
+	return Py_BuildValue("{s:s,s:s,s:s,s:H,s:H,s:H,s:H}",
+		"input", dev->input, "name", dev->name, "phys", dev->phys,
+		"bustype", dev->bustype, "vendor", dev->vendor,
+		"product", dev->product, "version", dev->version);
+}
+
+// Returns (ev, key) bitmaps.
+PyObject *py_capabilities(PyObject *self, PyObject *args) {
+	unsigned int n;
+	if (!PyArg_ParseTuple(args, "I", &n))
+		return NULL;
+	struct input_device *dev = lookup_device(n);
+	if (dev == NULL)
+		return NULL;
+	PyObject *ev = bitmap_to_int(dev->ev, EV_CNT);
+	PyObject *key = bitmap_to_int(dev->key, KEY_CNT);
+	PyObject *result = NULL;
+	if (ev != NULL && key != NULL)
+		result = PyTuple_Pack(2, ev, key);
+	Py_XDECREF(ev);
+	Py_XDECREF(key);
+	return result;
+}
+
+// Reads a sequence of codes below limit into codes.
+int parse_codes(PyObject *seq, unsigned int *codes, int size,
+			unsigned int limit) {
+	PyObject *fast = PySequence_Fast(seq, "expected a sequence of codes");
+	if (fast == NULL)
+		return -1;
+	Py_ssize_t len = PySequence_Fast_GET_SIZE(fast);
+	if (len > size) {
+		PyErr_SetString(PyExc_ValueError, "too many codes");
+		Py_DECREF(fast);
+		return -1;
+	}
+	for (Py_ssize_t i = 0; i < len; i++) {
+		unsigned long code = PyLong_AsUnsignedLong(
+					PySequence_Fast_GET_ITEM(fast, i));
+		if (PyErr_Occurred() || code >= limit) {
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_ValueError,
+					"code out of range");
+			Py_DECREF(fast);
+			return -1;
+		}
+		codes[i] = code;
+	}
+	Py_DECREF(fast);
+	return len;
+}
+
+// match(ev_types, keys) returns the N of every eventN supporting all of
+// them, straight from the index bitmaps.
+PyObject *py_match(PyObject *self, PyObject *args) {
+	PyObject *ev_seq, *key_seq = NULL;
+	if (!PyArg_ParseTuple(args, "O|O", &ev_seq, &key_seq))
+		return NULL;
+	unsigned int evs[EV_CNT], keys[64];
+	int num_evs = parse_codes(ev_seq, &evs[0], EV_CNT, EV_CNT);
+	if (num_evs < 0)
+		return NULL;
+	int num_keys = 0;
+	if (key_seq != NULL)
+		num_keys = parse_codes(key_seq, &keys[0], 64, KEY_CNT);
+	if (num_keys < 0)
+		return NULL;
+
+	unsigned long match[DEVICE_LONGS];
+	index_match(&device_index, &evs[0], num_evs, &keys[0], num_keys,
+			&match[0]);
+	PyObject *list = PyList_New(0);
+	for (unsigned int n = 0; list != NULL && n < MAX_INPUT_DEVICES; n++) {
+		if (!test_bit(&match[0], n))
+			continue;
+		PyObject *item = PyLong_FromUnsignedLong(n);
+		if (item == NULL || PyList_Append(list, item) < 0) {
+			Py_XDECREF(item);
+			Py_CLEAR(list);
+		}
+		Py_XDECREF(item);
+	}
+	return list;
+}
+
+// Returns an fd for the best device that supports sysrq injection, the
+// same one across calls while it stays plugged in.
+PyObject *py_find_device(PyObject *self, PyObject *args) {
+	if (!scanned) {
+		PyObject *none = PyTuple_New(0);
+		PyObject *rv = none ? py_scan(self, none) : NULL;
+		Py_XDECREF(none);
+		if (rv == NULL)
+			return NULL;
+		Py_DECREF(rv);
+	}
+	int fd = injector_get(&module_injector, &device_index);
+	if (fd < 0)
+		return raise_errno(ENODEV, "no input devices support sysrq "
+					"injection");
+	return PyLong_FromLong(fd);
+}
+
+// write_events(fd, buffer) writes packed struct inject_event from any
+// bytes-like object, returns the number of events written including the
+// SYN_REPORTs that were added.
+PyObject *py_write_events(PyObject *self, PyObject *args) {
+	static __thread struct event_batch batch;
+	int fd;
+	Py_buffer buf;
+	if (!PyArg_ParseTuple(args, "iy*", &fd, &buf))
+		return NULL;
+	if (buf.len % sizeof(struct inject_event) != 0) {
+		PyBuffer_Release(&buf);
+		PyErr_SetString(PyExc_ValueError,
+			"buffer is not a whole number of events");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	batch_init(&batch, fd);
+	batch_inject(&batch, buf.buf, buf.len / sizeof(struct inject_event));
+	batch_flush(&batch);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+
+	if (batch.error != 0)
+		return raise_errno(batch.error, "write");
+	return PyLong_FromUnsignedLong(batch.written);
+}
+
+// sysrq(fd, key) presses and releases Alt+SysRq+key.
+PyObject *py_sysrq(PyObject *self, PyObject *args) {
+	static __thread struct event_batch batch;
+	int fd;
+	unsigned int key = KEY_X;
+	if (!PyArg_ParseTuple(args, "i|I", &fd, &key))
+		return NULL;
+	if (key >= KEY_CNT) {
+		PyErr_SetString(PyExc_ValueError, "key out of range");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	batch_init(&batch, fd);
+	batch_sysrq(&batch, key);
+	batch_flush(&batch);
+	Py_END_ALLOW_THREADS
+
+	if (batch.error != 0)
+		return raise_errno(batch.error, "write");
+	Py_RETURN_NONE;
+}
+
+PyMethodDef module_methods[] = {
+	{ "scan", py_scan, METH_VARARGS,
+		"scan([cache_file]): index input devices from sysfs" },
+	{ "devices", py_devices, METH_NOARGS,
+		"devices(): N of every indexed eventN" },
+	{ "info", py_info, METH_VARARGS,
+		"info(n): identity of eventN" },
+	{ "capabilities", py_capabilities, METH_VARARGS,
+		"capabilities(n): (ev, key) bitmaps of eventN as ints" },
+	{ "match", py_match, METH_VARARGS,
+		"match(ev_types[, keys]): devices supporting all of them" },
+	{ "find_device", py_find_device, METH_NOARGS,
+		"find_device(): fd of a device that supports sysrq injection" },
+	{ "write_events", py_write_events, METH_VARARGS,
+		"write_events(fd, buffer): write packed (type, code, value) "
+		"events" },
+	{ "sysrq", py_sysrq, METH_VARARGS,
+		"sysrq(fd[, key]): press and release Alt+SysRq+key" },
+	{ NULL, NULL, 0, NULL },
+};
+
+struct PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "evdev_sysrq",
+	.m_doc = "evdev-sysrq device index and event injection",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_evdev_sysrq(void) {
+	return PyModule_Create(&module_def);
+}
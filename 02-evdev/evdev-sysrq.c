@@ -8,117 +8,624 @@
 //
 // Andrey Konovalov <andreyknvl@gmail.com>
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
-#include <dirent.h>
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include <linux/input.h>
+#include <linux/netlink.h>
 
-bool supports_feature(int fd, unsigned int feature) {
-	unsigned long evbit = 0;
-	int rv = ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), &evbit);
-	if (rv != sizeof(evbit)) {
-		perror("ioctl(EVIOCGBIT)");
+#include "evdev.h"
+#include "inject.h"
+#include "../trace/trace.h"
+
+// index_scan() for the command line, where there is nothing to do
+// without sysfs.
+int scan_devices(struct device_index *index, const char *cache_path) {
+	int count = index_scan(index, cache_path);
+	if (count < 0) {
+		perror("opendir(" SYSFS_INPUT ")");
 		exit(EXIT_FAILURE);
 	}
-	return evbit & (1 << feature);
+	return count;
 }
 
-bool supports_key(int fd, unsigned int key) {
-	size_t nchar = KEY_MAX / 8 + 1;
-	unsigned char bits[nchar];
-	int rv = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), &bits);
-	if (rv != sizeof(bits)) {
-		perror("ioctl(EVIOCGBIT)");
+// The index is kept up to date by a device monitor instead of being
+// rescanned. Kernel uevents for eventN nodes come in over netlink, an
+// add reads that one node from sysfs and a remove clears its slot. Where
+// the uevent socket isn't available (e.g. in a network namespace without
+// uevent forwarding), /dev/input is watched with inotify instead.
+//
+// The monitor has to be opened before the scan, otherwise a device
+// that shows up during the scan could be missed.
+
+#define MONITOR_BUFFER_SIZE 8192
+
+struct device_monitor {
+	int fd;
+	bool netlink;
+};
+
+void monitor_open(struct device_monitor *monitor) {
+	monitor->netlink = true;
+	monitor->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK |
+				SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (monitor->fd >= 0) {
+		struct sockaddr_nl addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1;	// kernel uevents, not the udev ones
+		if (bind(monitor->fd, (struct sockaddr *)&addr,
+				sizeof(addr)) == 0)
+			return;
+		close(monitor->fd);
+	}
+
+	monitor->netlink = false;
+	monitor->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (monitor->fd < 0) {
+		perror("inotify_init1()");
+		exit(EXIT_FAILURE);
+	}
+	if (inotify_add_watch(monitor->fd, "/dev/input",
+			IN_CREATE | IN_DELETE | IN_MOVED_TO |
+			IN_MOVED_FROM) < 0) {
+		perror("inotify_add_watch(/dev/input)");
 		exit(EXIT_FAILURE);
 	}
-	return bits[key / 8] & (1 << (key % 8));
 }
 
-bool check_device(int fd) {
-	if (!supports_feature(fd, EV_KEY))
-		return false;
-	printf("EV_KEY supported\n");
-	if (!supports_key(fd, KEY_SYSRQ))
-		return false;
-	printf("KEY_SYSRQ supported\n");
-	if (!supports_feature(fd, EV_SYN))
-		return false;
-	printf("EV_SYN supported\n");
-	return true;
+// Parses N out of "eventN", returns -1 for other names.
+int parse_event_name(const char *name) {
+	if (strncmp(name, "event", strlen("event")) != 0)
+		return -1;
+	char *end;
+	unsigned long n = strtoul(name + strlen("event"), &end, 10);
+	if (end == name + strlen("event") || *end != 0 ||
+	    n >= MAX_INPUT_DEVICES)
+		return -1;
+	return n;
+}
+
+void index_update(struct device_index *index, int n, bool add) {
+	if (n < 0)
+		return;
+	if (index->devices[n].present)
+		index_remove(index, n);
+	if (add && read_device(n, &index->devices[n]) == 0)
+		index_add(index, n);
 }
 
-int is_event_device(const struct dirent *dir) {
-	return strncmp("event", dir->d_name, strlen("event")) == 0;
+// A uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings, each ending
+// with a zero byte.
+void monitor_uevent(struct device_index *index, char *buf, size_t len) {
+	const char *action = NULL, *subsystem = NULL, *devname = NULL;
+	for (size_t off = strlen(buf) + 1; off < len;
+			off += strlen(buf + off) + 1) {
+		const char *var = buf + off;
+		if (strncmp(var, "ACTION=", 7) == 0)
+			action = var + 7;
+		else if (strncmp(var, "SUBSYSTEM=", 10) == 0)
+			subsystem = var + 10;
+		else if (strncmp(var, "DEVNAME=", 8) == 0)
+			devname = var + 8;
+	}
+	if (action == NULL || subsystem == NULL || devname == NULL ||
+	    strcmp(subsystem, "input") != 0 ||
+	    strncmp(devname, "input/", strlen("input/")) != 0)
+		return;
+
+	int n = parse_event_name(devname + strlen("input/"));
+	if (strcmp(action, "add") == 0 || strcmp(action, "change") == 0)
+		index_update(index, n, true);
+	else if (strcmp(action, "remove") == 0)
+		index_update(index, n, false);
 }
 
-int find_device(void) {
-	struct dirent **names;
-	int n = scandir("/dev/input", &names, is_event_device, alphasort);
-	if (n <= 0) {
+// Applies all pending add and remove events to the index.
+void monitor_read(struct device_monitor *monitor,
+			struct device_index *index) {
+	char buf[MONITOR_BUFFER_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	while (true) {
+		ssize_t len = read(monitor->fd, &buf[0], sizeof(buf) - 1);
+		if (len < 0 && errno == EINTR)
+			continue;
+		// A full socket buffer drops uevents, so start over.
+		if (len < 0 && errno == ENOBUFS) {
+			scan_devices(index, NULL);
+			continue;
+		}
+		if (len < 0 && errno == EAGAIN)
+			return;
+		if (len <= 0) {
+			perror("read(monitor)");
+			exit(EXIT_FAILURE);
+		}
+
+		if (monitor->netlink) {
+			buf[len] = 0;
+			monitor_uevent(index, &buf[0], len);
+			continue;
+		}
+
+		for (char *ptr = &buf[0]; ptr < &buf[len]; ) {
+			struct inotify_event *event =
+				(struct inotify_event *)ptr;
+			ptr += sizeof(*event) + event->len;
+			if (event->len == 0)
+				continue;
+			index_update(index, parse_event_name(event->name),
+				event->mask & (IN_CREATE | IN_MOVED_TO));
+		}
+	}
+}
+
+void monitor_wait(struct device_monitor *monitor,
+			struct device_index *index) {
+	struct pollfd pfd = { .fd = monitor->fd, .events = POLLIN };
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		perror("poll()");
+		exit(EXIT_FAILURE);
+	}
+	monitor_read(monitor, index);
+}
+
+/*----------------------------------------------------------------------*/
+
+// With wait set, blocks until a device that supports sysrq injection is
+// plugged in instead of failing.
+int find_device(const char *cache_path, bool wait) {
+	struct device_index *index = &device_index;
+	struct device_monitor monitor;
+	if (wait)
+		monitor_open(&monitor);
+
+	if (scan_devices(index, cache_path) == 0 && !wait) {
 		fprintf(stderr, "no input devices found\n");
 		exit(EXIT_FAILURE);
 	}
 
-	for (int i = 0; i < n; i++) {
-		char name[512];
-		snprintf(&name[0], sizeof(name), "%s/%s", "/dev/input",
-				names[i]->d_name);
-		free(names[i]);
+	struct injector injector = { .fd = -1, .event = -1 };
+	int fd = injector_get(&injector, index);
+	if (fd < 0 && !wait) {
+		fprintf(stderr, "no input devices support sysrq injection\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fd < 0)
+		printf("waiting for a device that supports sysrq injection\n");
+	while (fd < 0) {
+		monitor_wait(&monitor, index);
+		fd = injector_get(&injector, index);
+	}
 
-		int fd = open(name, O_RDWR);
-		if (fd < 0) {
-			perror("open()");
+	if (wait)
+		close(monitor.fd);
+	return fd;
+}
+
+
+void disable_lockdown(int fd) {
+	struct event_batch batch;
+
+	printf("sending Alt+SysRq+X sequence\n");
+
+	batch_init(&batch, fd);
+	batch_sysrq(&batch, KEY_X);
+	batch_flush(&batch);
+	if (batch.error != 0) {
+		errno = batch.error;
+		perror("write()");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("done\n");
+}
+
+// Replays a recording of struct input_event, e.g. taken with
+// cat /dev/input/eventN > file, as fast as the device takes it. The
+// recorded SYN_REPORTs frame the events, a trailing frame without one
+// gets it added. Timestamps are ignored.
+void replay(int fd, const char *path, unsigned long repeat) {
+	static struct event_batch batch;
+	batch_init(&batch, fd);
+
+	int file = open(path, O_RDONLY);
+	if (file < 0) {
+		perror("open()");
+		exit(EXIT_FAILURE);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < repeat; i++) {
+		if (lseek(file, 0, SEEK_SET) < 0) {
+			perror("lseek()");
 			exit(EXIT_FAILURE);
 		}
-		printf("checking %s\n", &name[0]);
-		if (check_device(fd)) {
-			printf("found device %s\n", &name[0]);
-			return fd;
+		while (true) {
+			struct input_event events[MAX_BATCH_EVENTS];
+			ssize_t rv = read(file, &events[0], sizeof(events));
+			if (rv < 0) {
+				perror("read()");
+				exit(EXIT_FAILURE);
+			}
+			if (rv == 0)
+				break;
+			if (rv % sizeof(events[0]) != 0) {
+				fprintf(stderr, "truncated recording\n");
+				exit(EXIT_FAILURE);
+			}
+			for (int j = 0; j < rv / sizeof(events[0]); j++) {
+				if (events[j].type == EV_SYN &&
+				    events[j].code == SYN_REPORT)
+					batch_sync(&batch);
+				else
+					batch_event(&batch, events[j].type,
+						events[j].code,
+						events[j].value);
+			}
 		}
-		close(fd);
+		batch_sync(&batch);
+	}
+	batch_flush(&batch);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(file);
+	if (batch.error != 0) {
+		errno = batch.error;
+		perror("write()");
+		exit(EXIT_FAILURE);
 	}
 
-	fprintf(stderr, "no input devices support sysrq injection\n");
-	exit(EXIT_FAILURE);
+	double secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("replayed %lu events with %lu writes in %.3f s (%.0f events/s)\n",
+		batch.written, batch.writes, secs,
+		secs > 0 ? batch.written / secs : 0.0);
 }
 
-void write_event(int fd, unsigned int type, unsigned int code,
-				unsigned int value) {
-	struct input_event event;
-	memset(&event, 0, sizeof(event));
-	event.type = type;
-	event.code = code;
-	event.value = value;
-	int rv = write(fd, &event, sizeof(event));
-	if (rv != sizeof(event)) {
+// With -l the program stays running as an injection daemon, see inject.h
+// for the protocol. The index and the device fd are kept across requests
+// and the monitor tracks hotplug, so a request costs a read(), a write()
+// to the device and a write() of the replies.
+
+#define MAX_CLIENTS 64
+#define MAX_CLIENT_REPLIES 256
+#define CLIENT_BUFFER_SIZE (sizeof(struct inject_request) + \
+			INJECT_MAX_EVENTS * sizeof(struct inject_event))
+#define DAEMON_MAX_EVENTS 64
+
+struct daemon_client {
+	int fd;
+	bool broken;
+	size_t len;
+	unsigned int num_replies;
+	struct inject_reply replies[MAX_CLIENT_REPLIES];
+	char buf[CLIENT_BUFFER_SIZE];
+};
+
+struct daemon {
+	int epoll_fd;
+	int listen_fd;
+	struct device_monitor monitor;
+	struct device_index *index;
+	struct injector injector;
+	struct event_batch batch;
+	struct daemon_client *clients[MAX_CLIENTS];
+};
+
+// Clients are only closed at the end of a round, the events of the
+// round may still point to them.
+void daemon_close_broken(struct daemon *daemon) {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		struct daemon_client *client = daemon->clients[i];
+		if (client == NULL || !client->broken)
+			continue;
+		close(client->fd);
+		free(client);
+		daemon->clients[i] = NULL;
+	}
+}
+
+// Writes out the batch, then sends every client its replies. If the
+// write failed, all requests in the batch get the error.
+void daemon_flush(struct daemon *daemon) {
+	batch_flush(&daemon->batch);
+	int error = daemon->batch.error;
+	daemon->batch.error = 0;
+	if (error != 0) {
+		errno = error;
 		perror("write()");
+		injector_close(&daemon->injector);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		struct daemon_client *client = daemon->clients[i];
+		if (client == NULL || client->broken ||
+		    client->num_replies == 0)
+			continue;
+		size_t size = client->num_replies * sizeof(client->replies[0]);
+		for (unsigned int j = 0; j < client->num_replies; j++) {
+			if (error != 0 && client->replies[j].status == 0)
+				client->replies[j].status = -error;
+		}
+		client->num_replies = 0;
+		// Replies are small, a client that lets them pile up in the
+		// socket buffer isn't reading them at all.
+		if (send(client->fd, &client->replies[0], size,
+				MSG_NOSIGNAL | MSG_DONTWAIT) != size)
+			client->broken = true;
+	}
+}
+
+// Queues the events of one request and its reply.
+void daemon_request(struct daemon *daemon, struct daemon_client *client,
+			struct inject_request *request) {
+	struct event_batch *batch = &daemon->batch;
+	if (client->num_replies == MAX_CLIENT_REPLIES)
+		daemon_flush(daemon);
+
+	struct inject_reply *reply = &client->replies[client->num_replies++];
+	reply->seqnum = request->seqnum;
+	reply->status = 0;
+	reply->count = 0;
+	reply->event = daemon->injector.event;
+	if (daemon->injector.fd < 0) {
+		reply->status = -ENODEV;
+		return;
+	}
+
+	unsigned long queued = batch->written + batch->count;
+	if (request->op == INJECT_OP_SYSRQ) {
+		if (request->count >= KEY_CNT) {
+			reply->status = -EINVAL;
+			return;
+		}
+		batch_sysrq(batch, request->count);
+	} else {
+		batch_inject(batch, (struct inject_event *)(request + 1),
+				request->count);
+	}
+	reply->count = batch->written + batch->count - queued;
+}
+
+// Reads and queues all complete requests. Returns -1 when the client is
+// gone or broke the protocol.
+int daemon_read(struct daemon *daemon, struct daemon_client *client) {
+	ssize_t rv = read(client->fd, &client->buf[client->len],
+				sizeof(client->buf) - client->len);
+	if (rv < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (rv <= 0)
+		return -1;
+	client->len += rv;
+
+	size_t off = 0;
+	while (client->len - off >= sizeof(struct inject_request)) {
+		struct inject_request *request =
+			(struct inject_request *)&client->buf[off];
+		if (request->magic != INJECT_MAGIC)
+			return -1;
+		size_t size = sizeof(*request);
+		if (request->op == INJECT_OP_EVENTS) {
+			if (request->count > INJECT_MAX_EVENTS)
+				return -1;
+			size += request->count * sizeof(struct inject_event);
+		} else if (request->op != INJECT_OP_SYSRQ) {
+			return -1;
+		}
+		if (client->len - off < size)
+			break;
+		daemon_request(daemon, client, request);
+		off += size;
+	}
+	memmove(&client->buf[0], &client->buf[off], client->len - off);
+	client->len -= off;
+	return 0;
+}
+
+void daemon_epoll_add(struct daemon *daemon, int fd, void *ptr) {
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = ptr };
+	if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		perror("epoll_ctl()");
 		exit(EXIT_FAILURE);
 	}
 }
 
-void disable_lockdown(int fd) {
-	printf("sending Alt+SysRq+X sequence\n");
+void daemon_accept(struct daemon *daemon) {
+	while (true) {
+		int fd = accept4(daemon->listen_fd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0 && errno == EINTR)
+			continue;
+		if (fd < 0 && errno == EAGAIN)
+			return;
+		if (fd < 0) {
+			perror("accept4()");
+			return;
+		}
+
+		int i;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (daemon->clients[i] == NULL)
+				break;
+		}
+		struct daemon_client *client = NULL;
+		if (i < MAX_CLIENTS)
+			client = malloc(sizeof(*client));
+		if (client == NULL) {
+			fprintf(stderr, "dropping client, too many\n");
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->broken = false;
+		client->len = 0;
+		client->num_replies = 0;
+		daemon->clients[i] = client;
+		daemon_epoll_add(daemon, fd, client);
+	}
+}
 
-	write_event(fd, EV_KEY, KEY_LEFTALT, 1);
-	write_event(fd, EV_KEY, KEY_SYSRQ, 1);
-	write_event(fd, EV_KEY, KEY_X, 1);
+int listen_unix(const char *path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(&addr.sun_path[0], path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind()");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		perror("listen()");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
 
-	write_event(fd, EV_KEY, KEY_X, 0);
-	write_event(fd, EV_KEY, KEY_SYSRQ, 0);
-	write_event(fd, EV_KEY, KEY_LEFTALT, 0);
+void run_daemon(const char *path, const char *cache_path) {
+	static struct daemon daemon;
+	daemon.index = &device_index;
+	batch_init(&daemon.batch, -1);
+	daemon.injector.fd = -1;
+	daemon.injector.event = -1;
 
-	write_event(fd, EV_SYN, 0, 0);
+	monitor_open(&daemon.monitor);
+	scan_devices(daemon.index, cache_path);
+	if (injector_get(&daemon.injector, daemon.index) < 0)
+		printf("no device supports sysrq injection yet\n");
 
-	printf("done\n");
+	daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (daemon.epoll_fd < 0) {
+		perror("epoll_create1()");
+		exit(EXIT_FAILURE);
+	}
+	daemon.listen_fd = listen_unix(path);
+	daemon_epoll_add(&daemon, daemon.listen_fd, &daemon.listen_fd);
+	daemon_epoll_add(&daemon, daemon.monitor.fd, &daemon.monitor);
+	printf("listening on %s\n", path);
+	fflush(stdout);
+
+	while (true) {
+		struct epoll_event events[DAEMON_MAX_EVENTS];
+		int n = epoll_wait(daemon.epoll_fd, &events[0],
+					DAEMON_MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+
+		// Hotplug first, so that requests from this round already
+		// go to the right device.
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &daemon.monitor)
+				monitor_read(&daemon.monitor, daemon.index);
+			else if (events[i].data.ptr == &daemon.listen_fd)
+				daemon_accept(&daemon);
+		}
+		daemon.batch.fd = injector_get(&daemon.injector, daemon.index);
+
+		for (int i = 0; i < n; i++) {
+			struct daemon_client *client = events[i].data.ptr;
+			if (events[i].data.ptr == &daemon.monitor ||
+			    events[i].data.ptr == &daemon.listen_fd ||
+			    client->broken)
+				continue;
+			// Replies to requests read before an error are still sent.
+			if (daemon_read(&daemon, client) < 0) {
+				daemon_flush(&daemon);
+				client->broken = true;
+			}
+		}
+		daemon_flush(&daemon);
+		daemon_close_broken(&daemon);
+	}
+}
+
+// The daemon runs until it is killed, the trace is flushed on the way.
+void exit_signal(int sig) {
+	trace_flush_signal();
+	signal(sig, SIG_DFL);
+	raise(sig);
 }
 
-int main () {
-	int fd = find_device();
-	disable_lockdown(fd);
+void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-w] [-c cache_file] [-t trace_file] "
+		"[-l socket | -r recording [-n repeat]]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	const char *recording = NULL;
+	const char *cache = NULL;
+	const char *socket_path = NULL;
+	bool wait = false;
+	unsigned long repeat = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:l:n:r:t:w")) != -1) {
+		switch (opt) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'l':
+			socket_path = optarg;
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			recording = optarg;
+			break;
+		case 't':
+			trace_start(optarg);
+			break;
+		case 'w':
+			wait = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = exit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (socket_path != NULL)
+		run_daemon(socket_path, cache);
+
+	int fd = find_device(cache, wait);
+	if (recording != NULL)
+		replay(fd, recording, repeat);
+	else
+		disable_lockdown(fd);
 }
@@ -7,6 +7,26 @@
 # Andrey Konovalov <andreyknvl@gmail.com>
 
 import os
+
+# The evdev_sysrq module (see evdev-sysrq-py.c) shares the device index
+# and the batched writes of evdev-sysrq in evdev.c. Without it
+# python-evdev is used, which opens and queries every device.
+try:
+	import evdev_sysrq
+except ImportError:
+	evdev_sysrq = None
+
+if evdev_sysrq != None:
+	try:
+		fd = evdev_sysrq.find_device()
+	except OSError as err:
+		print(err)
+		exit(-1)
+	print("sending Alt+SysRq+X sequence")
+	evdev_sysrq.sysrq(fd)
+	print("done")
+	exit(0)
+
 import evdev
 import evdev.ecodes as e
 
@@ -47,4 +67,4 @@ sysrq_dev.write(e.EV_KEY, e.KEY_LEFTALT, 0)
 
 sysrq_dev.write(e.EV_SYN, 0, 0)
 
-printf("done")
+print("done")
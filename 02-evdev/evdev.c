@@ -0,0 +1,452 @@
+// Input device index, injector and event batches, see evdev.h.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include "evdev.h"
+#include "inject.h"
+#include "../trace/trace.h"
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+#define MAX_SCAN_THREADS 8
+#define UEVENT_SIZE 4096
+
+struct device_index device_index;
+
+// Parses a bitmap the way sysfs prints it: hex words separated by
+// spaces, most significant first, leading zero words left out.
+static void parse_bitmap(const char *str, unsigned long *bits,
+			unsigned int nbits) {
+	unsigned long words[BITS_TO_LONGS(KEY_CNT)];
+	unsigned int count = 0;
+	while (count < BITS_TO_LONGS(KEY_CNT)) {
+		char *end;
+		unsigned long word = strtoul(str, &end, 16);
+		if (end == str)
+			break;
+		words[count++] = word;
+		str = end;
+	}
+
+	memset(bits, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+	for (unsigned int i = 0; i < count && i < BITS_TO_LONGS(nbits); i++)
+		bits[i] = words[count - 1 - i];
+}
+
+static void parse_quoted(const char *str, char *out, size_t size) {
+	if (*str == '"')
+		str++;
+	snprintf(out, size, "%s", str);
+	size_t len = strlen(out);
+	if (len > 0 && out[len - 1] == '"')
+		out[len - 1] = 0;
+}
+
+// Returns the inputN the event node belongs to in input, or -1.
+static int read_device_link(unsigned int n, char *input, size_t size) {
+	char path[256], link[256];
+	snprintf(&path[0], sizeof(path), SYSFS_INPUT "/event%u/device", n);
+	ssize_t len = readlink(&path[0], &link[0], sizeof(link) - 1);
+	if (len < 0)
+		return -1;
+	link[len] = 0;
+	char *base = strrchr(&link[0], '/');
+	// A name that doesn't fit can't be told apart from others.
+	if (snprintf(input, size, "%s", base ? base + 1 : &link[0]) >= size)
+		return -1;
+	return 0;
+}
+
+int read_device(unsigned int n, struct input_device *dev) {
+	memset(dev, 0, sizeof(*dev));
+	if (read_device_link(n, dev->input, sizeof(dev->input)) < 0)
+		return -1;
+
+	char path[256];
+	snprintf(&path[0], sizeof(path), SYSFS_INPUT "/event%u/device/uevent",
+		n);
+	int fd = open(&path[0], O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	char buf[UEVENT_SIZE];
+	ssize_t len = read(fd, &buf[0], sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = 0;
+
+	char *save;
+	for (char *line = strtok_r(&buf[0], "\n", &save); line != NULL;
+			line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, "PRODUCT=", 8) == 0) {
+			unsigned int bustype, vendor, product, version;
+			if (sscanf(line + 8, "%x/%x/%x/%x", &bustype, &vendor,
+					&product, &version) == 4) {
+				dev->bustype = bustype;
+				dev->vendor = vendor;
+				dev->product = product;
+				dev->version = version;
+			}
+		} else if (strncmp(line, "NAME=", 5) == 0) {
+			parse_quoted(line + 5, dev->name, sizeof(dev->name));
+		} else if (strncmp(line, "PHYS=", 5) == 0) {
+			parse_quoted(line + 5, dev->phys, sizeof(dev->phys));
+		} else if (strncmp(line, "EV=", 3) == 0) {
+			parse_bitmap(line + 3, dev->ev, EV_CNT);
+		} else if (strncmp(line, "KEY=", 4) == 0) {
+			parse_bitmap(line + 4, dev->key, KEY_CNT);
+		}
+	}
+	dev->present = true;
+	return 0;
+}
+
+void index_add(struct device_index *index, unsigned int n) {
+	struct input_device *dev = &index->devices[n];
+	for (unsigned int ev = 0; ev < EV_CNT; ev++) {
+		if (test_bit(dev->ev, ev))
+			set_bit(index->by_ev[ev], n);
+	}
+	for (unsigned int key = 0; key < KEY_CNT; key++) {
+		if (test_bit(dev->key, key))
+			set_bit(index->by_key[key], n);
+	}
+}
+
+void index_remove(struct device_index *index, unsigned int n) {
+	for (unsigned int ev = 0; ev < EV_CNT; ev++)
+		clear_bit(index->by_ev[ev], n);
+	for (unsigned int key = 0; key < KEY_CNT; key++)
+		clear_bit(index->by_key[key], n);
+	index->devices[n].present = false;
+}
+
+void index_match(struct device_index *index, const unsigned int *evs,
+			int num_evs, const unsigned int *keys, int num_keys,
+			unsigned long *result) {
+	memset(result, 0xff, DEVICE_LONGS * sizeof(long));
+	for (int i = 0; i < num_evs; i++) {
+		for (int w = 0; w < DEVICE_LONGS; w++)
+			result[w] &= index->by_ev[evs[i]][w];
+	}
+	for (int i = 0; i < num_keys; i++) {
+		for (int w = 0; w < DEVICE_LONGS; w++)
+			result[w] &= index->by_key[keys[i]][w];
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+struct cache_header {
+	char magic[8];
+	char boot_id[40];
+	unsigned int entry_size;
+	unsigned int count;
+};
+
+struct cache_entry {
+	unsigned int event;
+	struct input_device dev;
+};
+
+#define CACHE_MAGIC "EVIDX001"
+
+static void read_boot_id(char *boot_id, size_t size) {
+	memset(boot_id, 0, size);
+	int fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	ssize_t len = read(fd, boot_id, size - 1);
+	close(fd);
+	if (len > 0 && boot_id[len - 1] == '\n')
+		boot_id[len - 1] = 0;
+}
+
+// Returns the number of entries loaded into cached, which is indexed by
+// N of eventN like the index itself.
+static int cache_load(const char *path, struct input_device *cached) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	struct cache_header header;
+	char boot_id[sizeof(header.boot_id)];
+	read_boot_id(&boot_id[0], sizeof(boot_id));
+	int loaded = 0;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(&header.magic[0], CACHE_MAGIC, sizeof(header.magic)) ||
+	    memcmp(&header.boot_id[0], &boot_id[0], sizeof(boot_id)) ||
+	    header.entry_size != sizeof(struct cache_entry))
+		goto out;
+
+	for (unsigned int i = 0; i < header.count; i++) {
+		struct cache_entry entry;
+		if (read(fd, &entry, sizeof(entry)) != sizeof(entry))
+			break;
+		if (entry.event >= MAX_INPUT_DEVICES || !entry.dev.present)
+			continue;
+		cached[entry.event] = entry.dev;
+		loaded++;
+	}
+out:
+	close(fd);
+	return loaded;
+}
+
+static void cache_save(const char *path, struct device_index *index) {
+	char tmp[512];
+	snprintf(&tmp[0], sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(&tmp[0], "w");
+	if (f == NULL) {
+		perror("fopen(cache)");
+		return;
+	}
+
+	struct cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header.magic[0], CACHE_MAGIC, sizeof(header.magic));
+	read_boot_id(&header.boot_id[0], sizeof(header.boot_id));
+	header.entry_size = sizeof(struct cache_entry);
+	for (unsigned int n = 0; n < MAX_INPUT_DEVICES; n++)
+		header.count += index->devices[n].present;
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (unsigned int n = 0; n < MAX_INPUT_DEVICES; n++) {
+		if (!index->devices[n].present)
+			continue;
+		struct cache_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.event = n;
+		entry.dev = index->devices[n];
+		fwrite(&entry, sizeof(entry), 1, f);
+	}
+
+	if (fclose(f) != 0 || rename(&tmp[0], path) < 0) {
+		perror("cache_save()");
+		unlink(&tmp[0]);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+struct scan_work {
+	struct device_index *index;
+	unsigned int nodes[MAX_INPUT_DEVICES];
+	unsigned int num_nodes;
+	unsigned int next;
+};
+
+static void *scan_thread(void *arg) {
+	struct scan_work *work = arg;
+	while (true) {
+		unsigned int i = __atomic_fetch_add(&work->next, 1,
+						__ATOMIC_RELAXED);
+		if (i >= work->num_nodes)
+			return NULL;
+		unsigned int n = work->nodes[i];
+		read_device(n, &work->index->devices[n]);
+	}
+}
+
+int index_scan(struct device_index *index, const char *cache_path) {
+	static struct input_device cached[MAX_INPUT_DEVICES];
+	static struct scan_work work;
+	DIR *dir = opendir(SYSFS_INPUT);
+	if (dir == NULL)
+		return -1;
+	memset(index, 0, sizeof(*index));
+	memset(&work, 0, sizeof(work));
+	work.index = index;
+
+	int num_cached = 0;
+	if (cache_path != NULL)
+		num_cached = cache_load(cache_path, &cached[0]);
+
+	unsigned int hits = 0, nodes = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "event", strlen("event")) != 0)
+			continue;
+		unsigned int n = atoi(entry->d_name + strlen("event"));
+		if (n >= MAX_INPUT_DEVICES)
+			continue;
+		nodes++;
+
+		char input[sizeof(cached[0].input)];
+		if (num_cached != 0 && cached[n].present &&
+		    read_device_link(n, &input[0], sizeof(input)) == 0 &&
+		    strcmp(&input[0], cached[n].input) == 0) {
+			index->devices[n] = cached[n];
+			hits++;
+			continue;
+		}
+		work.nodes[work.num_nodes++] = n;
+	}
+	closedir(dir);
+
+	unsigned int num_threads = work.num_nodes / 16 + 1;
+	if (num_threads > MAX_SCAN_THREADS)
+		num_threads = MAX_SCAN_THREADS;
+	pthread_t threads[MAX_SCAN_THREADS];
+	for (unsigned int i = 1; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_thread, &work) != 0)
+			num_threads = i;
+	}
+	scan_thread(&work);
+	for (unsigned int i = 1; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	int count = 0;
+	for (unsigned int n = 0; n < MAX_INPUT_DEVICES; n++) {
+		if (!index->devices[n].present)
+			continue;
+		index_add(index, n);
+		count++;
+	}
+
+	if (cache_path != NULL && hits != nodes)
+		cache_save(cache_path, index);
+	return count;
+}
+
+/*----------------------------------------------------------------------*/
+
+void injector_close(struct injector *injector) {
+	if (injector->fd >= 0)
+		close(injector->fd);
+	injector->fd = -1;
+	injector->event = -1;
+}
+
+int injector_get(struct injector *injector, struct device_index *index) {
+	const unsigned int evs[] = { EV_KEY, EV_SYN };
+	const unsigned int keys[] = { KEY_SYSRQ };
+	unsigned long match[DEVICE_LONGS];
+	index_match(index, &evs[0], 2, &keys[0], 1, &match[0]);
+
+	if (injector->event >= 0) {
+		// Same slot but another input device means it was replugged.
+		struct input_device *dev = &index->devices[injector->event];
+		if (test_bit(&match[0], injector->event) &&
+		    strcmp(dev->input, &injector->input[0]) == 0)
+			return injector->fd;
+		injector_close(injector);
+	}
+
+	for (unsigned int n = 0; n < MAX_INPUT_DEVICES; n++) {
+		if (!test_bit(&match[0], n))
+			continue;
+		char name[64];
+		snprintf(&name[0], sizeof(name), "/dev/input/event%u", n);
+		int fd = open(&name[0], O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			perror("open()");
+			continue;
+		}
+		trace_emit(TRACE_EVDEV_CHECK, n, 0, 0, TRACE_EVDEV_KEY |
+			TRACE_EVDEV_SYSRQ | TRACE_EVDEV_SYN, 0, NULL, 0);
+		printf("found device %s (%s)\n", &name[0],
+			index->devices[n].name);
+		injector->fd = fd;
+		injector->event = n;
+		snprintf(&injector->input[0], sizeof(injector->input), "%s",
+			index->devices[n].input);
+		return fd;
+	}
+	return -1;
+}
+
+/*----------------------------------------------------------------------*/
+
+void batch_init(struct event_batch *batch, int fd) {
+	memset(batch, 0, sizeof(*batch));
+	batch->fd = fd;
+}
+
+static void batch_write(struct event_batch *batch) {
+	char *data = (char *)&batch->events[0];
+	size_t size = batch->count * sizeof(batch->events[0]);
+	while (size > 0) {
+		ssize_t rv = write(batch->fd, data, size);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		// The events are dropped, callers check batch->error.
+		if (rv <= 0) {
+			batch->error = rv < 0 ? errno : EIO;
+			break;
+		}
+		data += rv;
+		size -= rv;
+		batch->writes++;
+	}
+	batch->written += batch->count;
+	batch->count = 0;
+}
+
+void batch_event(struct event_batch *batch, unsigned int type,
+			unsigned int code, int value) {
+	if (batch->count == MAX_BATCH_EVENTS)
+		batch_write(batch);
+
+	struct input_event *event = &batch->events[batch->count++];
+	memset(event, 0, sizeof(*event));
+	event->type = type;
+	event->code = code;
+	event->value = value;
+	trace_emit(TRACE_EVDEV_WRITE, batch->fd, 0, type, code, value, NULL, 0);
+
+	if (type == EV_SYN && code == SYN_REPORT)
+		batch->frame_events = 0;
+	else
+		batch->frame_events++;
+}
+
+void batch_sync(struct event_batch *batch) {
+	if (batch->frame_events != 0)
+		batch_event(batch, EV_SYN, SYN_REPORT, 0);
+}
+
+void batch_flush(struct event_batch *batch) {
+	batch_sync(batch);
+	if (batch->count != 0)
+		batch_write(batch);
+}
+
+void batch_sysrq(struct event_batch *batch, unsigned int key) {
+	batch_sync(batch);
+
+	batch_event(batch, EV_KEY, KEY_LEFTALT, 1);
+	batch_event(batch, EV_KEY, KEY_SYSRQ, 1);
+	batch_event(batch, EV_KEY, key, 1);
+	batch_sync(batch);
+
+	batch_event(batch, EV_KEY, key, 0);
+	batch_event(batch, EV_KEY, KEY_SYSRQ, 0);
+	batch_event(batch, EV_KEY, KEY_LEFTALT, 0);
+	batch_sync(batch);
+}
+
+void batch_inject(struct event_batch *batch, const struct inject_event *events,
+			unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+			batch_sync(batch);
+		else
+			batch_event(batch, events[i].type, events[i].code,
+				events[i].value);
+	}
+	batch_sync(batch);
+}
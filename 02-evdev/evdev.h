@@ -0,0 +1,140 @@
+// Input device index, injector and event batches of evdev-sysrq.c, also
+// linked into the Python module in evdev-sysrq-py.c. Nothing here exits
+// on failure, errors are returned to the caller.
+//
+// Input devices are found through sysfs instead of by opening every
+// /dev/input/eventN and asking it with EVIOCGBIT. The uevent file of the
+// input device behind each event node has its identity and capability
+// bitmaps, so the scan is one read per node, done by several threads at
+// once. The result is an index with a bitmap of devices for every event
+// type and key, and only the device that gets picked is ever opened.
+//
+// With a cache file the index is also kept there. Entries are keyed by
+// the input device an event node belongs to (inputN, never reused until
+// reboot) and the boot ID, so on later runs a readlink() per node is
+// enough to tell that nothing changed.
+
+#ifndef EVDEV_H
+#define EVDEV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <linux/input.h>
+
+#include "inject.h"
+
+#ifndef SYSFS_INPUT
+#define SYSFS_INPUT "/sys/class/input"
+#endif
+
+#define MAX_INPUT_DEVICES 1024	// N of eventN, power of two
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DEVICE_LONGS BITS_TO_LONGS(MAX_INPUT_DEVICES)
+
+struct input_device {
+	bool present;
+	char input[16];			// inputN
+	unsigned short bustype;
+	unsigned short vendor;
+	unsigned short product;
+	unsigned short version;
+	char name[128];
+	char phys[64];
+	unsigned long ev[BITS_TO_LONGS(EV_CNT)];
+	unsigned long key[BITS_TO_LONGS(KEY_CNT)];
+};
+
+struct device_index {
+	struct input_device devices[MAX_INPUT_DEVICES];
+	unsigned long by_ev[EV_CNT][DEVICE_LONGS];
+	unsigned long by_key[KEY_CNT][DEVICE_LONGS];
+};
+
+extern struct device_index device_index;
+
+static inline bool test_bit(const unsigned long *bits, unsigned int bit) {
+	return bits[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG));
+}
+
+static inline void set_bit(unsigned long *bits, unsigned int bit) {
+	bits[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+static inline void clear_bit(unsigned long *bits, unsigned int bit) {
+	bits[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+// Fills dev from the uevent file of eventN's input device. Returns -1 if
+// the device went away or can't be read.
+int read_device(unsigned int n, struct input_device *dev);
+
+void index_add(struct device_index *index, unsigned int n);
+void index_remove(struct device_index *index, unsigned int n);
+
+// Sets the bits of devices that support all of evs and keys in result.
+void index_match(struct device_index *index, const unsigned int *evs,
+			int num_evs, const unsigned int *keys, int num_keys,
+			unsigned long *result);
+
+// Fills the index from sysfs, or from the cache for nodes that still
+// belong to the same input device. Returns the number of devices, or -1
+// with errno set and the index untouched if SYSFS_INPUT can't be read.
+int index_scan(struct device_index *index, const char *cache_path);
+
+/*----------------------------------------------------------------------*/
+
+// Injections go to the best device that supports sysrq injection. The
+// current one is kept for as long as it stays plugged in, after that it's
+// the lowest numbered one that can be opened.
+
+struct injector {
+	int fd;
+	int event;	// N of eventN, -1 when there is no device
+	char input[16];
+};
+
+void injector_close(struct injector *injector);
+
+// Returns an fd for the currently best device, or -1 if there is none.
+int injector_get(struct injector *injector, struct device_index *index);
+
+/*----------------------------------------------------------------------*/
+
+// Events are collected into a preallocated batch and written with a
+// single write(), evdev takes any number of events per write. A batch is
+// a sequence of frames, batch_sync() ends the current one with
+// SYN_REPORT unless it is empty. A failed write drops the events and
+// leaves its errno in batch->error.
+
+#define MAX_BATCH_EVENTS 1024
+
+struct event_batch {
+	int fd;
+	struct input_event events[MAX_BATCH_EVENTS];
+	unsigned int count;
+	unsigned int frame_events;	// in the current frame
+	unsigned long written;
+	unsigned long writes;
+	int error;			// errno of the last failed write
+};
+
+void batch_init(struct event_batch *batch, int fd);
+void batch_event(struct event_batch *batch, unsigned int type,
+			unsigned int code, int value);
+void batch_sync(struct event_batch *batch);
+
+// Ends the current frame and writes out everything.
+void batch_flush(struct event_batch *batch);
+
+// Queues a press and a release of Alt+SysRq+key, as two frames.
+void batch_sysrq(struct event_batch *batch, unsigned int key);
+
+// Queues events in the inject.h format. Their SYN_REPORTs end frames and
+// the last frame is ended if it isn't already.
+void batch_inject(struct event_batch *batch, const struct inject_event *events,
+			unsigned int count);
+
+#endif // EVDEV_H
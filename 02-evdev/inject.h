@@ -0,0 +1,44 @@
+// Protocol of the evdev-sysrq injection daemon (evdev-sysrq -l path).
+//
+// Clients connect to the daemon's Unix stream socket and send requests,
+// each an inject_request header followed by its data. Every request gets
+// an inject_reply, in order. A single message may carry any number of
+// requests, the daemon writes the events of everything it has read to
+// the device with one write() and then sends the replies.
+
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stdint.h>
+
+#define INJECT_MAGIC		0x4a4e4956	// "VINJ"
+
+// count struct inject_event follow. SYN_REPORTs among them end frames,
+// the request's last frame is ended by the daemon if it isn't already.
+#define INJECT_OP_EVENTS	1
+// count is a key code, Alt+SysRq+key is pressed and released.
+#define INJECT_OP_SYSRQ		2
+
+#define INJECT_MAX_EVENTS	4096	// per request
+
+struct inject_event {
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+} __attribute__((packed));
+
+struct inject_request {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t seqnum;
+	uint32_t count;
+} __attribute__((packed));
+
+struct inject_reply {
+	uint32_t seqnum;
+	int32_t status;		// 0 or -errno, -ENODEV when there is no device
+	uint32_t count;		// events written, including added SYN_REPORTs
+	int32_t event;		// N of the eventN written to, or -1
+} __attribute__((packed));
+
+#endif // INJECT_H
@@ -0,0 +1,444 @@
+// Measures how long injected key events take to reach an evdev reader.
+//
+// Taps KEY_F24 over and over through one of the injection paths and reads
+// the presses back from a separate fd of the receiving /dev/input/eventN:
+//
+//   evdev	write()s to the device directly, what evdev-sysrq does
+//   daemon	sends requests to evdev-sysrq -l (see inject.h)
+//   usbip	writes "tap 0x73" lines to the report stream script of a
+//		keyboard.c server (-s fifo) whose device is attached over vhci
+//
+// For every press two latencies are recorded: until the timestamp evdev
+// gave the event when the input core passed it on, and until the read()
+// returned it. Prints percentiles, a histogram of each and the events/s
+// that got through. -w keeps several taps in flight for throughput runs.
+// -k writes the submit time of every tap to the mark file of the probe
+// module in rootkit/ first, so that its histograms have the same taps.
+//
+//   gcc input-latency.c -o input-latency -pthread
+//   ./input-latency -m evdev -d /dev/input/event3 -n 10000
+//   ./input-latency -m daemon -l /tmp/evdev.sock
+//   mkfifo /tmp/s; ../01-usbip/keyboard -s /tmp/s & usbip attach ...
+//   ./input-latency -m usbip -s /tmp/s -d /dev/input/event20 -n 1000
+//   ./input-latency -d /dev/input/event3 -k /sys/kernel/debug/input_latency/mark
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/input.h>
+
+#include "inject.h"
+
+#define TAP_KEY KEY_F24
+#define TAP_SCRIPT "tap 0x73\n"	// HID usage of F24
+#define READ_TIMEOUT_MS 1000
+#define HIST_BUCKETS 32		// powers of two of us
+
+enum inject_mode {
+	MODE_EVDEV,
+	MODE_DAEMON,
+	MODE_USBIP,
+};
+
+struct bench {
+	enum inject_mode mode;
+	int inject_fd;
+	int read_fd;
+	int mark_fd;		// -1 without -k
+	unsigned long count;
+	unsigned long window;
+
+	// Indexed by tap number.
+	unsigned long *inject_ns;
+	unsigned long *kernel_ns;
+	unsigned long *read_ns;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long sent;
+	unsigned long received;
+	bool lost;
+};
+
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void write_all(int fd, const void *buf, size_t size) {
+	while (size > 0) {
+		ssize_t rv = write(fd, buf, size);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			perror("write()");
+			exit(EXIT_FAILURE);
+		}
+		buf = (const char *)buf + rv;
+		size -= rv;
+	}
+}
+
+void read_all(int fd, void *buf, size_t size) {
+	while (size > 0) {
+		ssize_t rv = read(fd, buf, size);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			fprintf(stderr, "read(): %s\n",
+				rv == 0 ? "connection closed" : strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		buf = (char *)buf + rv;
+		size -= rv;
+	}
+}
+
+int open_device(const char *path, int flags) {
+	int fd = open(path, flags | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open()");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+int connect_daemon(const char *path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket()");
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(&addr.sun_path[0], sizeof(addr.sun_path), "%s", path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect()");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+// Sends one request of count events and waits for its reply.
+struct inject_reply daemon_inject(int fd, uint32_t seqnum,
+				struct inject_event *events, uint32_t count) {
+	struct {
+		struct inject_request request;
+		struct inject_event events[4];
+	} __attribute__((packed)) msg;
+	msg.request.magic = INJECT_MAGIC;
+	msg.request.op = INJECT_OP_EVENTS;
+	msg.request.seqnum = seqnum;
+	msg.request.count = count;
+	if (count != 0)
+		memcpy(&msg.events[0], events, count * sizeof(events[0]));
+	write_all(fd, &msg, sizeof(msg.request) + count * sizeof(events[0]));
+
+	struct inject_reply reply;
+	read_all(fd, &reply, sizeof(reply));
+	if (reply.seqnum != seqnum || reply.status != 0) {
+		fprintf(stderr, "daemon: seqnum %u, status %d\n",
+			reply.seqnum, reply.status);
+		exit(EXIT_FAILURE);
+	}
+	return reply;
+}
+
+// Takes the submit time of tap i and hands it to the probe module. The
+// mark has to be there before the press, so the write counts towards the
+// latency of the tap.
+void mark_tap(struct bench *bench, unsigned long i) {
+	bench->inject_ns[i] = now_ns();
+	if (bench->mark_fd < 0)
+		return;
+	char buf[32];
+	int len = snprintf(&buf[0], sizeof(buf), "%lu\n", bench->inject_ns[i]);
+	write_all(bench->mark_fd, &buf[0], len);
+}
+
+// A tap is the press and the release, each in its own frame. Only the
+// press is timed, it's the first event of the tap on every path.
+void inject_tap(struct bench *bench, unsigned long i) {
+	struct inject_event events[4] = {
+		{ EV_KEY, TAP_KEY, 1 }, { EV_SYN, SYN_REPORT, 0 },
+		{ EV_KEY, TAP_KEY, 0 }, { EV_SYN, SYN_REPORT, 0 },
+	};
+	struct input_event raw[4];
+
+	switch (bench->mode) {
+	case MODE_EVDEV:
+		memset(&raw[0], 0, sizeof(raw));
+		for (int j = 0; j < 4; j++) {
+			raw[j].type = events[j].type;
+			raw[j].code = events[j].code;
+			raw[j].value = events[j].value;
+		}
+		mark_tap(bench, i);
+		write_all(bench->inject_fd, &raw[0], sizeof(raw));
+		break;
+	case MODE_DAEMON:
+		mark_tap(bench, i);
+		daemon_inject(bench->inject_fd, i, &events[0], 4);
+		break;
+	case MODE_USBIP:
+		mark_tap(bench, i);
+		write_all(bench->inject_fd, TAP_SCRIPT, strlen(TAP_SCRIPT));
+		break;
+	}
+}
+
+void *reader_main(void *arg) {
+	struct bench *bench = arg;
+	struct pollfd pfd = { .fd = bench->read_fd, .events = POLLIN };
+	unsigned long received = 0;
+
+	while (received < bench->count) {
+		int rv = poll(&pfd, 1, READ_TIMEOUT_MS);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0) {
+			perror("poll()");
+			exit(EXIT_FAILURE);
+		}
+		if (rv == 0) {
+			pthread_mutex_lock(&bench->lock);
+			fprintf(stderr, "no events for %d ms, %lu taps lost\n",
+				READ_TIMEOUT_MS, bench->sent - received);
+			bench->lost = true;
+			pthread_cond_signal(&bench->cond);
+			pthread_mutex_unlock(&bench->lock);
+			return NULL;
+		}
+
+		struct input_event events[64];
+		ssize_t len = read(bench->read_fd, &events[0], sizeof(events));
+		if (len < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (len <= 0) {
+			perror("read()");
+			exit(EXIT_FAILURE);
+		}
+		unsigned long now = now_ns();
+		unsigned long before = received;
+		for (int j = 0; j < len / sizeof(events[0]); j++) {
+			struct input_event *e = &events[j];
+			if (e->type == EV_SYN && e->code == SYN_DROPPED)
+				fprintf(stderr, "reader fell behind, "
+					"evdev dropped events\n");
+			if (e->type != EV_KEY || e->code != TAP_KEY ||
+			    e->value != 1 || received == bench->count)
+				continue;
+			bench->kernel_ns[received] = e->input_event_sec *
+				1000000000UL + e->input_event_usec * 1000UL;
+			bench->read_ns[received] = now;
+			received++;
+		}
+		if (received == before)
+			continue;
+
+		pthread_mutex_lock(&bench->lock);
+		bench->received = received;
+		pthread_cond_signal(&bench->cond);
+		pthread_mutex_unlock(&bench->lock);
+	}
+	return NULL;
+}
+
+/*----------------------------------------------------------------------*/
+
+int compare_ulong(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+// Turns the end times in ns into latencies, sorts them and prints
+// percentiles and a histogram with a bucket per power of two of us.
+void latency_print(const char *name, unsigned long *ns,
+			unsigned long *start, unsigned long count) {
+	for (unsigned long i = 0; i < count; i++)
+		ns[i] = ns[i] > start[i] ? ns[i] - start[i] : 0;
+	qsort(ns, count, sizeof(ns[0]), compare_ulong);
+	printf("%s: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+		"max %.1f us\n", name, ns[count / 2] / 1000.0,
+		ns[count * 90 / 100] / 1000.0, ns[count * 99 / 100] / 1000.0,
+		ns[count * 999 / 1000] / 1000.0, ns[count - 1] / 1000.0);
+
+	unsigned long buckets[HIST_BUCKETS];
+	memset(&buckets[0], 0, sizeof(buckets));
+	for (unsigned long i = 0; i < count; i++) {
+		unsigned long us = ns[i] / 1000;
+		int b = 0;
+		while (us > 1 && b < HIST_BUCKETS - 1) {
+			us >>= 1;
+			b++;
+		}
+		buckets[b]++;
+	}
+	unsigned long most = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		if (buckets[b] > most)
+			most = buckets[b];
+	}
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		if (buckets[b] == 0)
+			continue;
+		int width = buckets[b] * 50 / most;
+		printf("  < %8lu us %8lu |%.*s\n", 2UL << b, buckets[b], width,
+			"##################################################");
+	}
+}
+
+void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-m evdev|daemon|usbip] [-d device] "
+		"[-l socket] [-s script] [-n taps] [-w window] [-k mark]\n",
+		argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	struct bench bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.mode = MODE_EVDEV;
+	bench.count = 10000;
+	bench.window = 1;
+	bench.mark_fd = -1;
+	const char *device = NULL, *socket_path = NULL, *script = NULL;
+	const char *mark = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:k:l:m:n:s:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'k':
+			mark = optarg;
+			break;
+		case 'l':
+			socket_path = optarg;
+			break;
+		case 'm':
+			if (strcmp(optarg, "evdev") == 0)
+				bench.mode = MODE_EVDEV;
+			else if (strcmp(optarg, "daemon") == 0)
+				bench.mode = MODE_DAEMON;
+			else if (strcmp(optarg, "usbip") == 0)
+				bench.mode = MODE_USBIP;
+			else
+				usage(argv[0]);
+			break;
+		case 'n':
+			bench.count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			script = optarg;
+			break;
+		case 'w':
+			bench.window = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (bench.count == 0 || bench.window == 0)
+		usage(argv[0]);
+
+	// The reader is opened first, events injected before it exists
+	// would be lost.
+	char daemon_device[64];
+	switch (bench.mode) {
+	case MODE_EVDEV:
+		if (device == NULL)
+			usage(argv[0]);
+		break;
+	case MODE_DAEMON:
+		if (socket_path == NULL)
+			usage(argv[0]);
+		bench.inject_fd = connect_daemon(socket_path);
+		// An empty request tells which device the daemon writes to.
+		struct inject_reply reply = daemon_inject(bench.inject_fd,
+							~0u, NULL, 0);
+		snprintf(&daemon_device[0], sizeof(daemon_device),
+			"/dev/input/event%d", reply.event);
+		if (device == NULL)
+			device = &daemon_device[0];
+		break;
+	case MODE_USBIP:
+		if (script == NULL || device == NULL)
+			usage(argv[0]);
+		break;
+	}
+
+	bench.read_fd = open_device(device, O_RDONLY | O_NONBLOCK);
+	int clk = CLOCK_MONOTONIC;
+	if (ioctl(bench.read_fd, EVIOCSCLOCKID, &clk) < 0)
+		perror("ioctl(EVIOCSCLOCKID)");
+
+	if (bench.mode == MODE_EVDEV)
+		bench.inject_fd = open_device(device, O_WRONLY);
+	else if (bench.mode == MODE_USBIP)
+		bench.inject_fd = open_device(script, O_WRONLY);
+	if (mark != NULL)
+		bench.mark_fd = open_device(mark, O_WRONLY);
+
+	bench.inject_ns = calloc(bench.count, sizeof(unsigned long));
+	bench.kernel_ns = calloc(bench.count, sizeof(unsigned long));
+	bench.read_ns = calloc(bench.count, sizeof(unsigned long));
+	if (!bench.inject_ns || !bench.kernel_ns || !bench.read_ns) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&bench.lock, NULL);
+	pthread_cond_init(&bench.cond, NULL);
+
+	pthread_t reader;
+	int rv = pthread_create(&reader, NULL, reader_main, &bench);
+	if (rv != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(rv));
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned long start = now_ns();
+	for (unsigned long i = 0; i < bench.count; i++) {
+		pthread_mutex_lock(&bench.lock);
+		while (i - bench.received >= bench.window && !bench.lost)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		bool lost = bench.lost;
+		bench.sent = i + 1;
+		pthread_mutex_unlock(&bench.lock);
+		if (lost)
+			break;
+		inject_tap(&bench, i);
+	}
+	pthread_join(reader, NULL);
+	unsigned long end = now_ns();
+
+	unsigned long count = bench.received;
+	if (count == 0) {
+		fprintf(stderr, "nothing came back from %s\n", device);
+		exit(EXIT_FAILURE);
+	}
+	double secs = (end - start) / 1e9;
+	printf("%lu taps through %s in %.3f s, %.0f events/s\n", count,
+		device, secs, count * 4 / secs);
+	latency_print("input core", bench.kernel_ns, bench.inject_ns, count);
+	latency_print("reader", bench.read_ns, bench.inject_ns, count);
+
+	return bench.lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -4,5 +4,5 @@ set -eux
 
 echo 1 > /proc/sys/kernel/sysrq
 
-gcc ./evdev-sysrq.c -o evdev-sysrq
+gcc ./evdev-sysrq.c ./evdev.c -o evdev-sysrq -pthread
 ./evdev-sysrq
@@ -1,15 +1,417 @@
+// Input latency probe: an input handler that sees every event of every
+// input device as the input core passes it on and keeps histograms in
+// debugfs, so that injection benchmarks can tell how long an event took
+// from the userspace submit to the input core without kprobes.
+//
+// Handlers are called from input_event() itself, so the time taken in
+// probe_event() is when the event arrived in the input core, the same
+// moment evdev stamps it for its readers. Two histograms are kept, both
+// with a bucket per power of two of us like input-latency.c:
+//
+//   latency	from a submit time that userspace wrote to the mark file
+//		until the press of the probed key (module parameter key,
+//		KEY_F24 by default) that it was written for arrived
+//   interval	between two SYN_REPORT frames of the same device, which is
+//		what throughput runs look at
+//
+// Each CPU counts into its own copy with this_cpu_inc(), only presses of
+// the probed key take a lock to get their mark. The files under
+// /sys/kernel/debug/input_latency/ sum the copies when they're read:
+//
+//   latency, interval	the histograms
+//   cpus		events, frames and presses per CPU
+//   devices		counters and frames/s of every device
+//   mark		write a CLOCK_MONOTONIC time in ns before submitting a
+//			press, marks are matched to presses in order
+//   reset		write anything to zero everything
+//
+// Andrey Konovalov <andreyknvl@gmail.com>
+
+#include <linux/debugfs.h>
+#include <linux/input.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+
+#define HIST_BUCKETS 32		// powers of two of us
+#define MARK_RING 1024		// marks that can wait for their press
+
+static unsigned int key = KEY_F24;
+module_param(key, uint, 0644);
+MODULE_PARM_DESC(key, "key code whose presses are matched to marks");
+
+struct probe_stats {
+	u64 latency[HIST_BUCKETS];
+	u64 interval[HIST_BUCKETS];
+	u64 events;
+	u64 frames;
+	u64 marked;		// presses of the key with a mark
+	u64 unmarked;		// and without one
+};
+
+static DEFINE_PER_CPU(struct probe_stats, probe_stats);
+
+// Only touched by probe_event(), which the input core never runs
+// concurrently for one device, the readers don't mind torn values.
+struct probe_dev {
+	struct input_handle handle;
+	struct list_head node;
+	u64 events;
+	u64 frames;
+	u64 first_ns;
+	u64 last_ns;
+	u64 last_frame_ns;
+};
+
+static LIST_HEAD(probe_devs);
+static DEFINE_MUTEX(probe_devs_lock);
+
+static struct dentry *probe_dir;
+
+// Writers of the mark file push at the tail, probe_event() pops at the
+// head, both under mark_lock. probe_event() runs with interrupts off
+// under the device's event lock, so the writers disable them too.
+static u64 marks[MARK_RING];
+static unsigned int mark_head;
+static unsigned int mark_tail;
+static DEFINE_SPINLOCK(mark_lock);
+
+static int probe_mark_push(u64 ns)
+{
+	unsigned long flags;
+	int error = 0;
+
+	spin_lock_irqsave(&mark_lock, flags);
+	if (mark_tail - mark_head >= MARK_RING)
+		error = -ENOSPC;
+	else
+		marks[mark_tail++ % MARK_RING] = ns;
+	spin_unlock_irqrestore(&mark_lock, flags);
+	return error;
+}
+
+// Returns 0 if no mark is waiting.
+static u64 probe_mark_pop(void)
+{
+	unsigned long flags;
+	u64 ns = 0;
+
+	spin_lock_irqsave(&mark_lock, flags);
+	if (mark_head != mark_tail)
+		ns = marks[mark_head++ % MARK_RING];
+	spin_unlock_irqrestore(&mark_lock, flags);
+	return ns;
+}
+
+static unsigned int probe_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	if (us <= 1)
+		return 0;
+	return min_t(unsigned int, ilog2(us), HIST_BUCKETS - 1);
+}
+
+static void probe_event(struct input_handle *handle, unsigned int type,
+			unsigned int code, int value)
+{
+	struct probe_dev *pd = container_of(handle, struct probe_dev, handle);
+	u64 now = ktime_get_ns();
+	unsigned int b;
+	u64 mark;
+
+	this_cpu_inc(probe_stats.events);
+	pd->events++;
+	if (pd->first_ns == 0)
+		pd->first_ns = now;
+	pd->last_ns = now;
+
+	if (type == EV_SYN && code == SYN_REPORT) {
+		this_cpu_inc(probe_stats.frames);
+		if (pd->last_frame_ns != 0) {
+			b = probe_bucket(now - pd->last_frame_ns);
+			this_cpu_inc(probe_stats.interval[b]);
+		}
+		pd->last_frame_ns = now;
+		pd->frames++;
+	} else if (type == EV_KEY && code == READ_ONCE(key) && value == 1) {
+		mark = probe_mark_pop();
+		if (mark == 0) {
+			this_cpu_inc(probe_stats.unmarked);
+			return;
+		}
+		b = probe_bucket(now > mark ? now - mark : 0);
+		this_cpu_inc(probe_stats.marked);
+		this_cpu_inc(probe_stats.latency[b]);
+	}
+}
+
+static int probe_connect(struct input_handler *handler, struct input_dev *dev,
+			 const struct input_device_id *id)
+{
+	struct probe_dev *pd;
+	int error;
+
+	pd = kzalloc(sizeof(*pd), GFP_KERNEL);
+	if (!pd)
+		return -ENOMEM;
+
+	pd->handle.dev = dev;
+	pd->handle.handler = handler;
+	pd->handle.name = "input_latency";
+
+	error = input_register_handle(&pd->handle);
+	if (error)
+		goto err_free;
+
+	// Handlers only get events of devices they have opened.
+	error = input_open_device(&pd->handle);
+	if (error)
+		goto err_unregister;
+
+	mutex_lock(&probe_devs_lock);
+	list_add_tail(&pd->node, &probe_devs);
+	mutex_unlock(&probe_devs_lock);
+	return 0;
+
+err_unregister:
+	input_unregister_handle(&pd->handle);
+err_free:
+	kfree(pd);
+	return error;
+}
+
+static void probe_disconnect(struct input_handle *handle)
+{
+	struct probe_dev *pd = container_of(handle, struct probe_dev, handle);
+
+	mutex_lock(&probe_devs_lock);
+	list_del(&pd->node);
+	mutex_unlock(&probe_devs_lock);
+
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(pd);
+}
+
+static const struct input_device_id probe_ids[] = {
+	{ .driver_info = 1 },	// matches all devices
+	{ },
+};
+
+static struct input_handler probe_handler = {
+	.event = probe_event,
+	.connect = probe_connect,
+	.disconnect = probe_disconnect,
+	.name = "input_latency",
+	.id_table = probe_ids,
+};
+
+/*----------------------------------------------------------------------*/
+
+static void probe_sum(struct probe_stats *sum)
+{
+	struct probe_stats *s;
+	int cpu, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(&probe_stats, cpu);
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			sum->latency[b] += READ_ONCE(s->latency[b]);
+			sum->interval[b] += READ_ONCE(s->interval[b]);
+		}
+		sum->events += READ_ONCE(s->events);
+		sum->frames += READ_ONCE(s->frames);
+		sum->marked += READ_ONCE(s->marked);
+		sum->unmarked += READ_ONCE(s->unmarked);
+	}
+}
+
+static void probe_show_hist(struct seq_file *m, const u64 *buckets)
+{
+	u64 total = 0, most = 0;
+	int b, width;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		total += buckets[b];
+		most = max(most, buckets[b]);
+	}
+	seq_printf(m, "%llu samples\n", total);
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (buckets[b] == 0)
+			continue;
+		width = div64_u64(buckets[b] * 50, most);
+		seq_printf(m, "  < %8llu us %8llu |%.*s\n", 2ULL << b,
+			   buckets[b], width,
+			   "##################################################");
+	}
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+	struct probe_stats sum;
+
+	probe_sum(&sum);
+	probe_show_hist(m, sum.latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int interval_show(struct seq_file *m, void *v)
+{
+	struct probe_stats sum;
+
+	probe_sum(&sum);
+	probe_show_hist(m, sum.interval);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(interval);
+
+static int cpus_show(struct seq_file *m, void *v)
+{
+	struct probe_stats *s;
+	unsigned int pending;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(&probe_stats, cpu);
+		if (READ_ONCE(s->events) == 0)
+			continue;
+		seq_printf(m, "cpu%d events %llu frames %llu "
+			   "marked %llu unmarked %llu\n", cpu,
+			   READ_ONCE(s->events), READ_ONCE(s->frames),
+			   READ_ONCE(s->marked), READ_ONCE(s->unmarked));
+	}
+	spin_lock_irq(&mark_lock);
+	pending = mark_tail - mark_head;
+	spin_unlock_irq(&mark_lock);
+	seq_printf(m, "marks pending %u\n", pending);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cpus);
+
+static int devices_show(struct seq_file *m, void *v)
+{
+	struct probe_dev *pd;
+	struct input_dev *dev;
+	u64 span, rate;
+
+	mutex_lock(&probe_devs_lock);
+	list_for_each_entry(pd, &probe_devs, node) {
+		dev = pd->handle.dev;
+		span = READ_ONCE(pd->last_ns) - READ_ONCE(pd->first_ns);
+		rate = span ? div64_u64(READ_ONCE(pd->frames) * NSEC_PER_SEC,
+					span) : 0;
+		seq_printf(m, "%s events %llu frames %llu frames/s %llu "
+			   "\"%s\"\n", dev_name(&dev->dev),
+			   READ_ONCE(pd->events), READ_ONCE(pd->frames), rate,
+			   dev->name ? dev->name : "");
+	}
+	mutex_unlock(&probe_devs_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(devices);
+
+static ssize_t mark_write(struct file *file, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	u64 ns;
+	int error;
+
+	error = kstrtou64_from_user(buf, count, 0, &ns);
+	if (error)
+		return error;
+	if (ns == 0)
+		return -EINVAL;
+	error = probe_mark_push(ns);
+	if (error)
+		return error;
+	return count;
+}
+
+static const struct file_operations mark_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = mark_write,
+	.llseek = noop_llseek,
+};
+
+// Counts that are in flight on other CPUs may survive a reset.
+static ssize_t reset_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct probe_dev *pd;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&probe_stats, cpu), 0,
+		       sizeof(struct probe_stats));
+
+	mutex_lock(&probe_devs_lock);
+	list_for_each_entry(pd, &probe_devs, node) {
+		pd->events = 0;
+		pd->frames = 0;
+		pd->first_ns = 0;
+		pd->last_ns = 0;
+		pd->last_frame_ns = 0;
+	}
+	mutex_unlock(&probe_devs_lock);
+
+	spin_lock_irq(&mark_lock);
+	mark_head = mark_tail;
+	spin_unlock_irq(&mark_lock);
+	return count;
+}
+
+static const struct file_operations reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = reset_write,
+	.llseek = noop_llseek,
+};
 
 static int rootkit_init(void)
 {
+	int error;
+
+	probe_dir = debugfs_create_dir("input_latency", NULL);
+	debugfs_create_file("latency", 0444, probe_dir, NULL, &latency_fops);
+	debugfs_create_file("interval", 0444, probe_dir, NULL,
+			    &interval_fops);
+	debugfs_create_file("cpus", 0444, probe_dir, NULL, &cpus_fops);
+	debugfs_create_file("devices", 0444, probe_dir, NULL, &devices_fops);
+	debugfs_create_file("mark", 0200, probe_dir, NULL, &mark_fops);
+	debugfs_create_file("reset", 0200, probe_dir, NULL, &reset_fops);
+
+	error = input_register_handler(&probe_handler);
+	if (error) {
+		debugfs_remove_recursive(probe_dir);
+		return error;
+	}
+
 	pr_err("rootkit successfully loaded\n");
 	return 0;
 }
 
 static void rootkit_exit(void)
 {
+	input_unregister_handler(&probe_handler);
+	debugfs_remove_recursive(probe_dir);
 }
 
 module_init(rootkit_init);
 module_exit(rootkit_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Input latency probe");
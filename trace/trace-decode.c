@@ -0,0 +1,332 @@
+// Prints trace files written by trace.h as text.
+//
+// Events are sorted by time across threads. Replies are matched with the
+// CMD_SUBMIT or CMD_UNLINK that has the same connection and seqnum, and
+// the time between the two is shown as latency. A summary with counts
+// and latency percentiles follows the events, -s prints only that.
+//
+//   gcc trace-decode.c -o trace-decode
+//   ./trace-decode [-s] trace.bin
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_DISABLED
+#include "trace.h"
+
+const char *type_names[TRACE_NUM_TYPES] = {
+	[TRACE_DROPPED]		= "DROPPED",
+	[TRACE_CONN_OPEN]	= "CONN_OPEN",
+	[TRACE_CONN_CLOSE]	= "CONN_CLOSE",
+	[TRACE_CMD_SUBMIT]	= "CMD_SUBMIT",
+	[TRACE_RET_SUBMIT]	= "RET_SUBMIT",
+	[TRACE_CMD_UNLINK]	= "CMD_UNLINK",
+	[TRACE_RET_UNLINK]	= "RET_UNLINK",
+	[TRACE_EP_TIMER]	= "EP_TIMER",
+	[TRACE_EVDEV_CHECK]	= "EVDEV_CHECK",
+	[TRACE_EVDEV_WRITE]	= "EVDEV_WRITE",
+};
+
+struct trace_event *events;
+unsigned long num_events;
+
+int compare_events(const void *a, const void *b) {
+	const struct trace_event *x = *(const struct trace_event **)a;
+	const struct trace_event *y = *(const struct trace_event **)b;
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	// Keep the order within a thread for events with equal timestamps.
+	return x < y ? -1 : x > y;
+}
+
+/*----------------------------------------------------------------------*/
+
+// Submission times of requests that have not been answered yet, keyed by
+// connection and seqnum.
+
+#define PENDING_HASH_SIZE (1 << 16)
+
+struct pending {
+	bool used;
+	uint32_t id;
+	uint32_t seqnum;
+	uint64_t ts;
+};
+
+struct pending pending[PENDING_HASH_SIZE];
+
+struct pending *pending_lookup(uint32_t id, uint32_t seqnum, bool insert) {
+	unsigned int hash = (id * 0x9e3779b1u) ^ seqnum;
+	for (unsigned int i = 0; i < PENDING_HASH_SIZE; i++) {
+		struct pending *p =
+			&pending[(hash + i) & (PENDING_HASH_SIZE - 1)];
+		if (!p->used) {
+			if (!insert)
+				return NULL;
+			p->used = true;
+			p->id = id;
+			p->seqnum = seqnum;
+			return p;
+		}
+		if (p->id == id && p->seqnum == seqnum)
+			return p;
+	}
+	return NULL;
+}
+
+// Open addressing, so removal has to move later entries of the same
+// cluster back.
+void pending_remove(struct pending *p) {
+	unsigned int hole = p - &pending[0];
+	p->used = false;
+	for (unsigned int i = (hole + 1) & (PENDING_HASH_SIZE - 1);
+			pending[i].used; i = (i + 1) & (PENDING_HASH_SIZE - 1)) {
+		struct pending moved = pending[i];
+		pending[i].used = false;
+		struct pending *q = pending_lookup(moved.id, moved.seqnum, true);
+		q->ts = moved.ts;
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+struct latencies {
+	uint64_t *ns;
+	unsigned long count;
+	unsigned long size;
+};
+
+struct latencies submit_latencies;
+struct latencies unlink_latencies;
+
+void latencies_add(struct latencies *l, uint64_t ns) {
+	if (l->count == l->size) {
+		l->size = l->size ? l->size * 2 : 4096;
+		l->ns = realloc(l->ns, l->size * sizeof(l->ns[0]));
+		if (l->ns == NULL) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	l->ns[l->count++] = ns;
+}
+
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void latencies_print(const char *name, struct latencies *l) {
+	if (l->count == 0)
+		return;
+	qsort(l->ns, l->count, sizeof(l->ns[0]), compare_u64);
+	printf("%s latency: p50 %.1f us, p99 %.1f us, max %.1f us\n", name,
+		l->ns[l->count / 2] / 1000.0,
+		l->ns[l->count * 99 / 100] / 1000.0,
+		l->ns[l->count - 1] / 1000.0);
+}
+
+/*----------------------------------------------------------------------*/
+
+void print_event(struct trace_event *e, uint64_t start, long latency) {
+	printf("%12.6f %6u ", (e->ts - start) / 1e9, e->tid);
+	if (e->type < TRACE_NUM_TYPES && type_names[e->type] != NULL)
+		printf("%-11s", type_names[e->type]);
+	else
+		printf("type %-6u", e->type);
+
+	switch (e->type) {
+	case TRACE_DROPPED:
+		printf(" %d events", e->arg0);
+		break;
+	case TRACE_CONN_OPEN:
+		printf(" fd %u", e->id);
+		break;
+	case TRACE_CONN_CLOSE:
+		printf(" fd %u, %d URBs", e->id, e->arg0);
+		break;
+	case TRACE_CMD_SUBMIT:
+		printf(" fd %u, seqnum %u, ep %u %s, length %d", e->id,
+			e->seqnum, e->ep, e->arg1 ? "in" : "out", e->arg0);
+		if (e->ep == 0) {
+			printf(", setup");
+			for (int i = 0; i < 8; i++)
+				printf(" %02x", e->data[i]);
+		}
+		break;
+	case TRACE_RET_SUBMIT:
+		printf(" fd %u, seqnum %u, status %d, length %d", e->id,
+			e->seqnum, e->arg0, e->arg1);
+		if (e->arg1 > 0) {
+			printf(", data");
+			for (int i = 0; i < e->arg1 && i < 8; i++)
+				printf(" %02x", e->data[i]);
+		}
+		break;
+	case TRACE_CMD_UNLINK:
+		printf(" fd %u, seqnum %u, unlink %u", e->id, e->seqnum,
+			(uint32_t)e->arg0);
+		break;
+	case TRACE_RET_UNLINK:
+		printf(" fd %u, seqnum %u, status %d", e->id, e->seqnum,
+			e->arg0);
+		break;
+	case TRACE_EP_TIMER:
+		printf(" fd %u, ep %u, expirations %d, queued %d", e->id,
+			e->ep, e->arg0, e->arg1);
+		break;
+	case TRACE_EVDEV_CHECK:
+		printf(" event%u:%s%s%s", e->id,
+			(e->arg0 & TRACE_EVDEV_KEY) ? " EV_KEY" : "",
+			(e->arg0 & TRACE_EVDEV_SYSRQ) ? " KEY_SYSRQ" : "",
+			(e->arg0 & TRACE_EVDEV_SYN) ? " EV_SYN" : "");
+		break;
+	case TRACE_EVDEV_WRITE:
+		printf(" fd %u, type %u, code %d, value %d", e->id, e->ep,
+			e->arg0, e->arg1);
+		break;
+	}
+
+	if (latency >= 0)
+		printf(", latency %.1f us", latency / 1000.0);
+	printf("\n");
+}
+
+long match_reply(struct trace_event *e) {
+	struct pending *p;
+	switch (e->type) {
+	case TRACE_CMD_SUBMIT:
+	case TRACE_CMD_UNLINK:
+		p = pending_lookup(e->id, e->seqnum, true);
+		if (p == NULL) {
+			fprintf(stderr, "too many requests in flight\n");
+			exit(EXIT_FAILURE);
+		}
+		p->ts = e->ts;
+		return -1;
+	case TRACE_RET_SUBMIT:
+	case TRACE_RET_UNLINK:
+		p = pending_lookup(e->id, e->seqnum, false);
+		if (p == NULL)
+			return -1;
+		long latency = e->ts - p->ts;
+		pending_remove(p);
+		latencies_add(e->type == TRACE_RET_SUBMIT ?
+			&submit_latencies : &unlink_latencies, latency);
+		return latency;
+	case TRACE_CONN_CLOSE:
+		// The fd is about to be reused, forget what it left behind.
+		for (unsigned int i = 0; i < PENDING_HASH_SIZE; i++) {
+			while (pending[i].used && pending[i].id == e->id)
+				pending_remove(&pending[i]);
+		}
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+int main(int argc, char **argv) {
+	bool summary_only = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		switch (opt) {
+		case 's':
+			summary_only = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s] trace_file\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-s] trace_file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror("open()");
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("fstat()");
+		exit(EXIT_FAILURE);
+	}
+	if (st.st_size < sizeof(struct trace_file_header)) {
+		fprintf(stderr, "not a trace file\n");
+		exit(EXIT_FAILURE);
+	}
+	char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_file_header *header = (struct trace_file_header *)file;
+	if (memcmp(&header->magic[0], TRACE_MAGIC, sizeof(header->magic)) ||
+	    header->version != TRACE_VERSION ||
+	    header->event_size != sizeof(struct trace_event)) {
+		fprintf(stderr, "not a trace file or unsupported version\n");
+		exit(EXIT_FAILURE);
+	}
+
+	events = (struct trace_event *)(file + sizeof(*header));
+	num_events = (st.st_size - sizeof(*header)) /
+			sizeof(struct trace_event);
+
+	struct trace_event **sorted = calloc(num_events + 1, sizeof(*sorted));
+	if (sorted == NULL) {
+		perror("calloc()");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned long i = 0; i < num_events; i++)
+		sorted[i] = &events[i];
+	qsort(sorted, num_events, sizeof(*sorted), compare_events);
+
+	unsigned long counts[TRACE_NUM_TYPES];
+	memset(&counts[0], 0, sizeof(counts));
+	unsigned long dropped = 0;
+	uint64_t start = 0, end = 0;
+	for (unsigned long i = 0; i < num_events; i++) {
+		struct trace_event *e = sorted[i];
+		// Drop markers carry no time if nothing else was drained
+		// along with them.
+		if (e->ts != 0 && start == 0)
+			start = e->ts;
+		if (e->ts > end)
+			end = e->ts;
+		if (e->type < TRACE_NUM_TYPES)
+			counts[e->type]++;
+		if (e->type == TRACE_DROPPED)
+			dropped += e->arg0;
+
+		long latency = match_reply(e);
+		if (!summary_only)
+			print_event(e, e->ts ? start : e->ts, latency);
+	}
+
+	printf("%lu events in %.3f s", num_events, (end - start) / 1e9);
+	if (end > start)
+		printf(", %.0f events/s", num_events / ((end - start) / 1e9));
+	printf(", %lu dropped\n", dropped);
+	for (int type = 1; type < TRACE_NUM_TYPES; type++) {
+		if (counts[type] != 0)
+			printf("%-11s %lu\n", type_names[type], counts[type]);
+	}
+	latencies_print("submit", &submit_latencies);
+	latencies_print("unlink", &unlink_latencies);
+
+	return EXIT_SUCCESS;
+}
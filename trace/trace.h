@@ -0,0 +1,290 @@
+// Binary event tracing for keyboard.c and evdev-sysrq.c.
+//
+// Every thread that emits an event gets its own single-producer ring of
+// fixed-size binary records. A background thread drains all rings into
+// the file given to trace_start() every TRACE_DRAIN_MS, so emitting an
+// event is a clock read, a few stores and no syscalls. When a ring is
+// full the event is dropped and counted, the hot path never waits. Run
+// trace-decode on the file to get text back.
+//
+// Until trace_start() is called every trace_emit() is a single predicted
+// branch. Building with -DTRACE_DISABLED removes tracing altogether.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_MAGIC "UNLKTRC1"
+#define TRACE_VERSION 1
+
+enum trace_type {
+	TRACE_DROPPED,		// arg0: number of events lost by the thread
+	TRACE_CONN_OPEN,	// id: connection fd
+	TRACE_CONN_CLOSE,	// id: connection fd, arg0: URBs handled
+	TRACE_CMD_SUBMIT,	// arg0: buffer length, arg1: direction, data: setup
+	TRACE_RET_SUBMIT,	// arg0: status, arg1: actual length
+	TRACE_CMD_UNLINK,	// arg0: seqnum of the unlinked URB
+	TRACE_RET_UNLINK,	// arg0: status
+	TRACE_EP_TIMER,		// arg0: timer expirations, arg1: queued URBs
+	TRACE_EVDEV_CHECK,	// id: N of eventN, arg0: TRACE_EVDEV_* bits
+	TRACE_EVDEV_WRITE,	// id: fd, ep: type, arg0: code, arg1: value
+	TRACE_NUM_TYPES,
+};
+
+#define TRACE_EVDEV_KEY		(1 << 0)
+#define TRACE_EVDEV_SYSRQ	(1 << 1)
+#define TRACE_EVDEV_SYN		(1 << 2)
+
+struct trace_event {
+	uint64_t ts;		// CLOCK_MONOTONIC, ns
+	uint32_t tid;
+	uint16_t type;
+	uint16_t ep;
+	uint32_t id;
+	uint32_t seqnum;
+	int32_t arg0;
+	int32_t arg1;
+	uint8_t data[8];
+} __attribute__((packed));
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+} __attribute__((packed));
+
+#ifndef TRACE_DISABLED
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define TRACE_RING_SIZE 16384	// events, must be a power of two
+#define TRACE_DRAIN_MS 10
+
+struct trace_ring {
+	struct trace_event events[TRACE_RING_SIZE];
+	unsigned long head;	// written by the drain thread
+	char pad[64];
+	unsigned long tail;	// written by the owning thread
+	unsigned long dropped;
+	uint32_t tid;
+	struct trace_ring *next;
+};
+
+// Weak, so that every file of a program including this shares the state
+// and trace_start() in main() enables the events of all of them.
+bool trace_enabled __attribute__((weak));
+int trace_fd __attribute__((weak)) = -1;
+bool trace_stopping __attribute__((weak));
+bool trace_draining __attribute__((weak));
+pthread_t trace_thread __attribute__((weak));
+struct trace_ring *trace_rings __attribute__((weak));
+__thread struct trace_ring *trace_ring_self __attribute__((weak));
+
+static struct trace_ring *trace_ring_new(void) {
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	ring->tid = syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring,
+			true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return ring;
+}
+
+static void trace_emit_slow(uint16_t type, uint32_t id, uint32_t seqnum,
+			uint16_t ep, int32_t arg0, int32_t arg1,
+			const void *data, unsigned int len) {
+	struct trace_ring *ring = trace_ring_self;
+	if (ring == NULL) {
+		ring = trace_ring_self = trace_ring_new();
+		if (ring == NULL)
+			return;
+	}
+
+	unsigned long tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+			TRACE_RING_SIZE) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct trace_event *event = &ring->events[tail & (TRACE_RING_SIZE - 1)];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	event->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	event->tid = ring->tid;
+	event->type = type;
+	event->ep = ep;
+	event->id = id;
+	event->seqnum = seqnum;
+	event->arg0 = arg0;
+	event->arg1 = arg1;
+	memset(&event->data[0], 0, sizeof(event->data));
+	if (len > sizeof(event->data))
+		len = sizeof(event->data);
+	if (len > 0)
+		memcpy(&event->data[0], data, len);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline void trace_emit(uint16_t type, uint32_t id, uint32_t seqnum,
+			uint16_t ep, int32_t arg0, int32_t arg1,
+			const void *data, unsigned int len) {
+	if (__builtin_expect(trace_enabled, 0))
+		trace_emit_slow(type, id, seqnum, ep, arg0, arg1, data, len);
+}
+
+static void trace_drain_ring(struct trace_ring *ring) {
+	unsigned long head = ring->head;
+	unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head == tail &&
+	    __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) == 0)
+		return;
+
+	unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0,
+						__ATOMIC_RELAXED);
+	struct trace_event lost;
+	memset(&lost, 0, sizeof(lost));
+	lost.type = TRACE_DROPPED;
+	lost.tid = ring->tid;
+	lost.arg0 = dropped;
+
+	unsigned int first = head & (TRACE_RING_SIZE - 1);
+	unsigned int count = tail - head;
+	unsigned int chunk = TRACE_RING_SIZE - first;
+	if (chunk > count)
+		chunk = count;
+
+	struct iovec iov[3];
+	int iovcnt = 0;
+	iov[iovcnt].iov_base = &ring->events[first];
+	iov[iovcnt++].iov_len = chunk * sizeof(struct trace_event);
+	if (chunk < count) {
+		iov[iovcnt].iov_base = &ring->events[0];
+		iov[iovcnt++].iov_len = (count - chunk) *
+					sizeof(struct trace_event);
+	}
+	if (dropped != 0) {
+		if (count > 0)
+			lost.ts = ring->events[(tail - 1) &
+					(TRACE_RING_SIZE - 1)].ts;
+		iov[iovcnt].iov_base = &lost;
+		iov[iovcnt++].iov_len = sizeof(lost);
+	}
+	if (writev(trace_fd, &iov[0], iovcnt) < 0)
+		perror("writev(trace)");
+
+	__atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+}
+
+// Only one thread drains at a time: the drain thread, or the one
+// flushing at exit or from a signal handler.
+static void trace_drain(void) {
+	while (__atomic_exchange_n(&trace_draining, true, __ATOMIC_ACQUIRE))
+		;
+	struct trace_ring *ring = __atomic_load_n(&trace_rings,
+						__ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next)
+		trace_drain_ring(ring);
+	__atomic_store_n(&trace_draining, false, __ATOMIC_RELEASE);
+}
+
+static void *trace_thread_main(void *arg) {
+	struct timespec period = {
+		.tv_sec = 0,
+		.tv_nsec = TRACE_DRAIN_MS * 1000000L,
+	};
+	while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)) {
+		nanosleep(&period, NULL);
+		trace_drain();
+	}
+	return NULL;
+}
+
+// Flushes whatever is left in the rings. Called at exit, events emitted
+// after this are lost.
+static inline void trace_stop(void) {
+	if (!__atomic_exchange_n(&trace_enabled, false, __ATOMIC_ACQ_REL))
+		return;
+	__atomic_store_n(&trace_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(trace_thread, NULL);
+	trace_drain();
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+// The same for a handler of a signal that ends the process, which skips
+// atexit(). Only takes async-signal-safe steps. The drain thread has the
+// signals blocked, so the handler never waits for the thread it runs on.
+static inline void trace_flush_signal(void) {
+	if (!__atomic_exchange_n(&trace_enabled, false, __ATOMIC_ACQ_REL))
+		return;
+	trace_drain();
+}
+
+static inline void trace_start(const char *path) {
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0) {
+		perror("open(trace)");
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header.magic[0], TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.event_size = sizeof(struct trace_event);
+	if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+		perror("write(trace)");
+		exit(EXIT_FAILURE);
+	}
+
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	int rv = pthread_create(&trace_thread, NULL, trace_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (rv != 0) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(rv));
+		exit(EXIT_FAILURE);
+	}
+	trace_enabled = true;
+	atexit(trace_stop);
+}
+
+#else // TRACE_DISABLED
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline void trace_emit(uint16_t type, uint32_t id, uint32_t seqnum,
+			uint16_t ep, int32_t arg0, int32_t arg1,
+			const void *data, unsigned int len) {
+}
+
+static inline void trace_flush_signal(void) {
+}
+
+static inline void trace_start(const char *path) {
+	fprintf(stderr, "built with TRACE_DISABLED\n");
+	exit(EXIT_FAILURE);
+}
+
+#endif // TRACE_DISABLED
+
+#endif // TRACE_H